@@ -0,0 +1,282 @@
+/*
+ * _bluepy: bluepy-helper built into the Python process
+ *
+ * The helper's GLib main loop runs on a thread of its own. Commands are
+ * the binary frames btle.py would write to the helper's stdin; they are
+ * passed to the loop thread with an idle callback. Responses are queued
+ * per connection id as binary frames and turned into the same dictionaries
+ * as BluepyHelper.parseFrame() by whichever Python thread asks for them,
+ * so the loop thread never needs the GIL.
+ *
+ *   start(index)            start the helper for hci<index>, once
+ *   send(frame)             queue a command frame (u32 length, arguments)
+ *   get(cid[, timeout])     next response for connection cid; raises
+ *                           queue.Empty after timeout seconds
+ *   discard(cid)            drop responses queued for cid
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+#define MAX_CONNECTIONS 256
+
+/* How often a get() without a timeout checks for signals, in us */
+#define GET_POLL_US     100000
+
+void helper_run(int index);
+void helper_command(const uint8_t *frame, size_t flen);
+
+static GAsyncQueue *queues[MAX_CONNECTIONS];
+static int helper_index = -1;
+static PyObject *queue_empty;
+
+/* Called by resp_end() on the loop thread */
+void ext_resp(unsigned int cid, const uint8_t *frame, size_t len)
+{
+    GByteArray *resp;
+
+    if (cid >= MAX_CONNECTIONS)
+        return;
+
+    resp = g_byte_array_new();
+    g_byte_array_append(resp, frame, len);
+    g_async_queue_push(queues[cid], resp);
+}
+
+static gpointer helper_thread(gpointer user_data)
+{
+    helper_run(GPOINTER_TO_INT(user_data));
+    return NULL;
+}
+
+static gboolean command_idle(gpointer user_data)
+{
+    GByteArray *cmd = user_data;
+
+    helper_command(cmd->data, cmd->len);
+    g_byte_array_free(cmd, TRUE);
+    return FALSE;
+}
+
+static PyObject *bluepy_start(PyObject *self, PyObject *args)
+{
+    int index;
+
+    if (!PyArg_ParseTuple(args, "i", &index))
+        return NULL;
+
+    if (helper_index >= 0) {
+        if (index != helper_index) {
+            PyErr_Format(PyExc_ValueError,
+                         "in-process helper already serving hci%d", helper_index);
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+
+    helper_index = index;
+    g_thread_new("bluepy-helper", helper_thread, GINT_TO_POINTER(index));
+    Py_RETURN_NONE;
+}
+
+static PyObject *bluepy_send(PyObject *self, PyObject *args)
+{
+    const char *frame;
+    Py_ssize_t len;
+    GByteArray *cmd;
+
+    if (!PyArg_ParseTuple(args, "y#", &frame, &len))
+        return NULL;
+
+    if (helper_index < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "in-process helper not started");
+        return NULL;
+    }
+    if (len < 4 || (size_t) len - 4 != (frame[0] & 0xFF) +
+            ((frame[1] & 0xFF) << 8) + ((frame[2] & 0xFF) << 16) +
+            ((uint32_t) (frame[3] & 0xFF) << 24)) {
+        PyErr_SetString(PyExc_ValueError, "bad command frame");
+        return NULL;
+    }
+
+    cmd = g_byte_array_new();
+    g_byte_array_append(cmd, (const guint8 *) frame + 4, len - 4);
+    g_idle_add(command_idle, cmd);
+    Py_RETURN_NONE;
+}
+
+/* As BluepyHelper.parseFrame() */
+static PyObject *parse_frame(const uint8_t *frame, size_t flen)
+{
+    PyObject *resp = PyDict_New();
+    size_t pos = 0;
+
+    if (!resp)
+        return NULL;
+
+    while (pos < flen) {
+        PyObject *tag, *val, *list;
+        size_t taglen = frame[pos], vlen;
+        uint8_t type;
+
+        if (pos + 2 + taglen > flen)
+            goto bad;
+        tag = PyUnicode_DecodeUTF8((const char *) frame + pos + 1, taglen, "replace");
+        type = frame[pos + 1 + taglen];
+        pos += 2 + taglen;
+
+        if (type == 'h') {
+            if (!tag || pos + 4 > flen) {
+                Py_XDECREF(tag);
+                goto bad;
+            }
+            val = PyLong_FromUnsignedLong(frame[pos] | (frame[pos+1] << 8) |
+                            (frame[pos+2] << 16) | ((uint32_t) frame[pos+3] << 24));
+            pos += 4;
+        } else {
+            if (!tag || pos + 2 > flen) {
+                Py_XDECREF(tag);
+                goto bad;
+            }
+            vlen = frame[pos] | (frame[pos+1] << 8);
+            pos += 2;
+            if (pos + vlen > flen) {
+                Py_DECREF(tag);
+                goto bad;
+            }
+            if (type == 'b')
+                val = PyBytes_FromStringAndSize((const char *) frame + pos, vlen);
+            else
+                val = PyUnicode_DecodeUTF8((const char *) frame + pos, vlen, "replace");
+            pos += vlen;
+        }
+
+        if (!val) {
+            Py_DECREF(tag);
+            goto bad;
+        }
+
+        list = PyDict_GetItem(resp, tag);
+        if (list) {
+            PyList_Append(list, val);
+        } else {
+            list = PyList_New(1);
+            PyList_SET_ITEM(list, 0, val);
+            Py_INCREF(val);
+            PyDict_SetItem(resp, tag, list);
+            Py_DECREF(list);
+        }
+        Py_DECREF(val);
+        Py_DECREF(tag);
+    }
+
+    return resp;
+
+bad:
+    Py_DECREF(resp);
+    if (!PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError, "truncated response frame");
+    return NULL;
+}
+
+static PyObject *bluepy_get(PyObject *self, PyObject *args)
+{
+    unsigned int cid;
+    PyObject *timeout = Py_None;
+    GByteArray *resp = NULL;
+    gint64 end = 0, wait;
+    PyObject *rv;
+
+    if (!PyArg_ParseTuple(args, "I|O", &cid, &timeout))
+        return NULL;
+    if (cid >= MAX_CONNECTIONS) {
+        PyErr_SetString(PyExc_ValueError, "bad connection id");
+        return NULL;
+    }
+    if (timeout != Py_None) {
+        double t = PyFloat_AsDouble(timeout);
+
+        if (t == -1.0 && PyErr_Occurred())
+            return NULL;
+        end = g_get_monotonic_time() + (gint64) (t * 1e6);
+    }
+
+    /* Wait in slices, so that Ctrl-C is seen */
+    while (!resp) {
+        wait = GET_POLL_US;
+        if (timeout != Py_None) {
+            wait = MIN(wait, end - g_get_monotonic_time());
+            if (wait < 0)
+                wait = 0;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        resp = g_async_queue_timeout_pop(queues[cid], wait);
+        Py_END_ALLOW_THREADS
+
+        if (resp)
+            break;
+        if (PyErr_CheckSignals() < 0)
+            return NULL;
+        if (timeout != Py_None && g_get_monotonic_time() >= end) {
+            PyErr_SetNone(queue_empty);
+            return NULL;
+        }
+    }
+
+    rv = parse_frame(resp->data, resp->len);
+    g_byte_array_free(resp, TRUE);
+    return rv;
+}
+
+static PyObject *bluepy_discard(PyObject *self, PyObject *args)
+{
+    unsigned int cid;
+    GByteArray *resp;
+
+    if (!PyArg_ParseTuple(args, "I", &cid))
+        return NULL;
+    if (cid >= MAX_CONNECTIONS) {
+        PyErr_SetString(PyExc_ValueError, "bad connection id");
+        return NULL;
+    }
+
+    while ((resp = g_async_queue_try_pop(queues[cid])) != NULL)
+        g_byte_array_free(resp, TRUE);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef bluepy_methods[] = {
+    { "start", bluepy_start, METH_VARARGS, "Start the helper for an interface" },
+    { "send", bluepy_send, METH_VARARGS, "Send a command frame" },
+    { "get", bluepy_get, METH_VARARGS, "Get the next response for a connection" },
+    { "discard", bluepy_discard, METH_VARARGS, "Drop queued responses" },
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef bluepy_module = {
+    PyModuleDef_HEAD_INIT, "_bluepy", "bluepy-helper running in-process",
+    -1, bluepy_methods
+};
+
+PyMODINIT_FUNC PyInit__bluepy(void)
+{
+    PyObject *queue;
+    int i;
+
+    queue = PyImport_ImportModule("queue");
+    if (!queue)
+        return NULL;
+    queue_empty = PyObject_GetAttrString(queue, "Empty");
+    Py_DECREF(queue);
+    if (!queue_empty)
+        return NULL;
+
+    for (i = 0; i < MAX_CONNECTIONS; i++)
+        queues[i] = g_async_queue_new();
+
+    return PyModule_Create(&bluepy_module);
+}
@@ -0,0 +1,482 @@
+"""asyncio interface to bluepy-helper
+
+One AsyncHelper process carries the connections of any number of
+AsyncPeripheral and AsyncScanner objects. Its output is read by a task on
+the event loop, which routes each response to its connection by the 'cid'
+tag, so there is no reader thread and no blocking call.
+"""
+import asyncio
+import struct
+import subprocess
+
+from . import btle
+from .btle import (BluepyHelper, Peripheral, Scanner, UUID, BTLEException,
+                   BTLEInternalError, BTLEManagementError, BTLEGattError,
+                   BTLEDisconnectError, ADDR_TYPE_PUBLIC, ADDR_TYPE_RANDOM,
+                   BIN_FRAME_START, MAX_CONNECTIONS, DBG, buildServiceTree)
+
+
+class AsyncHelper:
+    """A bluepy-helper process driven from an asyncio event loop"""
+    def __init__(self, iface=None):
+        self.iface = iface
+        self._proc = None
+        self._stdin = None
+        self._stdout = None
+        self._reader = None
+        self._binary = False
+        self._channels = {}
+        self._nextCid = 1
+        self._control = None
+
+    async def __aenter__(self):
+        await self.start()
+        return self
+
+    async def __aexit__(self, type, value, traceback):
+        await self.close()
+
+    async def start(self):
+        if self._stdin is not None:
+            return
+        path = btle.daemonPath(self.iface)
+        if path is not None:
+            try:
+                (self._stdout, self._stdin) = await asyncio.open_unix_connection(path)
+                DBG("Using daemon at ", path)
+            except OSError:
+                pass        # Left behind by a daemon no longer running
+        if self._stdin is None:
+            DBG("Running ", btle.helperExe)
+            args = [btle.helperExe]
+            if self.iface is not None:
+                args.append(str(self.iface))
+            self._proc = await asyncio.create_subprocess_exec(*args,
+                                                              stdin=subprocess.PIPE,
+                                                              stdout=subprocess.PIPE,
+                                                              stderr=subprocess.DEVNULL,
+                                                              preexec_fn=btle.preexec_function)
+            (self._stdout, self._stdin) = (self._proc.stdout, self._proc.stdin)
+        self._reader = asyncio.ensure_future(self._readResponses())
+        # Connection 0 carries the helper's own commands
+        self._control = _AsyncChannel(self)
+        self._control._cid = 0
+        self._channels[0] = self._control
+        if btle.UseBinaryProtocol:
+            self._control._sendCmd("proto", "bin")
+            try:
+                rsp = await self._control._waitResp('proto')
+            except BTLEException:
+                return      # Older helper: stay with the text protocol
+            self._binary = (rsp is not None and rsp['proto'][0] == 'bin')
+
+    async def close(self):
+        if self._stdin is None:
+            return
+        DBG("Stopping ", btle.helperExe)
+        if not self._stdin.is_closing():
+            # A daemon ends the session, a helper process exits
+            self._control._sendCmd("quit")
+        if self._proc is not None:
+            await self._proc.wait()
+            self._proc = None
+        else:
+            self._stdin.close()
+        self._stdin = None
+        if self._reader is not None:
+            await self._reader
+            self._reader = None
+
+    async def _readResponses(self):
+        stdout = self._stdout
+        try:
+            while True:
+                first = await stdout.read(1)
+                if not first:               # EOF
+                    break
+                if first == BIN_FRAME_START:
+                    hdr = await stdout.readexactly(4)
+                    frame = await stdout.readexactly(struct.unpack('<I', hdr)[0])
+                    resp = BluepyHelper.parseFrame(frame)
+                else:
+                    line = (first + await stdout.readline()).decode('utf-8', 'replace')
+                    if line.startswith('#') or len(line.strip()) == 0:
+                        continue
+                    resp = BluepyHelper.parseResp(line)
+                DBG("Got:", repr(resp))
+                channel = self._channels.get(resp.get('cid', [0])[0])
+                if channel is not None:
+                    channel._deliver(resp)
+        except asyncio.IncompleteReadError:
+            pass
+        finally:
+            # Wake anyone still waiting: the helper has gone
+            for channel in list(self._channels.values()):
+                channel._deliver(None)
+
+    def _attach(self, channel):
+        # Round robin, so late responses for an id just given up go nowhere
+        for i in range(MAX_CONNECTIONS - 1):
+            cid = (self._nextCid + i - 1) % (MAX_CONNECTIONS - 1) + 1
+            if cid not in self._channels:
+                self._channels[cid] = channel
+                self._nextCid = cid % (MAX_CONNECTIONS - 1) + 1
+                return cid
+        raise BTLEInternalError("No free connections in helper")
+
+    def _detach(self, cid):
+        self._channels.pop(cid, None)
+        # The helper may still be connecting (say after a timeout)
+        if self._stdin is not None and not self._stdin.is_closing():
+            args = ("@%x" % cid, "disc")
+            self._writeCmd(BluepyHelper.encodeCmd(args) if self._binary
+                           else BluepyHelper.formatCmd(args))
+
+    def _writeCmd(self, cmd):
+        if self._stdin is None or self._stdin.is_closing():
+            raise BTLEInternalError("Helper not running")
+        DBG("Sent: ", repr(cmd))
+        if not isinstance(cmd, bytes):
+            cmd = cmd.encode('utf-8')
+        self._stdin.write(cmd)
+
+
+class _AsyncChannel(BluepyHelper):
+    """One connection id on an AsyncHelper; responses for it are queued
+       by the helper's reader task"""
+    def __init__(self, helper=None):
+        BluepyHelper.__init__(self)
+        self._aio = helper
+        self._ownHelper = False
+        self._respq = None
+        self._lock = None
+        self.delegate = None
+
+    async def _startHelper(self, iface=None):
+        if self._cid is not None:
+            return
+        if self._aio is None:
+            self._aio = AsyncHelper(iface)
+            self._ownHelper = True
+        await self._aio.start()
+        self._lock = asyncio.Lock()
+        self._cid = self._aio._attach(self)
+        self._helper = self._aio
+
+    def _stopHelper(self):
+        # Called from _checkResp() on a disconnection, so not a coroutine
+        if self._cid is not None:
+            self._aio._detach(self._cid)
+            self._cid = None
+            self._helper = None
+        if self._ownHelper and self._aio is not None:
+            asyncio.ensure_future(self._aio.close())
+            self._aio = None
+            self._ownHelper = False
+
+    def _writeCmd(self, cmd):
+        if self._aio is None:
+            raise BTLEInternalError("Helper not started (did you call connect()?)")
+        self._aio._writeCmd(cmd)
+
+    def _sendCmd(self, *args):
+        self._binary = self._aio._binary if self._aio is not None else False
+        if self._cid is None:
+            raise BTLEInternalError("Helper not started (did you call connect()?)")
+        BluepyHelper._sendCmd(self, *args)
+
+    def _queue(self):
+        if self._respq is None:
+            self._respq = asyncio.Queue()
+        return self._respq
+
+    def _deliver(self, resp):
+        self._queue().put_nowait(resp)
+
+    async def _waitResp(self, wantType, timeout=None):
+        if not isinstance(wantType, list):
+            wantType = [wantType]
+        while True:
+            try:
+                resp = await asyncio.wait_for(self._queue().get(), timeout)
+            except asyncio.TimeoutError:
+                return None
+            if resp is None:
+                raise BTLEInternalError("Helper exited")
+            if self._checkResp(resp, wantType):
+                return resp
+
+    async def _command(self, wantType, *args, **kwargs):
+        # One command at a time per connection, as responses are matched
+        # to commands by their order
+        async with self._lock:
+            self._sendCmd(*args)
+            return await self._waitResp(wantType, kwargs.get('timeout'))
+
+    async def _mgmtCmd(self, *args):
+        rsp = await self._command('mgmt', *args)
+        if rsp['code'][0] != 'success':
+            raise BTLEManagementError("Failed to execute management command '%s'" % (" ".join(str(a) for a in args)), rsp)
+
+    async def status(self):
+        return await self._command('stat', "stat")
+
+
+class AsyncPeripheral(_AsyncChannel):
+    """Connection to a peripheral, with awaitable GATT operations"""
+    def __init__(self, helper=None):
+        _AsyncChannel.__init__(self, helper)
+        self._serviceMap = None
+        self._handlers = {}
+        self._notifyq = None
+        self.linkInfo = {}
+        (self.addr, self.addrType, self.iface) = (None, None, None)
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, type, value, traceback):
+        await self.disconnect()
+
+    async def connect(self, addr, addrType=ADDR_TYPE_PUBLIC, iface=None, timeout=None, linkParams=None):
+        if isinstance(addr, btle.ScanEntry):
+            (addr, addrType, iface) = (addr.addr, addr.addrType, addr.iface)
+        if len(addr.split(":")) != 6:
+            raise ValueError("Expected MAC address, got %s" % repr(addr))
+        if addrType not in (ADDR_TYPE_PUBLIC, ADDR_TYPE_RANDOM):
+            raise ValueError("Expected address type public or random, got {}".format(addrType))
+        await self._startHelper(iface)
+        (self.addr, self.addrType, self.iface) = (addr, addrType, iface)
+        self._notifyq = asyncio.Queue()
+        if linkParams:
+            rsp = await self._command('mgmt', *Peripheral.linkCmd(linkParams))
+            if rsp['code'][0] != 'success':
+                raise BTLEManagementError("Bad link parameters %s" % repr(linkParams), rsp)
+        async with self._lock:
+            if iface is not None:
+                self._sendCmd("conn", addr, addrType, "hci"+str(iface))
+            else:
+                self._sendCmd("conn", addr, addrType)
+            rsp = await self._waitResp('stat', timeout)
+            while rsp and rsp['state'][0] == 'tryconn':
+                rsp = await self._waitResp('stat', timeout)
+        if rsp is None or rsp['state'][0] != 'conn':
+            self._stopHelper()
+            if rsp is None:
+                raise BTLEDisconnectError("Timed out while trying to connect to peripheral %s, addr type: %s" %
+                                          (addr, addrType), rsp)
+            raise BTLEDisconnectError("Failed to connect to peripheral %s, addr type: %s"
+                                      % (addr, addrType), rsp)
+        self.linkInfo = Peripheral.parseLinkInfo(rsp, linkParams)
+        return self
+
+    async def disconnect(self):
+        if self._cid is None:
+            return
+        try:
+            await self._command('stat', "disc")
+        except BTLEException:
+            pass
+        self._stopHelper()
+
+    def _deliver(self, resp):
+        # Notifications and indications are never the answer to a command
+        if resp is not None and resp['rsp'][0] in ('ntfy', 'ind'):
+            self._dispatchNotification(resp['hnd'][0], resp['d'][0])
+            return
+        # A disconnection (or the helper exiting) with no command waiting
+        # would sit in the queue; it ends notifications() instead
+        if not self._lock.locked() and (resp is None or
+                (resp['rsp'][0] == 'stat' and resp['state'][0] == 'disc')):
+            self._stopHelper()
+            return
+        _AsyncChannel._deliver(self, resp)
+
+    def setNotificationHandler(self, handle, callback, fmt=None):
+        return Peripheral.setNotificationHandler(self, handle, callback, fmt)
+
+    def _dispatchNotification(self, hnd, data):
+        handler = self._handlers.get(hnd)
+        if handler is not None:
+            (callback, decoder) = handler
+            if decoder is None:
+                return callback(hnd, data)
+            try:
+                values = Peripheral._decodeNotification(hnd, decoder, data)
+            except BTLEGattError as e:
+                # Raising would stop the task reading the helper's output
+                asyncio.get_event_loop().call_exception_handler(
+                    {'message': str(e), 'exception': e})
+                return
+            return callback(hnd, values)
+        if self._notifyq is not None:
+            self._notifyq.put_nowait((hnd, data))
+
+    async def notifications(self):
+        """Async iterator over (handle, data) for notifications and
+           indications which have no handler"""
+        while self._cid is not None:
+            (hnd, data) = await self._notifyq.get()
+            if hnd is None:
+                break
+            yield (hnd, data)
+
+    def _stopHelper(self):
+        _AsyncChannel._stopHelper(self)
+        if self._notifyq is not None:
+            self._notifyq.put_nowait((None, None))
+
+    async def discoverAll(self):
+        rsp = await self._command('tree', "tree")
+        self._serviceMap = buildServiceTree(self, rsp)
+        return self._serviceMap
+
+    async def getServices(self):
+        if self._serviceMap is None:
+            await self.discoverAll()
+        return self._serviceMap.values()
+
+    async def getServiceByUUID(self, uuidVal):
+        uuid = UUID(uuidVal)
+        if self._serviceMap is None:
+            await self.discoverAll()
+        if uuid not in self._serviceMap:
+            raise BTLEGattError("Service %s not found" % (uuid.getCommonName()))
+        return self._serviceMap[uuid]
+
+    async def readCharacteristic(self, handle, timeout=None):
+        rsp = await self._command('rd', "rd", handle, timeout=timeout)
+        return None if rsp is None else rsp['d'][0]
+
+    async def writeCharacteristic(self, handle, val, withResponse=False, timeout=None):
+        cmd = "wrr" if withResponse else "wr"
+        return await self._command('wr', cmd, handle, bytes(val), timeout=timeout)
+
+    async def batch(self, ops, timeout=None):
+        args = ["batch"]
+        for op in ops:
+            if op[0] == "rd":
+                args += ["rd", op[1]]
+            elif op[0] in ("wr", "wrr"):
+                args += [op[0], op[1], bytes(op[2])]
+            else:
+                raise ValueError("Unknown batch operation %s" % repr(op[0]))
+        resp = await self._command('batch', *args, timeout=timeout)
+        if resp is None:
+            return None
+        for (hnd, estat) in zip(resp['hnd'], resp['estat']):
+            if estat != 0:
+                raise BTLEGattError("Batch operation on handle 0x%X failed" % hnd,
+                                    {'estat': [estat]})
+        return [ (resp['d'][i] if ops[i][0] == "rd" else None)
+                 for i in range(len(ops)) ]
+
+    async def _subscribe(self, mode, handles, timeout):
+        handles = list(handles)
+        if not handles:
+            return {}
+        resp = await self._command('sub', "sub", mode, *handles, timeout=timeout)
+        if resp is None:
+            return None
+        for (hnd, estat) in zip(resp['hnd'], resp['estat']):
+            if estat != 0:
+                raise BTLEGattError("Cannot configure notifications for handle 0x%X" % hnd,
+                                    {'estat': [estat]})
+        return dict(zip(resp['hnd'], resp['dhnd']))
+
+    async def subscribe(self, handles, indicate=False, timeout=None):
+        return await self._subscribe("ind" if indicate else "ntfy", handles, timeout)
+
+    async def unsubscribe(self, handles, timeout=None):
+        return await self._subscribe("off", handles, timeout)
+
+    async def setMTU(self, mtu):
+        return await self._command('stat', "mtu", "%x" % mtu)
+
+
+class AsyncScanner(_AsyncChannel):
+    """Scanner whose results are awaited; configure it with the same
+       setWhiteList(), setScanFilter(), setDuplicateFilter() and
+       setIdentityKeys() calls as Scanner, before start()"""
+    def __init__(self, iface=0, helper=None):
+        _AsyncChannel.__init__(self, helper)
+        self.iface = iface
+        self._config = Scanner(iface)
+        self.scanned = self._config.scanned
+        self._scanning = False
+
+    def setWhiteList(self, devices=None):
+        self._config.setWhiteList(devices)
+
+    def setScanFilter(self, *args, **kwargs):
+        self._config.setScanFilter(*args, **kwargs)
+
+    def setDuplicateFilter(self, *args, **kwargs):
+        self._config.setDuplicateFilter(*args, **kwargs)
+
+    def setIdentityKeys(self, keys=None):
+        self._config.setIdentityKeys(keys)
+
+    def clear(self):
+        self._config.scanned = self.scanned = {}
+
+    async def start(self, passive=False, **params):
+        await self._startHelper(self.iface)
+        try:
+            for args in self._config._setupCmds(passive, **params):
+                await self._mgmtCmd(*args)
+            cmd = self._config._cmd()
+            rsp = await self._command('mgmt', cmd)
+            if rsp["code"][0] == "busy":
+                # Sometimes previous scan still ongoing
+                await self._mgmtCmd(cmd + "end")
+                async with self._lock:
+                    await self._waitResp("stat")
+                await self._mgmtCmd(cmd)
+            elif rsp["code"][0] != "success":
+                raise BTLEManagementError("Failed to start scan", rsp)
+        except BTLEException:
+            self._stopHelper()
+            raise
+        self._scanning = True
+
+    async def stop(self):
+        if self._scanning:
+            self._scanning = False
+            await self._mgmtCmd(self._config._cmd() + "end")
+        self._stopHelper()
+
+    async def discoveries(self, timeout=None):
+        """Async iterator over (ScanEntry, isNewDev, isNewData) as
+           advertisements arrive, ending after timeout seconds if given"""
+        loop = asyncio.get_event_loop()
+        end = None if timeout is None else loop.time() + timeout
+        while self._scanning:
+            remain = None
+            if end is not None:
+                remain = end - loop.time()
+                if remain <= 0:
+                    break
+            resp = await self._waitResp(['scan', 'stat'], remain)
+            if resp is None:
+                break
+            if resp['rsp'][0] == 'stat':
+                # if scan ended, restart it
+                if resp['state'][0] == 'disc':
+                    await self._mgmtCmd(self._config._cmd())
+                continue
+            for report in Scanner.splitScanResp(resp):
+                yield self._config._addReport(report)
+
+    def getDevices(self):
+        return self.scanned.values()
+
+    async def scan(self, timeout=10, passive=False, **params):
+        self.clear()
+        await self.start(passive=passive, **params)
+        try:
+            async for result in self.discoveries(timeout):
+                pass
+        finally:
+            await self.stop()
+        return self.getDevices()
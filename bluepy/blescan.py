@@ -24,6 +24,7 @@ else:
 
 
 def dump_services(dev):
+    dev.discoverAll()
     services = sorted(dev.services, key=lambda s: s.hndStart)
     for s in services:
         print ("\t%04x: %s" % (s.hndStart, s))
@@ -117,6 +118,9 @@ def main():
     btle.Debugging = arg.verbose
 
     scanner = btle.Scanner(arg.hci).withDelegate(ScanPrint(arg))
+    if arg.sensitivity > -128:
+        # Have the helper drop far devices before they reach us
+        scanner.setScanFilter(minRSSI=arg.sensitivity)
 
     print (ANSI_RED + "Scanning for devices..." + ANSI_OFF)
     devices = scanner.scan(arg.timeout)
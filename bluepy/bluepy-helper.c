@@ -26,10 +26,18 @@
 #endif
 
 #include <string.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <glib.h>
 
 
@@ -38,6 +46,13 @@
 #include "lib/uuid.h"
 #include "lib/mgmt.h"
 #include "src/shared/mgmt.h"
+#include "src/shared/att.h"
+#include "src/shared/io.h"
+#include "src/shared/timeout.h"
+#include "src/shared/crypto.h"
+#ifdef BLUEPY_MAINLOOP
+#include "src/shared/mainloop.h"
+#endif
 
 #include <btio/btio.h>
 #include "att.h"
@@ -49,7 +64,7 @@
 #define IO_CAPABILITY_NOINPUTNOOUTPUT   0x03
 
 #ifdef BLUEPY_DEBUG
-#define DBG(fmt, ...) do {printf("# %s() :" fmt "\n", __FUNCTION__, ##__VA_ARGS__); fflush(stdout); \
+#define DBG(fmt, ...) do {helper_comment("# %s() :" fmt "\n", __FUNCTION__, ##__VA_ARGS__); fflush(stdout); \
     } while(0)
 #else
 #ifdef BLUEPY_DEBUG_FILE_LOG
@@ -68,40 +83,257 @@ static void try_open(void) {
 #endif
 #endif
 
-static GIOChannel *iochannel = NULL;
-static GAttrib *attrib = NULL;
+#ifdef BLUEPY_EXTENSION
+/* Built into the _bluepy Python module (see _bluepy.c) rather than run as
+ * a process: responses are handed over as binary frames */
+void ext_resp(unsigned int cid, const uint8_t *frame, size_t len);
+#endif
+
+/* Comment lines ("# ...") in the output, which clients skip. The extension
+ * has no output of its own, as stdout belongs to the host program. */
+static void helper_comment(const char *fmt, ...) G_GNUC_PRINTF(1, 2);
+
+static void helper_comment(const char *fmt, ...)
+{
+#ifndef BLUEPY_EXTENSION
+    va_list ap;
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+#endif
+}
+
+/* Watches and timers go through src/shared/io.h and timeout.h, so only
+ * the loop itself differs between the GLib build and the one on
+ * src/shared/mainloop.c ("make MAINLOOP=epoll") */
+#ifdef BLUEPY_MAINLOOP
+#ifdef BLUEPY_EXTENSION
+#error "the extension runs GLib's main loop"
+#endif
+
+static void loop_init(void)
+{
+    mainloop_init();
+}
+
+static void loop_run(void)
+{
+    mainloop_run();
+}
+
+static void loop_quit(void)
+{
+    mainloop_quit();
+}
+#else
 static GMainLoop *event_loop;
 
-static gchar *opt_src = NULL;
-static gchar *opt_dst = NULL;
-static gchar *opt_dst_type = NULL;
-static gchar *opt_sec_level = NULL;
+static void loop_init(void)
+{
+    event_loop = g_main_loop_new(NULL, FALSE);
+}
+
+static void loop_run(void)
+{
+    g_main_loop_run(event_loop);
+    g_main_loop_unref(event_loop);
+    event_loop = NULL;
+}
+
+#ifndef BLUEPY_EXTENSION
+static void loop_quit(void)
+{
+    if (event_loop)
+        g_main_loop_quit(event_loop);
+}
+#endif
+#endif
+
 static const int opt_psm = 0;
-static int opt_mtu = 0;
 static int start;
 static int end;
 
 static uint16_t mgmt_ind = MGMT_INDEX_NONE;
 static struct mgmt *mgmt_master = NULL;
 
-static int hci_dd = -1;
-static GIOChannel *hci_io = NULL;
-
 struct characteristic_data {
+    struct conn *conn;
     uint16_t orig_start;
     uint16_t start;
     uint16_t end;
     bt_uuid_t uuid;
+    GSList *lists;  /* Decoded Read By Type responses, newest first */
 };
 
 static void cmd_help(int argcp, char **argvp);
+static void link_apply(struct conn *conn);
+static void hci_cancel(void *user_data);
 
-static enum state {
+enum state {
     STATE_DISCONNECTED=0,
     STATE_CONNECTING=1,
     STATE_CONNECTED=2,
     STATE_SCANNING=3,
-} conn_state;
+};
+
+enum proto {
+    PROTO_TEXT=0,
+    PROTO_BINARY=1,
+};
+
+/* One helper serves many links. Commands select a connection with a
+ * leading "@<hex id>" argument (default 0), and every response carries
+ * the id of the connection it belongs to. Entries are created on first
+ * use and kept for the lifetime of the helper, so callbacks may safely
+ * hold on to them.
+ */
+#define MAX_CONNECTIONS 256
+
+struct ring;
+struct session;
+
+/* A Write Without Response stream, fed to bt_att as the socket drains */
+struct write_stream {
+    struct conn *conn;
+    uint16_t handle;
+    uint8_t *data;
+    size_t len;
+    size_t queued;      /* Bytes handed to bt_att */
+    size_t sent;        /* Bytes written to the socket */
+    size_t chunk;       /* ATT_MTU - 3 when the stream started */
+    int inflight;
+    guint8 status;
+};
+
+#define STREAM_WINDOW   8   /* Chunks queued in bt_att at any time */
+
+/* Link settings requested with "link" for the next connection; zero
+ * fields are left as the controller chose them */
+struct link_profile {
+    uint16_t mtu;
+    uint16_t dle;           /* LE Data Length: max TX octets */
+    uint8_t phys;           /* Preferred PHYs, LE Set PHY bit mask */
+    uint16_t interval;      /* 1.25 ms units */
+    uint16_t latency;
+    uint16_t timeout;       /* 10 ms units */
+};
+
+struct conn {
+    unsigned int id;
+    GIOChannel *iochannel;
+    GAttrib *attrib;
+    gchar *src;
+    gchar *dst;
+    gchar *dst_type;
+    gchar *sec_level;
+    int mtu;
+    enum state state;
+    struct ring *ring;
+    struct write_stream *wstream;
+    struct link_profile link;       /* Requested */
+    struct link_profile granted;    /* As reported by the controller */
+    uint8_t rx_phy;
+    int hci_index;                  /* Adapter and handle of the link, */
+    uint16_t handle;                /* for the HCI link profile steps */
+    struct session *session;        /* Daemon client using it, if any */
+    unsigned int cid;               /* Id that client knows it by */
+    unsigned int disc_id;           /* bt_att disconnect registration */
+    unsigned int disc_idle;         /* Pending disconnect_io() */
+};
+
+static struct conn *conns[MAX_CONNECTIONS];
+
+/* Connection the command or callback being handled refers to */
+static struct conn *cur_conn = NULL;
+
+/* Connection which receives scan results */
+static struct conn *scan_conn = NULL;
+
+/* Daemon mode ("-s <path>"): the helper listens on a Unix socket rather
+ * than reading stdin, and each client connected to it is a session. A
+ * session has its own framing and its own connection ids, which are
+ * mapped to free entries in conns[]; entry 0 is kept for the shared scan.
+ */
+struct session {
+    struct io *io;
+    enum proto proto;
+    GByteArray *cmd_buf;
+    GByteArray *out;                /* Responses not yet written */
+    gboolean writing;               /* Waiting for the socket to drain */
+    gboolean closing;
+    unsigned int close_idle;
+    struct conn *conns[MAX_CONNECTIONS];
+};
+
+static const char *daemon_path = NULL;
+
+/* Session whose command is being dispatched */
+static struct session *cur_session = NULL;
+
+/* Connections of the sessions sharing the scan */
+static GSList *scan_subs = NULL;
+
+static struct conn *conn_get(unsigned int id)
+{
+    struct conn *conn;
+
+    if (id >= MAX_CONNECTIONS)
+        return NULL;
+
+    if (conns[id])
+        return conns[id];
+
+    conn = g_new0(struct conn, 1);
+    conn->id = id;
+    conn->dst_type = g_strdup("public");
+    conn->sec_level = g_strdup("low");
+    conn->state = STATE_DISCONNECTED;
+    conn->cid = id;
+    conns[id] = conn;
+
+    return conn;
+}
+
+/* The entry for a session's connection id, taking a free one on first use */
+static struct conn *session_conn(struct session *s, unsigned int cid)
+{
+    struct conn *conn;
+    unsigned int id;
+
+    if (cid >= MAX_CONNECTIONS)
+        return NULL;
+
+    if (s->conns[cid])
+        return s->conns[cid];
+
+    for (id = 1; id < MAX_CONNECTIONS; id++)
+        if (!conns[id] || (!conns[id]->session &&
+                                conns[id]->state == STATE_DISCONNECTED))
+            break;
+    if (id == MAX_CONNECTIONS)
+        return NULL;
+
+    /* Nothing of a previous client's link is carried over */
+    conn = conn_get(id);
+    g_free(conn->dst);
+    conn->dst = NULL;
+    g_free(conn->dst_type);
+    conn->dst_type = g_strdup("public");
+    g_free(conn->sec_level);
+    conn->sec_level = g_strdup("low");
+    conn->mtu = 0;
+    conn->session = s;
+    conn->cid = cid;
+    s->conns[cid] = conn;
+
+    return conn;
+}
+
+static struct conn *client_conn(unsigned int cid)
+{
+    return cur_session ? session_conn(cur_session, cid) : conn_get(cid);
+}
 
 
 static const char
@@ -123,7 +355,21 @@ static const char
   *tag_ADDR       = "addr",
   *tag_TYPE       = "type",
   *tag_RSSI       = "rssi",
-  *tag_FLAG       = "flag";
+  *tag_FLAG       = "flag",
+  *tag_PROTO      = "proto",
+  *tag_CONN       = "cid",
+  *tag_CHAR_UUID  = "cuuid",
+  *tag_DESC_HANDLE = "dhnd",
+  *tag_DESC_UUID  = "duuid",
+  *tag_LENGTH     = "len",
+  *tag_DATA_LEN   = "dle",
+  *tag_TX_PHY     = "txphy",
+  *tag_RX_PHY     = "rxphy",
+  *tag_INTERVAL   = "intv",
+  *tag_LATENCY    = "lat",
+  *tag_TIMEOUT    = "tmo",
+  *tag_IDENTITY   = "id",
+  *tag_ID_TYPE    = "idtype";
 
 static const char
   *rsp_ERROR     = "err",
@@ -136,7 +382,13 @@ static const char
   *rsp_WRITE     = "wr",
   *rsp_MGMT      = "mgmt",
   *rsp_SCAN      = "scan",
-  *rsp_OOB       = "oob";
+  *rsp_OOB       = "oob",
+  *rsp_PROTO     = "proto",
+  *rsp_BATCH     = "batch",
+  *rsp_RING      = "ring",
+  *rsp_TREE      = "tree",
+  *rsp_WRITE_STREAM = "wrs",
+  *rsp_SUBSCRIBE = "sub";
 
 static const char
   *err_CONN_FAIL = "connfail",
@@ -162,48 +414,188 @@ static const char
 // delimits fields in response message
 #define RESP_DELIM "\x1e"
 
+/* Binary framing (negotiated with "proto bin"):
+ *
+ *   response : BIN_FRAME_START, u32 length, fields...
+ *   field    : u8 taglen, tag, u8 type, value
+ *   value    : 'h' -> u32, '$' / '\'' / 'b' -> u16 length + raw bytes
+ *   command  : u32 length, then per argument u16 length + raw bytes
+ *
+ * All integers are little-endian. Comment lines ("# ...") are still
+ * written as text, so readers distinguish them by the first byte.
+ */
+#define BIN_FRAME_START 0x02
+
+static enum proto proto_mode;
+
+/* Responses are built in memory and written out by resp_end(). A daemon
+ * builds each one in both framings, as it may go to clients using either,
+ * and leaves out the connection id until it knows who it is going to.
+ */
+#ifdef BLUEPY_EXTENSION
+#define RESP_BINARY 1
+#define RESP_TEXT   0
+#else
+#define RESP_BINARY (daemon_path || proto_mode == PROTO_BINARY)
+#define RESP_TEXT   (daemon_path || proto_mode == PROTO_TEXT)
+#endif
+
+static GByteArray *bin_resp = NULL;
+static GString *text_resp = NULL;
+static const char *resp_type;
+static guint bin_cid_pos, text_cid_pos;
+
+/* Argument lengths of the binary command being dispatched, NULL for text */
+static gsize *cmd_arglen = NULL;
+
+static void bin_put_le16(uint16_t val)
+{
+  uint8_t buf[2];
+
+  bt_put_le16(val, buf);
+  g_byte_array_append(bin_resp, buf, sizeof(buf));
+}
+
+static void bin_put_le32(uint32_t val)
+{
+  uint8_t buf[4];
+
+  bt_put_le32(val, buf);
+  g_byte_array_append(bin_resp, buf, sizeof(buf));
+}
+
+static void bin_put_tag(const char *tag, uint8_t type)
+{
+  uint8_t taglen = strlen(tag);
+
+  g_byte_array_append(bin_resp, &taglen, 1);
+  g_byte_array_append(bin_resp, (const guint8 *) tag, taglen);
+  g_byte_array_append(bin_resp, &type, 1);
+}
+
+static void bin_put_bytes(const char *tag, uint8_t type,
+                            const unsigned char *val, size_t len)
+{
+  bin_put_tag(tag, type);
+  bin_put_le16(len);
+  g_byte_array_append(bin_resp, val, len);
+}
+
+static void send_uint(const char *tag, unsigned int val);
+static void daemon_resp_end(void);
+
+static void text_put_hex(const unsigned char *val, size_t len)
+{
+  static const char hex[] = "0123456789ABCDEF";
+
+  while ( len-- > 0 ) {
+    g_string_append_c(text_resp, hex[*val >> 4]);
+    g_string_append_c(text_resp, hex[*val++ & 0x0F]);
+  }
+}
+
 static void resp_begin(const char *rsptype)
 {
-  printf("%s=$%s", tag_RESPONSE, rsptype);
+  resp_type = rsptype;
+  if (RESP_BINARY) {
+    g_byte_array_set_size(bin_resp, 0);
+    bin_put_bytes(tag_RESPONSE, '$', (const unsigned char *) rsptype,
+                  strlen(rsptype));
+  }
+  if (RESP_TEXT) {
+    g_string_truncate(text_resp, 0);
+    g_string_append_printf(text_resp, "%s=$%s", tag_RESPONSE, rsptype);
+  }
+
+  if (daemon_path) {
+    bin_cid_pos = bin_resp->len;
+    text_cid_pos = text_resp->len;
+  } else if (cur_conn)
+    send_uint(tag_CONN, cur_conn->id);
 }
 
 static void send_sym(const char *tag, const char *val)
 {
-  printf(RESP_DELIM "%s=$%s", tag, val);
+  if (RESP_BINARY)
+    bin_put_bytes(tag, '$', (const unsigned char *) val, strlen(val));
+  if (RESP_TEXT)
+    g_string_append_printf(text_resp, RESP_DELIM "%s=$%s", tag, val);
 }
 
 static void send_uint(const char *tag, unsigned int val)
 {
-  printf(RESP_DELIM "%s=h%X", tag, val);
+  if (RESP_BINARY) {
+    bin_put_tag(tag, 'h');
+    bin_put_le32(val);
+  }
+  if (RESP_TEXT)
+    g_string_append_printf(text_resp, RESP_DELIM "%s=h%X", tag, val);
 }
 
 static void send_str(const char *tag, const char *val)
 {
-  printf(RESP_DELIM "%s='%s", tag, val);
+  if (RESP_BINARY) {
+    const char *v = val ? val : "";
+
+    bin_put_bytes(tag, '\'', (const unsigned char *) v, strlen(v));
+  }
+  if (RESP_TEXT)
+    g_string_append_printf(text_resp, RESP_DELIM "%s='%s", tag, val);
 }
 
 static void send_data(const unsigned char *val, size_t len)
 {
-  printf(RESP_DELIM "%s=b", tag_DATA);
-  while ( len-- > 0 )
-    printf("%02X", *val++);
+  if (RESP_BINARY)
+    bin_put_bytes(tag_DATA, 'b', val, len);
+  if (RESP_TEXT) {
+    g_string_append_printf(text_resp, RESP_DELIM "%s=b", tag_DATA);
+    text_put_hex(val, len);
+  }
 }
 
 static void send_addr(const struct mgmt_addr_info *addr)
 {
     const uint8_t *val = addr->bdaddr.b;
-    printf(RESP_DELIM "%s=b", tag_ADDR);
+    uint8_t rev[6];
     int len = 6;
+
     /* Human-readable byte order is reverse of bdaddr.b */
     while ( len-- > 0 )
-        printf("%02X", val[len]);
+        rev[5-len] = val[len];
+
+    if (RESP_BINARY)
+        bin_put_bytes(tag_ADDR, 'b', rev, sizeof(rev));
+    if (RESP_TEXT) {
+        g_string_append_printf(text_resp, RESP_DELIM "%s=b", tag_ADDR);
+        text_put_hex(rev, sizeof(rev));
+    }
 
     send_uint(tag_TYPE, addr->type);
 }
 
 static void resp_end()
 {
-  printf("\n");
+#ifdef BLUEPY_EXTENSION
+  ext_resp(cur_conn ? cur_conn->id : 0, bin_resp->data, bin_resp->len);
+  return;
+#endif
+
+  if (daemon_path) {
+    daemon_resp_end();
+    return;
+  }
+
+  if (proto_mode == PROTO_BINARY) {
+    uint8_t hdr[5];
+
+    hdr[0] = BIN_FRAME_START;
+    bt_put_le32(bin_resp->len, hdr+1);
+    fwrite(hdr, 1, sizeof(hdr), stdout);
+    fwrite(bin_resp->data, 1, bin_resp->len, stdout);
+  } else {
+    g_string_append_c(text_resp, '\n');
+    fwrite(text_resp->str, 1, text_resp->len, stdout);
+  }
   fflush(stdout);
 }
 
@@ -249,22 +641,35 @@ static void resp_mgmt_err(uint8_t status)
 
 static void cmd_status(int argcp, char **argvp)
 {
+  struct conn *conn = cur_conn;
+
   resp_begin(rsp_STATUS);
-  switch(conn_state)
+  switch(conn->state)
   {
     case STATE_CONNECTING:
       send_sym(tag_CONNSTATE, st_CONNECTING);
-      send_str(tag_DEVICE, opt_dst);
+      send_str(tag_DEVICE, conn->dst);
       break;
 
     case STATE_CONNECTED:
       send_sym(tag_CONNSTATE, st_CONNECTED);
-      send_str(tag_DEVICE, opt_dst);
+      send_str(tag_DEVICE, conn->dst);
+      if (conn->granted.dle)
+        send_uint(tag_DATA_LEN, conn->granted.dle);
+      if (conn->granted.phys) {
+        send_uint(tag_TX_PHY, conn->granted.phys);
+        send_uint(tag_RX_PHY, conn->rx_phy);
+      }
+      if (conn->granted.interval) {
+        send_uint(tag_INTERVAL, conn->granted.interval);
+        send_uint(tag_LATENCY, conn->granted.latency);
+        send_uint(tag_TIMEOUT, conn->granted.timeout);
+      }
       break;
 
     case STATE_SCANNING:
       send_sym(tag_CONNSTATE, st_SCANNING);
-      send_str(tag_DEVICE, opt_dst);
+      send_str(tag_DEVICE, conn->dst);
       break;
 
     default:
@@ -272,19 +677,232 @@ static void cmd_status(int argcp, char **argvp)
       break;
   }
 
-  send_uint(tag_MTU, opt_mtu);
-  send_str(tag_SEC_LEVEL, opt_sec_level);
+  send_uint(tag_MTU, conn->mtu);
+  send_str(tag_SEC_LEVEL, conn->sec_level);
   resp_end();
 }
 
-static void set_state(enum state st)
+static void set_state(struct conn *conn, enum state st)
 {
-    conn_state = st;
+    /* A link profile only applies to the connection attempt after it */
+    if (st == STATE_DISCONNECTED)
+        memset(&conn->link, 0, sizeof(conn->link));
+
+    conn->state = st;
+    cur_conn = conn;
     cmd_status(0, NULL);
 }
 
+/* Notification ring: a shared-memory file set up by the client with
+ * "ring <path>". Notifications for the connection are written into it as
+ * raw records rather than hex-encoded on stdout, and a short "ring"
+ * response, sent at most once per main loop iteration, tells the client
+ * there is something to read.
+ *
+ *   header : u32 magic, u32 size, u32 head, u32 tail, u32 dropped (host
+ *            byte order), padded to RING_HDR_LEN; followed by size bytes
+ *            of records
+ *   record : u16 handle, u16 length, u32 flags, u64 timestamp in ns
+ *            (CLOCK_MONOTONIC), data, padded to a multiple of 16 bytes
+ *
+ * head is only written by the helper and tail only by the client; both
+ * count bytes and wrap at 2^32. A record which would run past the end of
+ * the data area is preceded by a RING_PAD record filling the remainder.
+ * The helper never waits for the client: a notification which does not
+ * fit in the free space is discarded and counted in dropped. One too big
+ * for the ring at all goes to stdout, after a "ring" for what came before.
+ */
+#define RING_MAGIC      0x676e6952  /* "Ring" */
+#define RING_HDR_LEN    64
+#define RING_REC_LEN    16
+#define RING_PAD        0x0001
+#define RING_ALIGN(n)   (((n) + 15) & ~15)
+
+struct ring_hdr {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+};
+
+/* The client can rewrite the shared header at any time, so size and
+ * head are kept here and only tail is ever read back from it. */
+struct ring {
+    struct ring_hdr *hdr;
+    uint8_t *data;
+    size_t maplen;
+    uint32_t size;
+    uint32_t head;
+    unsigned int doorbell;
+};
+
+static void ring_close(struct conn *conn)
+{
+    struct ring *ring = conn->ring;
+
+    if (!ring)
+        return;
+
+    if (ring->doorbell)
+        timeout_remove(ring->doorbell);
+    munmap(ring->hdr, ring->maplen);
+    g_free(ring);
+    conn->ring = NULL;
+}
+
+static bool ring_doorbell(void *user_data)
+{
+    struct conn *conn = user_data;
+
+    conn->ring->doorbell = 0;
+    cur_conn = conn;
+    resp_begin(rsp_RING);
+    resp_end();
+    return false;
+}
+
+static gboolean ring_put(struct conn *conn, uint16_t handle,
+                            const uint8_t *val, uint16_t len)
+{
+    struct ring *ring = conn->ring;
+    uint32_t size = ring->size;
+    uint32_t head = ring->head;
+    uint32_t used;
+    uint32_t off = head & (size - 1);
+    uint32_t need = RING_ALIGN(RING_REC_LEN + len);
+    uint32_t pad = (size - off < need) ? size - off : 0;
+    struct timespec ts;
+    uint8_t *rec;
+
+    /* Too big for the ring at all: send it the usual way */
+    if (pad + need > size)
+        return FALSE;
+
+    /* Full: waiting here would stall every other connection, so the
+     * client loses this one and can see that it did. It already has a
+     * doorbell for what is in the ring. */
+    used = head - __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+    if (used > size)
+        used = size;
+    if (size - used < pad + need) {
+        __atomic_fetch_add(&ring->hdr->dropped, 1, __ATOMIC_RELEASE);
+        return TRUE;
+    }
+
+    if (pad) {
+        rec = ring->data + off;
+        bt_put_le16(0, rec);
+        bt_put_le16(0, rec + 2);
+        bt_put_le32(RING_PAD, rec + 4);
+        head += pad;
+        off = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec = ring->data + off;
+    bt_put_le16(handle, rec);
+    bt_put_le16(len, rec + 2);
+    bt_put_le32(0, rec + 4);
+    bt_put_le64((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, rec + 8);
+    memcpy(rec + RING_REC_LEN, val, len);
+
+    ring->head = head + need;
+    __atomic_store_n(&ring->hdr->head, ring->head, __ATOMIC_RELEASE);
+
+    if (!ring->doorbell)
+        ring->doorbell = timeout_add(0, ring_doorbell, conn, NULL);
+
+    return TRUE;
+}
+
+static void cmd_ring(int argcp, char **argvp)
+{
+    struct conn *conn = cur_conn;
+    struct ring_hdr *hdr;
+    struct stat st;
+    uint32_t size;
+    void *map;
+    int fd;
+
+    ring_close(conn);
+
+    if (argcp > 1) {
+        fd = open(argvp[1], O_RDWR);
+        if (fd < 0) {
+            resp_error(err_NOT_FOUND);
+            return;
+        }
+
+        if (fstat(fd, &st) < 0 || st.st_size < RING_HDR_LEN) {
+            close(fd);
+            resp_error(err_BAD_PARAM);
+            return;
+        }
+
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                                fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            resp_error(err_CALL_FAIL);
+            return;
+        }
+
+        /* The data area must be a power of two so offsets can wrap */
+        hdr = map;
+        size = hdr->size;
+        if (hdr->magic != RING_MAGIC || size < 256 ||
+                (size & (size - 1)) != 0 ||
+                RING_HDR_LEN + (off_t)size > st.st_size) {
+            munmap(map, st.st_size);
+            resp_error(err_BAD_PARAM);
+            return;
+        }
+
+        hdr->head = hdr->tail = hdr->dropped = 0;
+        conn->ring = g_new0(struct ring, 1);
+        conn->ring->hdr = hdr;
+        conn->ring->data = (uint8_t *)map + RING_HDR_LEN;
+        conn->ring->maplen = st.st_size;
+        conn->ring->size = size;
+    }
+
+    cmd_status(argcp, argvp);
+}
+
+static void notify_handler(uint8_t opcode, const void *pdu, uint16_t len,
+                            void *user_data)
+{
+    struct conn *conn = user_data;
+    const uint8_t *p = pdu;
+    uint16_t handle;
+
+    /* Registered directly with bt_att, so the PDU (less its opcode) is
+     * not copied on the way in */
+    if (len < 2)
+        return;
+    handle = bt_get_le16(p);
+
+    if (conn->ring && ring_put(conn, handle, p + 2, len - 2))
+        return;
+
+    /* Too big for the ring: announce what is already in it first, so the
+     * client still sees the notifications in order */
+    if (conn->ring && conn->ring->doorbell) {
+        timeout_remove(conn->ring->doorbell);
+        ring_doorbell(conn);
+    }
+
+    cur_conn = conn;
+    resp_begin(rsp_NOTIFY);
+    send_uint(tag_HANDLE, handle);
+    send_data(p + 2, len - 2);
+    resp_end();
+}
+
 static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t evt;
     uint16_t handle, olen;
@@ -294,13 +912,14 @@ static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
 
     if ( evt != ATT_OP_HANDLE_NOTIFY && evt != ATT_OP_HANDLE_IND )
     {
-        printf("#Invalid opcode %02X in event handler??\n", evt);
+        helper_comment("#Invalid opcode %02X in event handler??\n", evt);
         return;
     }
 
     assert( len >= 3 );
     handle = bt_get_le16(&pdu[1]);
 
+    cur_conn = conn;
     resp_begin( evt==ATT_OP_HANDLE_NOTIFY ? rsp_NOTIFY : rsp_IND );
     send_uint( tag_HANDLE, handle );
     send_data( pdu+3, len-3 );
@@ -309,15 +928,16 @@ static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
     if (evt == ATT_OP_HANDLE_NOTIFY)
         return;
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_confirmation(opdu, plen);
 
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_find_info_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t starting_handle, olen;
@@ -328,14 +948,15 @@ static void gatts_find_info_req(const uint8_t *pdu, uint16_t len, gpointer user_
     starting_handle = bt_get_le16(&pdu[1]);
     /* ending_handle = bt_get_le16(&pdu[3]); */
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_find_by_type_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t starting_handle, olen;
@@ -347,14 +968,15 @@ static void gatts_find_by_type_req(const uint8_t *pdu, uint16_t len, gpointer us
     /* ending_handle = bt_get_le16(&pdu[3]); */
     /* att_type = bt_get_le16(&pdu[5]); */
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_read_by_type_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t starting_handle, olen;
@@ -368,14 +990,15 @@ static void gatts_read_by_type_req(const uint8_t *pdu, uint16_t len, gpointer us
         /* att_type = bt_get_le16(&pdu[5]); */
     }
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_read_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t handle, olen;
@@ -385,14 +1008,15 @@ static void gatts_read_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
     opcode = pdu[0];
     handle = bt_get_le16(&pdu[1]);
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_read_blob_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t handle, olen;
@@ -403,14 +1027,15 @@ static void gatts_read_blob_req(const uint8_t *pdu, uint16_t len, gpointer user_
     handle = bt_get_le16(&pdu[1]);
     /* offset = bt_get_le16(&pdu[3]); */
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_read_multi_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t handle1, olen;
@@ -421,14 +1046,15 @@ static void gatts_read_multi_req(const uint8_t *pdu, uint16_t len, gpointer user
     handle1 = bt_get_le16(&pdu[1]);
     /* handle2 = bt_get_le16(&pdu[3]); */
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, handle1, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_read_by_group_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t starting_handle, olen;
@@ -440,14 +1066,15 @@ static void gatts_read_by_group_req(const uint8_t *pdu, uint16_t len, gpointer u
     /* ending_handle = bt_get_le16(&pdu[3]); */
     /* att_group_type = bt_get_le16(&pdu[5]); */
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, starting_handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t handle, olen;
@@ -457,10 +1084,10 @@ static void gatts_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data
     opcode = pdu[0];
     handle = bt_get_le16(&pdu[1]);
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_write_cmd(const uint8_t *pdu, uint16_t len, gpointer user_data)
@@ -479,6 +1106,7 @@ static void gatts_signed_write_cmd(const uint8_t *pdu, uint16_t len, gpointer us
 
 static void gatts_prep_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode, handle;
     uint16_t olen;
@@ -489,14 +1117,15 @@ static void gatts_prep_write_req(const uint8_t *pdu, uint16_t len, gpointer user
     handle = bt_get_le16(&pdu[1]);
     /* offset = bt_get_le16(&pdu[3]); */
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, handle, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_exec_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t olen;
@@ -506,14 +1135,15 @@ static void gatts_exec_write_req(const uint8_t *pdu, uint16_t len, gpointer user
     opcode = pdu[0];
     /* flags = pdu[1]; */
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
     olen = enc_error_resp(opcode, 0, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
 }
 
 static void gatts_mtu_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+    struct conn *conn = user_data;
     uint8_t *opdu;
     uint8_t opcode;
     uint16_t mtu, olen;
@@ -522,12 +1152,13 @@ static void gatts_mtu_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
     assert( len >= 3 );
     opcode = pdu[0];
 
+    cur_conn = conn;
     if (!dec_mtu_req(pdu, len, &mtu)) {
         resp_error(err_DECODING);
         return;
     }
 
-    opdu = g_attrib_get_buffer(attrib, &plen);
+    opdu = g_attrib_get_buffer(conn->attrib, &plen);
 
     // According to the Bluetooth specification, we're supposed to send the response
     // before applying the new MTU value:
@@ -536,9 +1167,9 @@ static void gatts_mtu_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
     // But if we do it in that order, what happens if setting the MTU fails?
 
     // set new value for MTU
-    if (g_attrib_set_mtu(attrib, mtu))
+    if (g_attrib_set_mtu(conn->attrib, mtu))
     {
-        opt_mtu = mtu;
+        conn->mtu = mtu;
         olen = enc_mtu_resp(mtu, opdu, plen);
         cmd_status(0, NULL);
     }
@@ -547,20 +1178,63 @@ static void gatts_mtu_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
         olen = enc_error_resp(opcode, mtu, ATT_ECODE_REQ_NOT_SUPP, opdu, plen);
     }
     if (olen > 0)
-        g_attrib_send(attrib, 0, opdu, olen, NULL, NULL, NULL);
+        g_attrib_send(conn->attrib, 0, opdu, olen, NULL, NULL, NULL);
+}
+
+static struct conn *conn_by_channel(GIOChannel *io)
+{
+    int i;
+
+    for (i = 0; i < MAX_CONNECTIONS; i++)
+        if (conns[i] && conns[i]->iochannel == io)
+            return conns[i];
+
+    return NULL;
+}
+
+static void disconnect_io(struct conn *conn);
+
+static bool disconnect_idle(void *user_data)
+{
+    struct conn *conn = user_data;
+
+    conn->disc_idle = 0;
+    disconnect_io(conn);
+    return false;
+}
+
+static void att_disconnect_cb(int err, void *user_data)
+{
+    struct conn *conn = user_data;
+
+    DBG("err = %d", err);
+
+    /* The attrib can't be freed while bt_att is still calling out, as
+     * its registrations are dropped after this returns */
+    conn->disc_id = 0;
+    if (!conn->disc_idle)
+        conn->disc_idle = timeout_add(0, disconnect_idle, conn, NULL);
 }
 
 static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 {
+    struct conn *conn;
+    GAttrib *attrib;
     uint16_t mtu;
     uint16_t cid;
     GError *gerr = NULL;
 
     DBG("io = %p, err = %p", io, err);
+    conn = conn_by_channel(io);
+    if (!conn) {
+        DBG("no connection for channel %p", io);
+        return;
+    }
+
     if (err) {
-        set_state(STATE_DISCONNECTED);
+        set_state(conn, STATE_DISCONNECTED);
         resp_str_error(err_CONN_FAIL, err->message);
-        printf("# Connect error: %s\n", err->message);
+        helper_comment("# Connect error: %s\n", err->message);
         return;
     }
 
@@ -568,69 +1242,93 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
                 BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
 
     if (gerr) {
-        printf("# Can't detect MTU, using default");
+        helper_comment("# Can't detect MTU, using default\n");
         g_error_free(gerr);
         mtu = ATT_DEFAULT_LE_MTU;
     }
     else if (cid == ATT_CID)
         mtu = ATT_DEFAULT_LE_MTU;
 
-    attrib = g_attrib_new(iochannel, mtu, false);
+    attrib = g_attrib_new(conn->iochannel, mtu, false);
+    conn->attrib = attrib;
+
+    /* The link going down is seen by the attrib's own io, which is the
+     * only watch on the socket once connected */
+    conn->disc_id = bt_att_register_disconnect(g_attrib_get_att(attrib),
+                        att_disconnect_cb, conn, NULL);
 
-    g_attrib_register(attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES,
-                        events_handler, attrib, NULL);
+    bt_att_register(g_attrib_get_att(attrib), BT_ATT_OP_HANDLE_VAL_NOT,
+                        notify_handler, conn, NULL);
     g_attrib_register(attrib, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES,
-                        events_handler, attrib, NULL);
+                        events_handler, conn, NULL);
     g_attrib_register(attrib, ATT_OP_FIND_INFO_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_find_info_req, attrib, NULL);
+                      gatts_find_info_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_FIND_BY_TYPE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_find_by_type_req, attrib, NULL);
+                      gatts_find_by_type_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_READ_BY_TYPE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_by_type_req, attrib, NULL);
+                      gatts_read_by_type_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_READ_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_req, attrib, NULL);
+                      gatts_read_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_READ_BLOB_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_blob_req, attrib, NULL);
+                      gatts_read_blob_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_READ_MULTI_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_multi_req, attrib, NULL);
+                      gatts_read_multi_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_READ_BY_GROUP_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_read_by_group_req, attrib, NULL);
+                      gatts_read_by_group_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_WRITE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_write_req, attrib, NULL);
+                      gatts_write_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_WRITE_CMD, GATTRIB_ALL_HANDLES,
-                      gatts_write_cmd, attrib, NULL);
+                      gatts_write_cmd, conn, NULL);
     g_attrib_register(attrib, ATT_OP_SIGNED_WRITE_CMD, GATTRIB_ALL_HANDLES,
-                      gatts_signed_write_cmd, attrib, NULL);
+                      gatts_signed_write_cmd, conn, NULL);
     g_attrib_register(attrib, ATT_OP_PREP_WRITE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_prep_write_req, attrib, NULL);
+                      gatts_prep_write_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_EXEC_WRITE_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_exec_write_req, attrib, NULL);
+                      gatts_exec_write_req, conn, NULL);
     g_attrib_register(attrib, ATT_OP_MTU_REQ, GATTRIB_ALL_HANDLES,
-                      gatts_mtu_req, attrib, NULL);
+                      gatts_mtu_req, conn, NULL);
 
-    set_state(STATE_CONNECTED);
+    /* Reports the connection once the link profile has been applied */
+    link_apply(conn);
 }
 
-static void disconnect_io()
+static void disconnect_io(struct conn *conn)
 {
-    if (conn_state == STATE_DISCONNECTED)
+    if (conn->state == STATE_DISCONNECTED)
         return;
 
-    g_attrib_unref(attrib);
-    attrib = NULL;
-    opt_mtu = 0;
+    /* Chunks still queued are dropped along with the attrib */
+    if (conn->wstream != NULL)
+        conn->wstream->status = ATT_ECODE_IO;
 
-    g_io_channel_shutdown(iochannel, FALSE, NULL);
-    g_io_channel_unref(iochannel);
-    iochannel = NULL;
-
-    set_state(STATE_DISCONNECTED);
+    if (conn->disc_idle) {
+        timeout_remove(conn->disc_idle);
+        conn->disc_idle = 0;
+    }
+    if (conn->disc_id) {
+        bt_att_unregister_disconnect(g_attrib_get_att(conn->attrib),
+                                        conn->disc_id);
+        conn->disc_id = 0;
+    }
+    g_attrib_unref(conn->attrib);
+    conn->attrib = NULL;
+    conn->mtu = 0;
+    memset(&conn->granted, 0, sizeof(conn->granted));
+    if (conn->state == STATE_CONNECTING)
+        hci_cancel(conn);           /* Link profile steps */
+
+    g_io_channel_shutdown(conn->iochannel, FALSE, NULL);
+    g_io_channel_unref(conn->iochannel);
+    conn->iochannel = NULL;
+
+    set_state(conn, STATE_DISCONNECTED);
 }
 
 static void primary_all_cb(uint8_t status, GSList *services, void *user_data)
 {
     GSList *l;
 
+    cur_conn = user_data;
     if (status) {
         DBG("status returned error : %s (0x%02x)",
             att_ecode2str(status), status);
@@ -653,6 +1351,7 @@ static void primary_by_uuid_cb(uint8_t status, GSList *ranges, void *user_data)
 {
     GSList *l;
 
+    cur_conn = user_data;
     if (status) {
         DBG("status returned error : %s (0x%02x)",
             att_ecode2str(status), status);
@@ -673,6 +1372,7 @@ static void included_cb(uint8_t status, GSList *includes, void *user_data)
 {
     GSList *l;
 
+    cur_conn = user_data;
     if (status) {
         DBG("status returned error : %s (0x%02x)",
             att_ecode2str(status), status);
@@ -695,6 +1395,7 @@ static void char_cb(uint8_t status, GSList *characteristics, void *user_data)
 {
     GSList *l;
 
+    cur_conn = user_data;
     if (status) {
         DBG("status returned error : %s (0x%02x)",
             att_ecode2str(status), status);
@@ -717,6 +1418,7 @@ static void char_desc_cb(uint8_t status, GSList *descriptors, void *user_data)
 {
     GSList *l;
 
+    cur_conn = user_data;
     if (status != 0) {
         DBG("status returned error : %s (0x%02x)",
             att_ecode2str(status), status);
@@ -739,6 +1441,7 @@ static void char_read_cb(guint8 status, const guint8 *pdu, guint16 plen,
     uint8_t value[plen];
     ssize_t vlen;
 
+    cur_conn = user_data;
     if (status != 0) {
         DBG("status returned error : %s (0x%02x)",
             att_ecode2str(status), status);
@@ -757,17 +1460,37 @@ static void char_read_cb(guint8 status, const guint8 *pdu, guint16 plen,
     resp_end();
 }
 
+static void char_read_by_uuid_done(struct characteristic_data *char_data)
+{
+    GSList *l;
+    int i;
+
+    char_data->lists = g_slist_reverse(char_data->lists);
+
+    resp_begin(rsp_READ);
+    for (l = char_data->lists; l != NULL; l = l->next) {
+        struct att_data_list *list = l->data;
+
+        /* Every entry in one response PDU has the same length */
+        for (i = 0; i < list->num; i++) {
+            send_uint(tag_HANDLE, bt_get_le16(list->data[i]));
+            send_data(list->data[i] + 2, list->len - 2);
+        }
+    }
+    resp_end();
+}
+
 static void char_read_by_uuid_cb(guint8 status, const guint8 *pdu,
                     guint16 plen, gpointer user_data)
 {
     struct characteristic_data *char_data = user_data;
     struct att_data_list *list;
-    int i;
+    uint16_t last;
 
+    cur_conn = char_data->conn;
     if (status == ATT_ECODE_ATTR_NOT_FOUND &&
-                char_data->start != char_data->orig_start)
-    {
-        printf("# TODO case in char_read_by_uuid_cb\n");
+                char_data->start != char_data->orig_start) {
+        char_read_by_uuid_done(char_data);
         goto done;
     }
 
@@ -779,104 +1502,117 @@ static void char_read_by_uuid_cb(guint8 status, const guint8 *pdu,
     }
 
     list = dec_read_by_type_resp(pdu, plen);
+    if (list == NULL || list->num == 0) {
+        if (list != NULL)
+            att_data_list_free(list);
+        char_read_by_uuid_done(char_data);
+        goto done;
+    }
 
-    resp_begin(rsp_READ);
-    if (list == NULL)
-        goto nolist;
-
-    for (i = 0; i < list->num; i++) {
-        uint8_t *value = list->data[i];
-
-        char_data->start = bt_get_le16(value) + 1;
+    char_data->lists = g_slist_prepend(char_data->lists, list);
 
-        send_uint(tag_HANDLE, bt_get_le16(value));
-                send_data(value+2, list->len-2); // All the same length??
+    /* Keep reading after the last handle until the range is exhausted */
+    last = bt_get_le16(list->data[list->num - 1]);
+    if (last >= char_data->end || last < char_data->start) {
+        char_read_by_uuid_done(char_data);
+        goto done;
     }
 
-    att_data_list_free(list);
-nolist:
-    resp_end();
+    char_data->start = last + 1;
+    if (gatt_read_char_by_uuid(cur_conn->attrib, char_data->start,
+                    char_data->end, &char_data->uuid,
+                    char_read_by_uuid_cb, char_data) != 0)
+        return;
+
+    resp_error(err_SEND_FAIL);
 
 done:
+    g_slist_free_full(char_data->lists,
+                    (GDestroyNotify) att_data_list_free);
     g_free(char_data);
 }
 
 static void cmd_exit(int argcp, char **argvp)
 {
-    g_main_loop_quit(event_loop);
-}
-
-static gboolean channel_watcher(GIOChannel *chan, GIOCondition cond,
-                gpointer user_data)
-{
-    DBG("chan = %p", chan);
-
-    // in case of quick disconnection/reconnection, do not mix them
-    if (chan == iochannel)
-        disconnect_io();
-
-    return FALSE;
+#ifdef BLUEPY_EXTENSION
+    /* Only the Python object using the connection is going away */
+    if (cur_conn->iochannel)
+        disconnect_io(cur_conn);
+    ring_close(cur_conn);
+#else
+    /* A daemon's client only ends its own session */
+    if (cur_session)
+        cur_session->closing = TRUE;
+    else
+        loop_quit();
+#endif
 }
 
 static void cmd_connect(int argcp, char **argvp)
 {
+    struct conn *conn = cur_conn;
     GError *gerr = NULL;
-    if (conn_state != STATE_DISCONNECTED)
+
+    if (conn->state != STATE_DISCONNECTED) {
+        resp_error(err_BAD_STATE);
         return;
+    }
 
     if (argcp > 1) {
-        g_free(opt_dst);
-        opt_dst = g_strdup(argvp[1]);
+        g_free(conn->dst);
+        conn->dst = g_strdup(argvp[1]);
 
-        g_free(opt_dst_type);
+        g_free(conn->dst_type);
         if (argcp > 2)
-            opt_dst_type = g_strdup(argvp[2]);
+            conn->dst_type = g_strdup(argvp[2]);
         else
-            opt_dst_type = g_strdup("public");
-        g_free(opt_src);
+            conn->dst_type = g_strdup("public");
+        g_free(conn->src);
         if (argcp > 3) {
-            opt_src = g_strdup(argvp[3]);
+            conn->src = g_strdup(argvp[3]);
         } else {
-            opt_src = NULL;
+            conn->src = NULL;
         }
     }
 
-    if (opt_dst == NULL) {
+    if (conn->dst == NULL) {
         resp_error(err_BAD_PARAM);
         return;
     }
 
-    set_state(STATE_CONNECTING);
-    iochannel = gatt_connect(opt_src, opt_dst, opt_dst_type, opt_sec_level,
-                        opt_psm, opt_mtu, connect_cb, &gerr);
+    /* A ring belongs to the client of the previous connection */
+    ring_close(conn);
 
-    DBG("gatt_connect returned %p", iochannel);
-    if (iochannel == NULL)
+    set_state(conn, STATE_CONNECTING);
+    conn->iochannel = gatt_connect(conn->src, conn->dst, conn->dst_type,
+                        conn->sec_level, opt_psm, conn->mtu, connect_cb, &gerr);
+
+    DBG("gatt_connect returned %p", conn->iochannel);
+    if (conn->iochannel == NULL)
     {
-        set_state(STATE_DISCONNECTED);
+        set_state(conn, STATE_DISCONNECTED);
         g_error_free(gerr);
-        }
-    else
-        g_io_add_watch(iochannel, G_IO_HUP | G_IO_NVAL, channel_watcher, NULL);
+    }
 }
 
 static void cmd_disconnect(int argcp, char **argvp)
 {
     DBG("");
-    disconnect_io();
+    disconnect_io(cur_conn);
 }
 
 static void cmd_primary(int argcp, char **argvp)
 {
+    struct conn *conn = cur_conn;
     bt_uuid_t uuid;
 
-    if (conn_state != STATE_CONNECTED) {
+    if (conn->state != STATE_CONNECTED) {
         resp_error(err_BAD_STATE);
         return;
     }
 
     if (argcp == 1) {
-        gatt_discover_primary(attrib, NULL, primary_all_cb, NULL);
+        gatt_discover_primary(conn->attrib, NULL, primary_all_cb, conn);
         return;
     }
 
@@ -885,7 +1621,7 @@ static void cmd_primary(int argcp, char **argvp)
         return;
     }
 
-    gatt_discover_primary(attrib, &uuid, primary_by_uuid_cb, NULL);
+    gatt_discover_primary(conn->attrib, &uuid, primary_by_uuid_cb, conn);
 }
 
 static int strtohandle(const char *src)
@@ -901,18 +1637,42 @@ static int strtohandle(const char *src)
     return dst;
 }
 
+/* Handles are hex strings in text commands and u16 in binary ones */
+static int arg_handle(char **argvp, int i)
+{
+    if (cmd_arglen) {
+        if (cmd_arglen[i] != 2)
+            return -EINVAL;
+        return bt_get_le16(argvp[i]);
+    }
+
+    return strtohandle(argvp[i]);
+}
+
+/* Values are hex strings in text commands and raw bytes in binary ones */
+static size_t arg_data(char **argvp, int i, uint8_t **value)
+{
+    if (cmd_arglen) {
+        *value = g_memdup(argvp[i], cmd_arglen[i]);
+        return cmd_arglen[i];
+    }
+
+    return gatt_attr_data_from_string(argvp[i], value);
+}
+
 static void cmd_included(int argcp, char **argvp)
 {
+    struct conn *conn = cur_conn;
     int start = 0x0001;
     int end = 0xffff;
 
-    if (conn_state != STATE_CONNECTED) {
+    if (conn->state != STATE_CONNECTED) {
         resp_error(err_BAD_STATE);
         return;
     }
 
     if (argcp > 1) {
-        start = strtohandle(argvp[1]);
+        start = arg_handle(argvp, 1);
         if (start < 0) {
             resp_error(err_BAD_PARAM);
             return;
@@ -921,28 +1681,29 @@ static void cmd_included(int argcp, char **argvp)
     }
 
     if (argcp > 2) {
-        end = strtohandle(argvp[2]);
+        end = arg_handle(argvp, 2);
         if (end < 0) {
             resp_error(err_BAD_PARAM);
             return;
         }
     }
 
-    gatt_find_included(attrib, start, end, included_cb, NULL);
+    gatt_find_included(conn->attrib, start, end, included_cb, conn);
 }
 
 static void cmd_char(int argcp, char **argvp)
 {
+    struct conn *conn = cur_conn;
     int start = 0x0001;
     int end = 0xffff;
 
-    if (conn_state != STATE_CONNECTED) {
+    if (conn->state != STATE_CONNECTED) {
         resp_error(err_BAD_STATE);
         return;
     }
 
     if (argcp > 1) {
-        start = strtohandle(argvp[1]);
+        start = arg_handle(argvp, 1);
         if (start < 0) {
             resp_error(err_BAD_PARAM);
             return;
@@ -950,7 +1711,7 @@ static void cmd_char(int argcp, char **argvp)
     }
 
     if (argcp > 2) {
-        end = strtohandle(argvp[2]);
+        end = arg_handle(argvp, 2);
         if (end < 0) {
             resp_error(err_BAD_PARAM);
             return;
@@ -965,22 +1726,24 @@ static void cmd_char(int argcp, char **argvp)
             return;
         }
 
-        gatt_discover_char(attrib, start, end, &uuid, char_cb, NULL);
+        gatt_discover_char(conn->attrib, start, end, &uuid, char_cb, conn);
         return;
     }
 
-    gatt_discover_char(attrib, start, end, NULL, char_cb, NULL);
+    gatt_discover_char(conn->attrib, start, end, NULL, char_cb, conn);
 }
 
 static void cmd_char_desc(int argcp, char **argvp)
 {
-    if (conn_state != STATE_CONNECTED) {
+    struct conn *conn = cur_conn;
+
+    if (conn->state != STATE_CONNECTED) {
         resp_error(err_BAD_STATE);
         return;
     }
 
     if (argcp > 1) {
-        start = strtohandle(argvp[1]);
+        start = arg_handle(argvp, 1);
         if (start < 0) {
             resp_error(err_BAD_PARAM);
             return;
@@ -989,7 +1752,7 @@ static void cmd_char_desc(int argcp, char **argvp)
         start = 0x0001;
 
     if (argcp > 2) {
-        end = strtohandle(argvp[2]);
+        end = arg_handle(argvp, 2);
         if (end < 0) {
             resp_error(err_BAD_PARAM);
             return;
@@ -997,14 +1760,134 @@ static void cmd_char_desc(int argcp, char **argvp)
     } else
         end = 0xffff;
 
-    gatt_discover_desc(attrib, start, end, NULL, char_desc_cb, NULL);
+    gatt_discover_desc(conn->attrib, start, end, NULL, char_desc_cb, conn);
+}
+
+/* "tree" runs primary service, characteristic and descriptor discovery
+ * over the whole handle range back-to-back, without waiting for the
+ * client between them, and sends everything in one response. Services
+ * use the same tags as "svcs"; characteristics use hnd/props/vhnd/cuuid
+ * and descriptors dhnd/duuid so the three lists can be told apart.
+ */
+struct discovery_tree {
+    struct conn *conn;
+    GSList *services;
+    GSList *chars;
+};
+
+static GSList *tree_copy(GSList *list, size_t size)
+{
+    GSList *copy = NULL;
+
+    for (; list; list = list->next)
+        copy = g_slist_prepend(copy, g_memdup(list->data, size));
+
+    return g_slist_reverse(copy);
+}
+
+static void tree_free(struct discovery_tree *tree)
+{
+    g_slist_free_full(tree->services, g_free);
+    g_slist_free_full(tree->chars, g_free);
+    g_free(tree);
+}
+
+/* Returns TRUE (having sent an error) if discovery should stop here */
+static gboolean tree_failed(struct discovery_tree *tree, uint8_t status)
+{
+    if (status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND)
+        return FALSE;
+
+    DBG("status returned error : %s (0x%02x)",
+        att_ecode2str(status), status);
+    cur_conn = tree->conn;
+    resp_att_error(status);
+    tree_free(tree);
+    return TRUE;
+}
+
+static void tree_desc_cb(uint8_t status, GSList *descriptors, void *user_data)
+{
+    struct discovery_tree *tree = user_data;
+    GSList *l;
+
+    if (tree_failed(tree, status))
+        return;
+
+    cur_conn = tree->conn;
+    resp_begin(rsp_TREE);
+    for (l = tree->services; l; l = l->next) {
+        struct gatt_primary *prim = l->data;
+        send_uint(tag_RANGE_START, prim->range.start);
+        send_uint(tag_RANGE_END, prim->range.end);
+        send_str(tag_UUID, prim->uuid);
+    }
+    for (l = tree->chars; l; l = l->next) {
+        struct gatt_char *chars = l->data;
+        send_uint(tag_HANDLE, chars->handle);
+        send_uint(tag_PROPERTIES, chars->properties);
+        send_uint(tag_VALUE_HANDLE, chars->value_handle);
+        send_str(tag_CHAR_UUID, chars->uuid);
+    }
+    for (l = status ? NULL : descriptors; l; l = l->next) {
+        struct gatt_desc *desc = l->data;
+        send_uint(tag_DESC_HANDLE, desc->handle);
+        send_str(tag_DESC_UUID, desc->uuid);
+    }
+    resp_end();
+
+    tree_free(tree);
+}
+
+static void tree_char_cb(uint8_t status, GSList *characteristics, void *user_data)
+{
+    struct discovery_tree *tree = user_data;
+
+    if (tree_failed(tree, status))
+        return;
+
+    if (status == 0)
+        tree->chars = tree_copy(characteristics, sizeof(struct gatt_char));
+
+    gatt_discover_desc(tree->conn->attrib, 0x0001, 0xffff, NULL,
+                                        tree_desc_cb, tree);
+}
+
+static void tree_primary_cb(uint8_t status, GSList *services, void *user_data)
+{
+    struct discovery_tree *tree = user_data;
+
+    if (tree_failed(tree, status))
+        return;
+
+    if (status == 0)
+        tree->services = tree_copy(services, sizeof(struct gatt_primary));
+
+    gatt_discover_char(tree->conn->attrib, 0x0001, 0xffff, NULL,
+                                        tree_char_cb, tree);
+}
+
+static void cmd_tree(int argcp, char **argvp)
+{
+    struct conn *conn = cur_conn;
+    struct discovery_tree *tree;
+
+    if (conn->state != STATE_CONNECTED) {
+        resp_error(err_BAD_STATE);
+        return;
+    }
+
+    tree = g_new0(struct discovery_tree, 1);
+    tree->conn = conn;
+    gatt_discover_primary(conn->attrib, NULL, tree_primary_cb, tree);
 }
 
 static void cmd_read_hnd(int argcp, char **argvp)
 {
+    struct conn *conn = cur_conn;
     int handle;
 
-    if (conn_state != STATE_CONNECTED) {
+    if (conn->state != STATE_CONNECTED) {
         resp_error(err_BAD_STATE);
         return;
     }
@@ -1014,23 +1897,100 @@ static void cmd_read_hnd(int argcp, char **argvp)
         return;
     }
 
-    handle = strtohandle(argvp[1]);
+    handle = arg_handle(argvp, 1);
     if (handle < 0) {
         resp_error(err_BAD_PARAM);
         return;
     }
 
-    gatt_read_char(attrib, handle, char_read_cb, attrib);
+    gatt_read_char(conn->attrib, handle, char_read_cb, conn);
+}
+
+static void char_read_multi_cb(guint8 status, const guint8 *pdu,
+                    guint16 plen, gpointer user_data)
+{
+    const uint8_t *values[plen / 2 + 1];
+    uint16_t vlens[plen / 2 + 1];
+    int i, n;
+
+    cur_conn = user_data;
+    if (status != 0) {
+        DBG("status returned error : %s (0x%02x)",
+            att_ecode2str(status), status);
+        resp_att_error(status);
+        return;
+    }
+
+    if (plen > 0 && pdu[0] == ATT_OP_READ_MULTI_RESP) {
+        /* Values are concatenated; the caller knows their lengths */
+        resp_begin(rsp_READ);
+        send_data(pdu + 1, plen - 1);
+        resp_end();
+        return;
+    }
+
+    n = dec_read_multi_vl_resp(pdu, plen, values, vlens, plen / 2 + 1);
+    if (n < 0) {
+        resp_error(err_DECODING);
+        return;
+    }
+
+    resp_begin(rsp_READ);
+    for (i = 0; i < n; i++)
+        send_data(values[i], vlens[i]);
+    resp_end();
+}
+
+static void cmd_read_multi_common(int argcp, char **argvp, gboolean variable)
+{
+    struct conn *conn = cur_conn;
+    uint16_t handles[argcp];
+    int i, handle;
+
+    if (conn->state != STATE_CONNECTED) {
+        resp_error(err_BAD_STATE);
+        return;
+    }
+
+    if (argcp < 3) {
+        resp_error(err_BAD_PARAM);
+        return;
+    }
+
+    for (i = 1; i < argcp; i++) {
+        handle = arg_handle(argvp, i);
+        if (handle <= 0) {
+            resp_error(err_BAD_PARAM);
+            return;
+        }
+        handles[i - 1] = handle;
+    }
+
+    /* Fails if the handles do not fit in one PDU */
+    if (gatt_read_multi(conn->attrib, handles, argcp - 1, variable,
+                            char_read_multi_cb, conn) == 0)
+        resp_error(err_BAD_PARAM);
+}
+
+static void cmd_read_multi(int argcp, char **argvp)
+{
+    cmd_read_multi_common(argcp, argvp, FALSE);
+}
+
+static void cmd_read_multi_vl(int argcp, char **argvp)
+{
+    cmd_read_multi_common(argcp, argvp, TRUE);
 }
 
 static void cmd_read_uuid(int argcp, char **argvp)
 {
+    struct conn *conn = cur_conn;
     struct characteristic_data *char_data;
     int start = 0x0001;
     int end = 0xffff;
     bt_uuid_t uuid;
 
-    if (conn_state != STATE_CONNECTED) {
+    if (conn->state != STATE_CONNECTED) {
         resp_error(err_BAD_STATE);
         return;
     }
@@ -1042,7 +2002,7 @@ static void cmd_read_uuid(int argcp, char **argvp)
     }
 
     if (argcp > 2) {
-        start = strtohandle(argvp[2]);
+        start = arg_handle(argvp, 2);
         if (start < 0) {
             resp_error(err_BAD_PARAM);
             return;
@@ -1050,26 +2010,31 @@ static void cmd_read_uuid(int argcp, char **argvp)
     }
 
     if (argcp > 3) {
-        end = strtohandle(argvp[3]);
+        end = arg_handle(argvp, 3);
         if (end < 0) {
             resp_error(err_BAD_PARAM);
             return;
         }
     }
 
-    char_data = g_new(struct characteristic_data, 1);
+    char_data = g_new0(struct characteristic_data, 1);
+    char_data->conn = conn;
     char_data->orig_start = start;
     char_data->start = start;
     char_data->end = end;
     char_data->uuid = uuid;
 
-    gatt_read_char_by_uuid(attrib, start, end, &char_data->uuid,
-                    char_read_by_uuid_cb, char_data);
+    if (gatt_read_char_by_uuid(conn->attrib, start, end, &char_data->uuid,
+                    char_read_by_uuid_cb, char_data) == 0) {
+        g_free(char_data);
+        resp_error(err_SEND_FAIL);
+    }
 }
 
 static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen,
                             gpointer user_data)
 {
+    cur_conn = user_data;
     if (status != 0) {
         DBG("status returned error : %s (0x%02x)",
             att_ecode2str(status), status);
@@ -1089,11 +2054,12 @@ static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen,
 
 static void cmd_char_write_common(int argcp, char **argvp, int with_response)
 {
+    struct conn *conn = cur_conn;
     uint8_t *value = NULL;
     size_t plen;
     int handle;
 
-    if (conn_state != STATE_CONNECTED) {
+    if (conn->state != STATE_CONNECTED) {
         resp_error(err_BAD_STATE);
         return;
     }
@@ -1103,15 +2069,15 @@ static void cmd_char_write_common(int argcp, char **argvp, int with_response)
         return;
     }
 
-    handle = strtohandle(argvp[1]);
+    handle = arg_handle(argvp, 1);
     if (handle <= 0) {
         resp_error(err_BAD_PARAM);
         return;
     }
 
     if (argcp >= 3) {
-      plen = gatt_attr_data_from_string(argvp[2], &value);
-      if (plen == 0) {
+      plen = arg_data(argvp, 2, &value);
+      if (plen == 0 && !cmd_arglen) {
           resp_error(err_BAD_PARAM);
           return;
       }
@@ -1120,11 +2086,11 @@ static void cmd_char_write_common(int argcp, char **argvp, int with_response)
     }
 
     if (with_response)
-        gatt_write_char(attrib, handle, value, plen,
-                    char_write_req_cb, NULL);
+        gatt_write_char(conn->attrib, handle, value, plen,
+                    char_write_req_cb, conn);
     else
     {
-        gatt_write_cmd(attrib, handle, value, plen, NULL, NULL);
+        gatt_write_cmd(conn->attrib, handle, value, plen, NULL, NULL);
         resp_begin(rsp_WRITE);
         resp_end();
     }
@@ -1142,472 +2108,2543 @@ static void cmd_char_write_rsp(int argcp, char **argvp)
   cmd_char_write_common(argcp, argvp, 1);
 }
 
-static void cmd_sec_level(int argcp, char **argvp)
-{
-    GError *gerr = NULL;
-    BtIOSecLevel sec_level;
-
-    if (argcp < 2) {
-        resp_error(err_BAD_PARAM);
-        return;
-    }
+static void stream_fill(struct write_stream *stream);
 
-    if (strcasecmp(argvp[1], "medium") == 0)
-        sec_level = BT_IO_SEC_MEDIUM;
-    else if (strcasecmp(argvp[1], "high") == 0)
-        sec_level = BT_IO_SEC_HIGH;
-    else if (strcasecmp(argvp[1], "low") == 0)
-        sec_level = BT_IO_SEC_LOW;
-    else {
-        resp_error(err_BAD_PARAM);
-        return;
-    }
+static void stream_write_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct write_stream *stream = user_data;
 
-    g_free(opt_sec_level);
-    opt_sec_level = g_strdup(argvp[1]);
+    /* Only called if the PDU could not be written */
+    if (stream->status == 0)
+        stream->status = status ? status : ATT_ECODE_IO;
+}
 
-    if (conn_state != STATE_CONNECTED)
-        return;
+static void stream_sent(gpointer user_data)
+{
+    struct write_stream *stream = user_data;
 
-    assert(!opt_psm);
+    stream->inflight--;
+    if (stream->status == 0)
+        stream->sent = MIN(stream->sent + stream->chunk, stream->len);
 
-    bt_io_set(iochannel, &gerr,
-            BT_IO_OPT_SEC_LEVEL, sec_level,
-            BT_IO_OPT_INVALID);
-    if (gerr) {
-        printf("# Error: %s\n", gerr->message);
-        resp_str_error(err_CALL_FAIL, gerr->message);
-        g_error_free(gerr);
-    }
-    else {
-        /* Tell bluepy the security level
-         * has been changed successfuly */
-        cmd_status(0, NULL);
-    }
+    stream_fill(stream);
 }
 
-static void exchange_mtu_cb(guint8 status, const guint8 *pdu, guint16 plen,
-                            gpointer user_data)
+static void stream_fill(struct write_stream *stream)
 {
-    uint16_t mtu;
-
-    if (status != 0) {
-        DBG("status returned error : %s (0x%02x)",
-            att_ecode2str(status), status);
-        resp_att_error(status);
-        return;
+    struct conn *conn = stream->conn;
+    uint8_t *buf;
+    size_t buflen, n;
+    guint16 plen;
+
+    while (stream->status == 0 && stream->inflight < STREAM_WINDOW &&
+                                    stream->queued < stream->len) {
+        n = MIN(stream->chunk, stream->len - stream->queued);
+        buf = g_attrib_get_buffer(conn->attrib, &buflen);
+        plen = enc_write_cmd(stream->handle, stream->data + stream->queued,
+                                n, buf, buflen);
+        if (plen == 0 || g_attrib_send(conn->attrib, 0, buf, plen,
+                    stream_write_cb, stream, stream_sent) == 0) {
+            stream->status = ATT_ECODE_IO;
+            break;
+        }
+        stream->queued += n;
+        stream->inflight++;
     }
 
-    if (!dec_mtu_resp(pdu, plen, &mtu)) {
-        resp_error(err_DECODING);
+    if (stream->inflight > 0 ||
+            (stream->status == 0 && stream->queued < stream->len))
         return;
-    }
 
-    mtu = MIN(mtu, opt_mtu);
-    /* Set new value for MTU in client */
-    if (g_attrib_set_mtu(attrib, mtu))
-    {
-        opt_mtu = mtu;
-        cmd_status(0, NULL);
-    }
-    else
-    {
-        printf("# Error exchanging MTU\n");
-        resp_error(err_CALL_FAIL);
-    }
+    cur_conn = conn;
+    resp_begin(rsp_WRITE_STREAM);
+    send_uint(tag_HANDLE, stream->handle);
+    send_uint(tag_LENGTH, stream->sent);
+    send_uint(tag_ERRSTAT, stream->status);
+    resp_end();
+
+    conn->wstream = NULL;
+    g_free(stream->data);
+    g_free(stream);
 }
 
-static void cmd_mtu(int argcp, char **argvp)
+static void cmd_write_stream(int argcp, char **argvp)
 {
-    if (conn_state != STATE_CONNECTED) {
+    struct conn *conn = cur_conn;
+    struct write_stream *stream;
+    size_t buflen;
+    int handle;
+
+    if (conn->state != STATE_CONNECTED) {
         resp_error(err_BAD_STATE);
         return;
     }
 
-    assert(!opt_psm);
+    if (conn->wstream != NULL) {
+        resp_error(err_BUSY);
+        return;
+    }
 
-    if (argcp < 2) {
+    if (argcp < 3) {
         resp_error(err_BAD_PARAM);
         return;
     }
 
-    if (opt_mtu) {
-        resp_error(err_BAD_STATE);
-        /* Can only set once per connection */
+    handle = arg_handle(argvp, 1);
+    if (handle <= 0) {
+        resp_error(err_BAD_PARAM);
         return;
     }
 
-    errno = 0;
-    opt_mtu = strtoll(argvp[1], NULL, 16);
-    if (errno != 0 || opt_mtu < ATT_DEFAULT_LE_MTU) {
+    stream = g_new0(struct write_stream, 1);
+    stream->conn = conn;
+    stream->handle = handle;
+    stream->len = arg_data(argvp, 2, &stream->data);
+    if (stream->len == 0) {
+        g_free(stream->data);
+        g_free(stream);
         resp_error(err_BAD_PARAM);
         return;
     }
 
-    gatt_exchange_mtu(attrib, opt_mtu, exchange_mtu_cb, NULL);
+    g_attrib_get_buffer(conn->attrib, &buflen);
+    stream->chunk = buflen - 3;
+
+    conn->wstream = stream;
+    stream_fill(stream);
 }
 
-static void set_mode_complete(uint8_t status, uint16_t length,
-                    const void *param, void *user_data)
+/* "batch" issues a list of reads and writes back-to-back. GAttrib hands
+ * them all to bt_att, whose request queue sends each one as soon as the
+ * previous response arrives, and the results come back to the client in
+ * a single response once the last operation has completed.
+ */
+enum batch_kind { BATCH_READ, BATCH_WRITE_REQ, BATCH_WRITE_CMD };
+
+struct batch;
+
+struct batch_op {
+    struct batch *batch;
+    enum batch_kind kind;
+    int handle;
+    guint8 status;
+    uint8_t *value;
+    size_t vlen;
+};
+
+struct batch {
+    struct conn *conn;
+    int nops;
+    int pending;
+    struct batch_op ops[];
+};
+
+static void batch_free(struct batch *batch)
 {
-    if (status != MGMT_STATUS_SUCCESS) {
-        DBG("status returned error : %s (0x%02x)",
-            mgmt_errstr(status), status);
-        resp_mgmt_err(status);
-        return;
-    }
+    int i;
 
-    resp_mgmt(err_SUCCESS);
+    for (i = 0; i < batch->nops; i++)
+        g_free(batch->ops[i].value);
+    g_free(batch);
 }
 
-static bool set_mode(uint16_t opcode, char *p_mode)
+static void batch_op_done(struct batch_op *op)
 {
-    struct mgmt_mode cp;
-    uint8_t val;
+    struct batch *batch = op->batch;
+    int i;
 
-    if (!mgmt_master) {
-        resp_error(err_NO_MGMT);
-        return true;
+    if (--batch->pending > 0)
+        return;
+
+    cur_conn = batch->conn;
+    resp_begin(rsp_BATCH);
+    for (i = 0; i < batch->nops; i++) {
+        send_uint(tag_HANDLE, batch->ops[i].handle);
+        send_uint(tag_ERRSTAT, batch->ops[i].status);
+        send_data(batch->ops[i].value, batch->ops[i].vlen);
     }
+    resp_end();
 
-    if (!memcmp(p_mode, "on", 2))
-        val = 1;
-    else if (!memcmp(p_mode, "off", 3))
-        val = 0;
-    else
-        return false;
+    batch_free(batch);
+}
 
-    memset(&cp, 0, sizeof(cp));
-    cp.val = val;
+static void batch_read_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct batch_op *op = user_data;
+    ssize_t vlen;
 
-    // at this time only index 0 is supported
-    if (mgmt_send(mgmt_master, opcode,
-            mgmt_ind, sizeof(cp), &cp,
-            set_mode_complete, NULL, NULL) == 0) {
-        resp_mgmt(err_SUCCESS);
+    if (status == 0) {
+        op->value = g_malloc(plen);
+        vlen = dec_read_resp(pdu, plen, op->value, plen);
+        if (vlen < 0)
+            status = ATT_ECODE_INVALID_PDU;
+        else
+            op->vlen = vlen;
     }
-    return true;
+
+    op->status = status;
+    batch_op_done(op);
 }
 
+static void batch_write_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct batch_op *op = user_data;
 
-static void cmd_le(int argcp, char **argvp)
+    if (status == 0 && !dec_write_resp(pdu, plen) &&
+                            !dec_exec_write_resp(pdu, plen))
+        status = ATT_ECODE_INVALID_PDU;
+
+    op->status = status;
+    batch_op_done(op);
+}
+
+static void cmd_batch(int argcp, char **argvp)
 {
-    if (argcp < 2) {
-        resp_mgmt(err_BAD_PARAM);
+    struct conn *conn = cur_conn;
+    struct batch *batch;
+    struct batch_op *op;
+    int i, nargs;
+    guint id;
+
+    if (conn->state != STATE_CONNECTED) {
+        resp_error(err_BAD_STATE);
         return;
     }
 
-    if (!set_mode(MGMT_OP_SET_LE, argvp[1])) {
-        resp_mgmt(err_BAD_PARAM);
+    if (argcp < 3) {
+        resp_error(err_BAD_PARAM);
+        return;
     }
-}
 
-static void add_remote_oob_data_complete(uint8_t status, uint16_t len,
-                    const void *param, void *user_data)
+    /* Every operation takes at least two arguments */
+    batch = g_malloc0(sizeof(*batch) +
+                        (argcp / 2) * sizeof(struct batch_op));
+    batch->conn = conn;
+
+    for (i = 1; i < argcp; i += nargs) {
+        op = &batch->ops[batch->nops++];
+        op->batch = batch;
+
+        if (strcmp(argvp[i], rsp_READ) == 0) {
+            op->kind = BATCH_READ;
+            nargs = 2;
+        } else if (strcmp(argvp[i], "wrr") == 0) {
+            op->kind = BATCH_WRITE_REQ;
+            nargs = 3;
+        } else if (strcmp(argvp[i], rsp_WRITE) == 0) {
+            op->kind = BATCH_WRITE_CMD;
+            nargs = 3;
+        } else
+            goto bad_param;
+
+        if (i + nargs > argcp)
+            goto bad_param;
+
+        op->handle = arg_handle(argvp, i + 1);
+        if (op->handle <= 0)
+            goto bad_param;
+
+        if (op->kind != BATCH_READ) {
+            op->vlen = arg_data(argvp, i + 2, &op->value);
+            if (op->vlen == 0 && !cmd_arglen)
+                goto bad_param;
+        }
+    }
+
+    /* Hold a reference so the batch survives operations which
+     * complete while it is still being issued. */
+    batch->pending = batch->nops + 1;
+
+    for (i = 0; i < batch->nops; i++) {
+        op = &batch->ops[i];
+
+        switch (op->kind) {
+        case BATCH_READ:
+            id = gatt_read_char(conn->attrib, op->handle,
+                                        batch_read_cb, op);
+            break;
+        case BATCH_WRITE_REQ:
+            id = gatt_write_char(conn->attrib, op->handle, op->value,
+                                op->vlen, batch_write_cb, op);
+            break;
+        default:
+            id = gatt_write_cmd(conn->attrib, op->handle, op->value,
+                                op->vlen, NULL, NULL);
+            break;
+        }
+
+        /* Written values are echoed back as empty data */
+        g_free(op->value);
+        op->value = NULL;
+        op->vlen = 0;
+
+        if (id == 0)
+            op->status = ATT_ECODE_IO;
+        if (id == 0 || op->kind == BATCH_WRITE_CMD)
+            batch_op_done(op);
+    }
+
+    batch_op_done(&batch->ops[0]);
+    return;
+
+bad_param:
+    batch_free(batch);
+    resp_error(err_BAD_PARAM);
+}
+
+/* Reliable write transaction: every value is queued on the peer with
+ * Prepare Write requests, checked against the echo, then committed with
+ * a single Execute Write. Nothing is applied unless everything is. */
+struct write_txn;
+
+struct txn_seg {
+    struct write_txn *txn;
+    uint16_t handle;
+    uint16_t offset;
+    const uint8_t *data;
+    size_t len;
+};
+
+struct write_txn {
+    struct conn *conn;
+    int nvalues;
+    uint8_t **values;
+    int nsegs;
+    int pending;
+    guint8 status;
+    uint16_t err_handle;
+    struct txn_seg segs[];
+};
+
+#define ATT_MAX_VALUE_LEN   512
+
+static void txn_free(struct write_txn *txn)
 {
-    const struct mgmt_addr_info *rp = param;
-    char str[18];
-    if (status) {
-        DBG("status returned error : %s (0x%02x)",
-            mgmt_errstr(status), status);
-        resp_mgmt_err(status);
+    int i;
+
+    for (i = 0; i < txn->nvalues; i++)
+        g_free(txn->values[i]);
+    g_free(txn->values);
+    g_free(txn);
+}
+
+static void txn_failed(struct write_txn *txn, guint8 status, uint16_t handle)
+{
+    if (txn->status != 0)
         return;
+
+    txn->status = status;
+    txn->err_handle = handle;
+}
+
+static void txn_finish(struct write_txn *txn)
+{
+    cur_conn = txn->conn;
+    if (txn->status != 0) {
+        resp_begin(rsp_ERROR);
+        send_sym(tag_ERRCODE, err_ATT_ERR);
+        send_uint(tag_ERRSTAT, txn->status);
+        send_uint(tag_HANDLE, txn->err_handle);
+        send_str(tag_ERRMSG, att_ecode2str(txn->status));
+        resp_end();
+    } else {
+        resp_begin(rsp_WRITE);
+        resp_end();
     }
-    ba2str(&rp->bdaddr, str);
-    DBG("  Remote data added for : %s\n", str);
+
+    txn_free(txn);
 }
 
-static bool add_remote_oob_data(uint16_t index, const bdaddr_t *bdaddr,
-                const uint8_t addr_type,
-                const char *hash192, const char *rand192,
-                const char *hash256, const char *rand256)
+static void txn_exec_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
 {
-    struct mgmt_cp_add_remote_oob_data cp;
-    uint8_t *oob;
-    size_t len;
+    struct write_txn *txn = user_data;
 
-    if (!mgmt_master) {
-        resp_error(err_NO_MGMT);
-        return true;
+    if (status == 0 && !dec_exec_write_resp(pdu, plen))
+        status = ATT_ECODE_INVALID_PDU;
+
+    /* A failed prepare was already recorded; this was the cancel */
+    if (status != 0)
+        txn_failed(txn, status, 0);
+
+    txn_finish(txn);
+}
+
+static void txn_seg_done(struct write_txn *txn)
+{
+    uint8_t flags;
+
+    if (--txn->pending > 0)
+        return;
+
+    flags = txn->status ? ATT_CANCEL_ALL_PREP_WRITES :
+                            ATT_WRITE_ALL_PREP_WRITES;
+    if (gatt_execute_write(txn->conn->attrib, flags,
+                            txn_exec_cb, txn) != 0)
+        return;
+
+    txn_failed(txn, ATT_ECODE_IO, 0);
+    txn_finish(txn);
+}
+
+static void txn_prepare_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct txn_seg *seg = user_data;
+    uint8_t value[plen];
+    uint16_t handle, offset;
+    size_t vlen;
+
+    /* The peer echoes each part back; anything else means the
+     * queued value would not be what we asked for */
+    if (status == 0 && (!dec_prep_write_resp(pdu, plen, &handle, &offset,
+                                                value, &vlen) ||
+                handle != seg->handle || offset != seg->offset ||
+                vlen != seg->len || memcmp(value, seg->data, vlen) != 0))
+        status = ATT_ECODE_UNLIKELY;
+
+    if (status != 0)
+        txn_failed(seg->txn, status, seg->handle);
+
+    txn_seg_done(seg->txn);
+}
+
+static void cmd_write_txn(int argcp, char **argvp)
+{
+    struct conn *conn = cur_conn;
+    struct write_txn *txn;
+    struct txn_seg *seg;
+    uint8_t **values;
+    size_t buflen, chunk, vlens[argcp], off;
+    int handles[argcp];
+    int i, nvalues, nsegs;
+
+    if (conn->state != STATE_CONNECTED) {
+        resp_error(err_BAD_STATE);
+        return;
     }
 
-    memset(&cp, 0, sizeof(cp));
-    bacpy(&cp.addr.bdaddr, bdaddr);
-    cp.addr.type = addr_type;
-    if (hash192 && rand192) {
-        len = gatt_attr_data_from_string(hash192, &oob);
-        if (len == 0) {
+    if (argcp < 3 || (argcp - 1) % 2 != 0) {
+        resp_error(err_BAD_PARAM);
+        return;
+    }
+
+    /* Prepare Write carries a handle and an offset besides the opcode */
+    g_attrib_get_buffer(conn->attrib, &buflen);
+    chunk = buflen - 5;
+
+    nvalues = (argcp - 1) / 2;
+    values = g_new0(uint8_t *, nvalues);
+    nsegs = 0;
+    for (i = 0; i < nvalues; i++) {
+        handles[i] = arg_handle(argvp, 1 + i * 2);
+        vlens[i] = arg_data(argvp, 2 + i * 2, &values[i]);
+        if (handles[i] <= 0 || (vlens[i] == 0 && !cmd_arglen) ||
+                                vlens[i] > ATT_MAX_VALUE_LEN) {
+            while (i >= 0)
+                g_free(values[i--]);
+            g_free(values);
             resp_error(err_BAD_PARAM);
-            g_free(oob);
-            return false;
+            return;
         }
-        memcpy(cp.hash192, oob, 16);
-        g_free(oob);
-        len = gatt_attr_data_from_string(rand192, &oob);
-        if (len == 0) {
-            resp_error(err_BAD_PARAM);
-            memset(cp.hash192, 0, 16);
-            g_free(oob);
-            return false;
+        nsegs += vlens[i] ? (vlens[i] + chunk - 1) / chunk : 1;
+    }
+
+    txn = g_malloc0(sizeof(*txn) + nsegs * sizeof(struct txn_seg));
+    txn->conn = conn;
+    txn->values = values;
+    txn->nvalues = nvalues;
+
+    for (i = 0; i < nvalues; i++) {
+        off = 0;
+        do {
+            seg = &txn->segs[txn->nsegs++];
+            seg->txn = txn;
+            seg->handle = handles[i];
+            seg->offset = off;
+            seg->data = values[i] + off;
+            seg->len = MIN(chunk, vlens[i] - off);
+            off += seg->len;
+        } while (off < vlens[i]);
+    }
+
+    /* Hold a reference until every prepare has been issued */
+    txn->pending = txn->nsegs + 1;
+
+    for (i = 0; i < txn->nsegs; i++) {
+        seg = &txn->segs[i];
+        if (gatt_prepare_write_char(conn->attrib, seg->handle, seg->offset,
+                        seg->data, seg->len, txn_prepare_cb, seg) == 0) {
+            txn_failed(txn, ATT_ECODE_IO, seg->handle);
+            txn_seg_done(txn);
         }
-        memcpy(cp.rand192, rand192, 16);
-        g_free(oob);
-    } else {
-        memset(cp.hash192, 0, 16);
-        memset(cp.rand192, 0, 16);
     }
-    if (hash256 && rand256) {
-        len = gatt_attr_data_from_string(hash256, &oob);
-        if (len == 0) {
-            resp_error(err_BAD_PARAM);
-            memset(cp.hash192, 0, 16);
-            memset(cp.rand192, 0, 16);
-            g_free(oob);
-            return false;
+
+    txn_seg_done(txn);
+}
+
+/* Subscription, set with "sub ntfy|ind|off <value handle> ...". For each
+ * characteristic the helper finds the Client Characteristic Configuration
+ * descriptor with Find Information requests starting just after the value
+ * handle (stopping at the next declaration), writes the new configuration
+ * to it, and reports all of them in one "sub" response. The requests for
+ * all handles are queued together. */
+struct subscription;
+
+struct sub_op {
+    struct subscription *sub;
+    uint16_t handle;
+    uint16_t cccd;
+    uint16_t next;      /* Where the next Find Information starts */
+    guint8 status;
+};
+
+struct subscription {
+    struct conn *conn;
+    uint8_t value[2];
+    int nops;
+    int pending;
+    struct sub_op ops[];
+};
+
+static void sub_find(struct sub_op *op);
+
+static void sub_op_done(struct sub_op *op)
+{
+    struct subscription *sub = op->sub;
+    int i;
+
+    if (--sub->pending > 0)
+        return;
+
+    cur_conn = sub->conn;
+    resp_begin(rsp_SUBSCRIBE);
+    for (i = 0; i < sub->nops; i++) {
+        send_uint(tag_HANDLE, sub->ops[i].handle);
+        send_uint(tag_DESC_HANDLE, sub->ops[i].cccd);
+        send_uint(tag_ERRSTAT, sub->ops[i].status);
+    }
+    resp_end();
+
+    g_free(sub);
+}
+
+static void sub_write_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct sub_op *op = user_data;
+
+    if (status == 0 && !dec_write_resp(pdu, plen))
+        status = ATT_ECODE_INVALID_PDU;
+
+    op->status = status;
+    sub_op_done(op);
+}
+
+static void sub_find_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct sub_op *op = user_data;
+    struct subscription *sub = op->sub;
+    struct att_data_list *list;
+    uint16_t handle = 0, uuid;
+    uint8_t format;
+    int i, num;
+
+    if (status != 0)
+        goto failed;
+
+    list = dec_find_info_resp(pdu, plen, &format);
+    if (list == NULL) {
+        status = ATT_ECODE_INVALID_PDU;
+        goto failed;
+    }
+
+    for (i = 0; i < list->num; i++) {
+        handle = bt_get_le16(list->data[i]);
+        if (format != ATT_FIND_INFO_RESP_FMT_16BIT)
+            continue;
+
+        uuid = bt_get_le16(list->data[i] + 2);
+        if (uuid == GATT_CLIENT_CHARAC_CFG_UUID) {
+            op->cccd = handle;
+            break;
         }
-        memcpy(cp.hash256, oob, 16);
-        g_free(oob);
-        len = gatt_attr_data_from_string(rand256, &oob);
-        if (len == 0) {
+        if (uuid == GATT_PRIM_SVC_UUID || uuid == GATT_SND_SVC_UUID ||
+                                            uuid == GATT_CHARAC_UUID)
+            break;
+    }
+    num = list->num;
+    att_data_list_free(list);
+
+    if (op->cccd != 0) {
+        if (gatt_write_char(sub->conn->attrib, op->cccd, sub->value,
+                        sizeof(sub->value), sub_write_cb, op) != 0)
+            return;
+        status = ATT_ECODE_IO;
+        goto failed;
+    }
+
+    /* Ran off the end of this response without reaching a declaration */
+    if (i == num && handle >= op->next && handle < 0xffff) {
+        op->next = handle + 1;
+        sub_find(op);
+        return;
+    }
+
+    /* The characteristic has no CCCD */
+    status = ATT_ECODE_ATTR_NOT_FOUND;
+
+failed:
+    op->status = status;
+    sub_op_done(op);
+}
+
+static void sub_find(struct sub_op *op)
+{
+    struct conn *conn = op->sub->conn;
+    size_t buflen;
+    uint8_t *buf = g_attrib_get_buffer(conn->attrib, &buflen);
+    guint16 plen;
+
+    plen = enc_find_info_req(op->next, 0xffff, buf, buflen);
+    if (plen != 0 && g_attrib_send(conn->attrib, 0, buf, plen,
+                                sub_find_cb, op, NULL) != 0)
+        return;
+
+    op->status = ATT_ECODE_IO;
+    sub_op_done(op);
+}
+
+static void cmd_subscribe(int argcp, char **argvp)
+{
+    struct conn *conn = cur_conn;
+    struct subscription *sub;
+    uint16_t value;
+    int i, handle;
+
+    if (conn->state != STATE_CONNECTED) {
+        resp_error(err_BAD_STATE);
+        return;
+    }
+
+    if (argcp < 3) {
+        resp_error(err_BAD_PARAM);
+        return;
+    }
+
+    if (strcmp(argvp[1], rsp_NOTIFY) == 0)
+        value = GATT_CLIENT_CHARAC_CFG_NOTIF_BIT;
+    else if (strcmp(argvp[1], rsp_IND) == 0)
+        value = GATT_CLIENT_CHARAC_CFG_IND_BIT;
+    else if (strcmp(argvp[1], "off") == 0)
+        value = 0x0000;
+    else {
+        resp_error(err_BAD_PARAM);
+        return;
+    }
+
+    sub = g_malloc0(sizeof(*sub) + (argcp - 2) * sizeof(struct sub_op));
+    sub->conn = conn;
+    bt_put_le16(value, sub->value);
+
+    for (i = 2; i < argcp; i++) {
+        handle = arg_handle(argvp, i);
+        if (handle <= 0 || handle == 0xffff) {
+            g_free(sub);
             resp_error(err_BAD_PARAM);
-            memset(cp.hash192, 0, 16);
-            memset(cp.rand192, 0, 16);
-            memset(cp.hash256, 0, 16);
-            g_free(oob);
-            return false;
+            return;
         }
-        memcpy(cp.rand256, rand256, 16);
-        g_free(oob);
-    } else {
-        memset(cp.hash256, 0, 16);
-        memset(cp.rand256, 0, 16);
-    }
-    if (mgmt_send(mgmt_master, MGMT_OP_ADD_REMOTE_OOB_DATA, mgmt_ind, sizeof(cp), &cp,
-                        add_remote_oob_data_complete,
-                        NULL, NULL) == 0) {
-        resp_error(err_SEND_FAIL);
-        g_free(oob);
-        return false;
+        sub->ops[sub->nops].sub = sub;
+        sub->ops[sub->nops].handle = handle;
+        sub->ops[sub->nops].next = handle + 1;
+        sub->nops++;
     }
-    g_free(oob);
-    return true;
+
+    /* Hold a reference so the subscription survives operations which
+     * complete while it is still being issued. */
+    sub->pending = sub->nops + 1;
+    for (i = 0; i < sub->nops; i++)
+        sub_find(&sub->ops[i]);
+
+    sub_op_done(&sub->ops[0]);
 }
 
-static void cmd_add_oob(int argcp, char **argvp)
+static void cmd_sec_level(int argcp, char **argvp)
 {
-    bdaddr_t bdaddr;
-    char *C192 = NULL;
-    char *R192 = NULL;
-    char *C256 = NULL;
-    char *R256 = NULL;
-    uint8_t addr_type = BDADDR_LE_RANDOM;
+    struct conn *conn = cur_conn;
+    GError *gerr = NULL;
+    BtIOSecLevel sec_level;
 
-    if (argcp < 7) {
-        resp_mgmt(err_BAD_PARAM);
+    if (argcp < 2) {
+        resp_error(err_BAD_PARAM);
         return;
     }
 
-    if (str2ba(argvp[1], &bdaddr)) {
-        resp_mgmt(err_NOT_FOUND);
+    if (strcasecmp(argvp[1], "medium") == 0)
+        sec_level = BT_IO_SEC_MEDIUM;
+    else if (strcasecmp(argvp[1], "high") == 0)
+        sec_level = BT_IO_SEC_HIGH;
+    else if (strcasecmp(argvp[1], "low") == 0)
+        sec_level = BT_IO_SEC_LOW;
+    else {
+        resp_error(err_BAD_PARAM);
         return;
     }
 
-    if (!memcmp(argvp[2], "public", 6)) {
-        addr_type = BDADDR_LE_PUBLIC;
+    g_free(conn->sec_level);
+    conn->sec_level = g_strdup(argvp[1]);
+
+    if (conn->state != STATE_CONNECTED)
+        return;
+
+    assert(!opt_psm);
+
+    bt_io_set(conn->iochannel, &gerr,
+            BT_IO_OPT_SEC_LEVEL, sec_level,
+            BT_IO_OPT_INVALID);
+    if (gerr) {
+        helper_comment("# Error: %s\n", gerr->message);
+        resp_str_error(err_CALL_FAIL, gerr->message);
+        g_error_free(gerr);
+    }
+    else {
+        /* Tell bluepy the security level
+         * has been changed successfuly */
+        cmd_status(0, NULL);
     }
+}
 
-    if ((!memcmp(argvp[3], "C_192", 5)) && (!memcmp(argvp[5], "R_192", 5))) {
+static void exchange_mtu_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint16_t mtu;
+
+    cur_conn = conn;
+    if (status != 0) {
+        DBG("status returned error : %s (0x%02x)",
+            att_ecode2str(status), status);
+        resp_att_error(status);
+        return;
+    }
+
+    if (!dec_mtu_resp(pdu, plen, &mtu)) {
+        resp_error(err_DECODING);
+        return;
+    }
+
+    mtu = MIN(mtu, conn->mtu);
+    /* Set new value for MTU in client */
+    if (g_attrib_set_mtu(conn->attrib, mtu))
+    {
+        conn->mtu = mtu;
+        cmd_status(0, NULL);
+    }
+    else
+    {
+        helper_comment("# Error exchanging MTU\n");
+        resp_error(err_CALL_FAIL);
+    }
+}
+
+static void cmd_mtu(int argcp, char **argvp)
+{
+    struct conn *conn = cur_conn;
+
+    if (conn->state != STATE_CONNECTED) {
+        resp_error(err_BAD_STATE);
+        return;
+    }
+
+    assert(!opt_psm);
+
+    if (argcp < 2) {
+        resp_error(err_BAD_PARAM);
+        return;
+    }
+
+    if (conn->mtu) {
+        resp_error(err_BAD_STATE);
+        /* Can only set once per connection */
+        return;
+    }
+
+    errno = 0;
+    conn->mtu = strtoll(argvp[1], NULL, 16);
+    if (errno != 0 || conn->mtu < ATT_DEFAULT_LE_MTU) {
+        resp_error(err_BAD_PARAM);
+        return;
+    }
+
+    gatt_exchange_mtu(conn->attrib, conn->mtu, exchange_mtu_cb, conn);
+}
+
+static void set_mode_complete(uint8_t status, uint16_t length,
+                    const void *param, void *user_data)
+{
+    cur_conn = user_data;
+    if (status != MGMT_STATUS_SUCCESS) {
+        DBG("status returned error : %s (0x%02x)",
+            mgmt_errstr(status), status);
+        resp_mgmt_err(status);
+        return;
+    }
+
+    resp_mgmt(err_SUCCESS);
+}
+
+static bool set_mode(uint16_t opcode, char *p_mode)
+{
+    struct mgmt_mode cp;
+    uint8_t val;
+
+    if (!mgmt_master) {
+        resp_error(err_NO_MGMT);
+        return true;
+    }
+
+    if (!memcmp(p_mode, "on", 2))
+        val = 1;
+    else if (!memcmp(p_mode, "off", 3))
+        val = 0;
+    else
+        return false;
+
+    memset(&cp, 0, sizeof(cp));
+    cp.val = val;
+
+    // at this time only index 0 is supported
+    if (mgmt_send(mgmt_master, opcode,
+            mgmt_ind, sizeof(cp), &cp,
+            set_mode_complete, cur_conn, NULL) == 0) {
+        resp_mgmt(err_SUCCESS);
+    }
+    return true;
+}
+
+
+static void cmd_le(int argcp, char **argvp)
+{
+    if (argcp < 2) {
+        resp_mgmt(err_BAD_PARAM);
+        return;
+    }
+
+    if (!set_mode(MGMT_OP_SET_LE, argvp[1])) {
+        resp_mgmt(err_BAD_PARAM);
+    }
+}
+
+static void add_remote_oob_data_complete(uint8_t status, uint16_t len,
+                    const void *param, void *user_data)
+{
+    const struct mgmt_addr_info *rp = param;
+    char str[18];
+    cur_conn = user_data;
+    if (status) {
+        DBG("status returned error : %s (0x%02x)",
+            mgmt_errstr(status), status);
+        resp_mgmt_err(status);
+        return;
+    }
+    ba2str(&rp->bdaddr, str);
+    DBG("  Remote data added for : %s\n", str);
+}
+
+static bool add_remote_oob_data(uint16_t index, const bdaddr_t *bdaddr,
+                const uint8_t addr_type,
+                const char *hash192, const char *rand192,
+                const char *hash256, const char *rand256)
+{
+    struct mgmt_cp_add_remote_oob_data cp;
+    uint8_t *oob;
+    size_t len;
+
+    if (!mgmt_master) {
+        resp_error(err_NO_MGMT);
+        return true;
+    }
+
+    memset(&cp, 0, sizeof(cp));
+    bacpy(&cp.addr.bdaddr, bdaddr);
+    cp.addr.type = addr_type;
+    if (hash192 && rand192) {
+        len = gatt_attr_data_from_string(hash192, &oob);
+        if (len == 0) {
+            resp_error(err_BAD_PARAM);
+            g_free(oob);
+            return false;
+        }
+        memcpy(cp.hash192, oob, 16);
+        g_free(oob);
+        len = gatt_attr_data_from_string(rand192, &oob);
+        if (len == 0) {
+            resp_error(err_BAD_PARAM);
+            memset(cp.hash192, 0, 16);
+            g_free(oob);
+            return false;
+        }
+        memcpy(cp.rand192, rand192, 16);
+        g_free(oob);
+    } else {
+        memset(cp.hash192, 0, 16);
+        memset(cp.rand192, 0, 16);
+    }
+    if (hash256 && rand256) {
+        len = gatt_attr_data_from_string(hash256, &oob);
+        if (len == 0) {
+            resp_error(err_BAD_PARAM);
+            memset(cp.hash192, 0, 16);
+            memset(cp.rand192, 0, 16);
+            g_free(oob);
+            return false;
+        }
+        memcpy(cp.hash256, oob, 16);
+        g_free(oob);
+        len = gatt_attr_data_from_string(rand256, &oob);
+        if (len == 0) {
+            resp_error(err_BAD_PARAM);
+            memset(cp.hash192, 0, 16);
+            memset(cp.rand192, 0, 16);
+            memset(cp.hash256, 0, 16);
+            g_free(oob);
+            return false;
+        }
+        memcpy(cp.rand256, rand256, 16);
+        g_free(oob);
+    } else {
+        memset(cp.hash256, 0, 16);
+        memset(cp.rand256, 0, 16);
+    }
+    if (mgmt_send(mgmt_master, MGMT_OP_ADD_REMOTE_OOB_DATA, mgmt_ind, sizeof(cp), &cp,
+                        add_remote_oob_data_complete,
+                        cur_conn, NULL) == 0) {
+        resp_error(err_SEND_FAIL);
+        g_free(oob);
+        return false;
+    }
+    g_free(oob);
+    return true;
+}
+
+static void cmd_add_oob(int argcp, char **argvp)
+{
+    bdaddr_t bdaddr;
+    char *C192 = NULL;
+    char *R192 = NULL;
+    char *C256 = NULL;
+    char *R256 = NULL;
+    uint8_t addr_type = BDADDR_LE_RANDOM;
+
+    if (argcp < 7) {
+        resp_mgmt(err_BAD_PARAM);
+        return;
+    }
+
+    if (str2ba(argvp[1], &bdaddr)) {
+        resp_mgmt(err_NOT_FOUND);
+        return;
+    }
+
+    if (!memcmp(argvp[2], "public", 6)) {
+        addr_type = BDADDR_LE_PUBLIC;
+    }
+
+    if ((!memcmp(argvp[3], "C_192", 5)) && (!memcmp(argvp[5], "R_192", 5))) {
         C192 = argvp[4];
         R192 = argvp[6];
         if ((argcp > 8) && !memcmp(argvp[5], "C_256", 5) && (!memcmp(argvp[7], "R_256", 5))) {
             C256 = argvp[6];
             R256 = argvp[8];
         }
-    } else if ((!memcmp(argvp[3], "C_256", 5)) && (!memcmp(argvp[5], "R_256", 5))) {
-        C256 = argvp[4];
-        R256 = argvp[6];
-    }
+    } else if ((!memcmp(argvp[3], "C_256", 5)) && (!memcmp(argvp[5], "R_256", 5))) {
+        C256 = argvp[4];
+        R256 = argvp[6];
+    }
+
+    if (!add_remote_oob_data(0, &bdaddr, addr_type, C192, R192, C256, R256)) {
+        DBG("Failed to add remote oob data");
+    }
+}
+
+static void read_local_oob_data_complete(uint8_t status, uint16_t len,
+                    const void *param, void *user_data)
+{
+    const struct mgmt_rp_read_local_oob_ext_data *rp = param;
+    uint32_t eir_len = rp->eir_len;
+    unsigned int i;
+
+    cur_conn = user_data;
+    if (status) {
+        DBG("status returned error : %s (0x%02x)",
+            mgmt_errstr(status), status);
+        resp_mgmt_err(status);
+        return;
+    }
+    DBG("received local OOB ext with eir_len = %d",eir_len);
+    for (i = 0; i<eir_len; i++)
+        DBG("0x%02x ", rp->eir[i]);
+    
+    resp_begin(rsp_OOB);
+    send_data(rp->eir, eir_len);
+    resp_end();
+}
+
+static bool read_local_oob_data(uint16_t index)
+{
+    struct mgmt_cp_read_local_oob_ext_data cp;
+
+    if (!mgmt_master) {
+        resp_error(err_NO_MGMT);
+        return true;
+    }
+    /* For now we only handle BLE OOB */
+    cp.type = 6;
+    if (mgmt_send(mgmt_master, MGMT_OP_READ_LOCAL_OOB_EXT_DATA, mgmt_ind, sizeof(cp), &cp,
+                        read_local_oob_data_complete,
+                        cur_conn, NULL) == 0) {
+        resp_error(err_SEND_FAIL);
+        return false;
+    }
+    return true;
+}
+
+static void cmd_read_oob(int argcp, char **argvp)
+{
+    if (!read_local_oob_data(0)) {
+        DBG("Failed to read local oob data");
+    }
+}
+
+static void cmd_pairable(int argcp, char **argvp)
+{
+    if (argcp < 2) {
+        resp_mgmt(err_BAD_PARAM);
+        return;
+    }
+
+    if (!set_mode(MGMT_OP_SET_BONDABLE, argvp[1])) {
+        resp_mgmt(err_BAD_PARAM);
+    }
+}
+
+static void pair_device_complete(uint8_t status, uint16_t length,
+                    const void *param, void *user_data)
+{
+    cur_conn = user_data;
+    if (status != MGMT_STATUS_SUCCESS) {
+        DBG("status returned error : %s (0x%02x)",
+                mgmt_errstr(status), status);
+        resp_mgmt_err(status);
+        return;
+    }
+
+    resp_mgmt(err_SUCCESS);
+}
+
+static void cmd_pair(int argcp, char **argvp)
+{
+    struct conn *conn = cur_conn;
+    struct mgmt_cp_pair_device cp;
+    bdaddr_t bdaddr;
+    uint8_t io_cap = IO_CAPABILITY_NOINPUTNOOUTPUT;
+    uint8_t addr_type = BDADDR_LE_RANDOM;
+
+    if (!mgmt_master) {
+        resp_error(err_NO_MGMT);
+        return;
+    }
+
+    if (conn->state != STATE_CONNECTED) {
+        resp_mgmt(err_BAD_STATE);
+        return;
+    }
+
+    if (str2ba(conn->dst, &bdaddr)) {
+        resp_mgmt(err_NOT_FOUND);
+        return;
+    }
+
+    if (!memcmp(conn->dst_type, "public", 6)) {
+        addr_type = BDADDR_LE_PUBLIC;
+    }
+
+    memset(&cp, 0, sizeof(cp));
+    bacpy(&cp.addr.bdaddr, &bdaddr);
+    cp.addr.type = addr_type;
+    cp.io_cap = io_cap;
+
+    if (mgmt_send(mgmt_master, MGMT_OP_PAIR_DEVICE,
+            mgmt_ind, sizeof(cp), &cp,
+                pair_device_complete, conn,
+                NULL) == 0) {
+        DBG("mgmt_send(MGMT_OP_PAIR_DEVICE) failed for %s for hci%u", conn->dst, mgmt_ind);
+        resp_mgmt(err_SEND_FAIL);
+        return;
+    }
+}
+
+static void unpair_device_complete(uint8_t status, uint16_t length,
+                    const void *param, void *user_data)
+{
+    cur_conn = user_data;
+    if (status != MGMT_STATUS_SUCCESS) {
+        DBG("status returned error : %s (0x%02x)",
+                mgmt_errstr(status), status);
+        resp_mgmt_err(status);
+        return;
+    }
+
+    resp_mgmt(err_SUCCESS);
+}
+
+static void cmd_unpair(int argcp, char **argvp)
+{
+    struct conn *conn = cur_conn;
+    struct mgmt_cp_unpair_device cp;
+    bdaddr_t bdaddr;
+    uint8_t addr_type = BDADDR_LE_RANDOM;
+
+    if (!mgmt_master) {
+        resp_error(err_NO_MGMT);
+        return;
+    }
+
+    if (str2ba(conn->dst, &bdaddr)) {
+        DBG("str2ba failed");
+        resp_mgmt(err_NOT_FOUND);
+        return;
+    }
+
+    if (!memcmp(conn->dst_type, "public", 6)) {
+        addr_type = BDADDR_LE_PUBLIC;
+    }
+
+    memset(&cp, 0, sizeof(cp));
+    bacpy(&cp.addr.bdaddr, &bdaddr);
+    cp.addr.type = addr_type;
+    cp.disconnect = 1;
+
+    if (mgmt_send(mgmt_master, MGMT_OP_UNPAIR_DEVICE,
+            mgmt_ind, sizeof(cp), &cp,
+            unpair_device_complete, conn,
+                NULL) == 0) {
+        DBG("mgmt_send(MGMT_OP_UNPAIR_DEVICE) failed for %s for hci%u", conn->dst, mgmt_ind);
+        resp_mgmt(err_SEND_FAIL);
+        return;
+    }
+}
+
+/* A daemon runs one scan for every session which asks for it: the first
+ * "scan" or "pasv" starts it, later ones join it, and the last to leave
+ * stops it. Results and scan state changes go to each of them.
+ */
+static void scan_set_state(enum state st)
+{
+    GSList *l;
+
+    set_state(scan_conn, st);
+    for (l = scan_subs; l; l = l->next)
+        set_state(l->data, st);
+
+    /* Each restarts the scan if it still wants one */
+    if (st == STATE_DISCONNECTED) {
+        g_slist_free(scan_subs);
+        scan_subs = NULL;
+    }
+}
+
+/* The settings of the scan (scanparams, whitelist, scanfilter, dedup and
+ * irks) are the adapter's, so every session sharing the scan gets the same
+ * results. A session can't change them while another session is using
+ * the scan: the command is answered with busy. Settings last until the
+ * session which made them ends.
+ */
+static struct session *scan_config_owner = NULL;
+
+static void scan_config_reset(void);
+
+/* TRUE (after answering) if another session is sharing the scan, so the
+ * settings must stay as they are: asking for the same ones succeeds */
+static gboolean scan_config_busy(gboolean same)
+{
+    GSList *l;
+
+    if (!daemon_path)
+        return FALSE;
+
+    for (l = scan_subs; l; l = l->next) {
+        struct conn *conn = l->data;
+
+        if (conn->session != cur_session) {
+            resp_mgmt(same ? err_SUCCESS : err_BUSY);
+            return TRUE;
+        }
+    }
+
+    scan_config_owner = cur_session;
+    return FALSE;
+}
+
+/* TRUE if the connection joined a scan already under way */
+static gboolean scan_join(void)
+{
+    gboolean running = (scan_subs != NULL);
+
+    if (!daemon_path)
+        return FALSE;
+
+    if (!g_slist_find(scan_subs, cur_conn))
+        scan_subs = g_slist_append(scan_subs, cur_conn);
+    if (!running) {
+        /* Left behind by a session which has gone */
+        if (!scan_config_owner)
+            scan_config_reset();
+        return FALSE;
+    }
+
+    resp_mgmt(err_SUCCESS);
+    set_state(cur_conn, STATE_SCANNING);
+    return TRUE;
+}
+
+/* TRUE if the connection left a scan others are still using */
+static gboolean scan_leave(void)
+{
+    if (!daemon_path)
+        return FALSE;
+
+    scan_subs = g_slist_remove(scan_subs, cur_conn);
+    if (scan_subs) {
+        resp_mgmt(err_SUCCESS);
+        set_state(cur_conn, STATE_DISCONNECTED);
+        return TRUE;
+    }
+
+    /* The last one stops the scan, and hears when it has */
+    scan_subs = g_slist_append(NULL, cur_conn);
+    return FALSE;
+}
+
+static void scan_cb(uint8_t status, uint16_t length, const void *param, void *user_data)
+{
+    cur_conn = user_data;
+    if (status != MGMT_STATUS_SUCCESS) {
+        DBG("Scan error: %s (0x%02x)", mgmt_errstr(status), status);
+        scan_subs = g_slist_remove(scan_subs, cur_conn);
+        if (status==MGMT_STATUS_BUSY)
+          resp_mgmt(err_BUSY);
+        else
+          resp_mgmt_err(status);
+        return;
+    }
+
+    resp_mgmt(err_SUCCESS);
+}
+
+#include "hci.h"
+#include "hci_lib.h"
+
+/* HCI commands are sent without waiting for the controller: each is
+ * queued on a raw socket for its adapter and sent once the one before it
+ * has been answered. The Command Status or Command Complete event with
+ * its opcode, read by hci_monitor_cb() along with any advertising
+ * reports, completes it; one which is also answered by an LE subevent
+ * (hci_cmd.meta) waits for that. The callback is given the HCI status
+ * and the return parameters (event parameters for a subevent), or
+ * HCI_NO_REPLY if the controller doesn't answer in time. An adapter's
+ * socket is closed again once it has nothing left to do.
+ */
+#define HCI_NO_REPLY        0xFF
+#define HCI_CMD_TIMEOUT     10000
+
+typedef void (*hci_cmd_func)(uint8_t status, const uint8_t *rp, uint8_t rlen,
+                                void *user_data);
+
+struct hci_ctrl;
+
+struct hci_cmd {
+    struct hci_ctrl *ctrl;
+    uint16_t opcode;
+    uint8_t meta;                   /* LE subevent which completes it */
+    uint16_t handle;                /* connection the subevent is for */
+    uint8_t clen;
+    uint8_t cp[HCI_MAX_EVENT_SIZE];
+    unsigned int timeout;           /* ms, from when it is sent */
+    unsigned int timer;
+    hci_cmd_func func;
+    void *user_data;
+};
+
+struct hci_ctrl {
+    int index;
+    struct io *io;
+    GQueue *queue;                  /* Not yet sent */
+    struct hci_cmd *sent;           /* Waiting for Status or Complete */
+    GSList *waiting;                /* Waiting for their LE subevent */
+    gboolean scanning;              /* Passive scan reports wanted */
+    unsigned int idle;
+};
+
+static GSList *hci_ctrls = NULL;
+
+static bool hci_monitor_cb(struct io *io, void *user_data);
+
+static void hci_ctrl_next(struct hci_ctrl *ctrl);
+
+static struct hci_ctrl *hci_ctrl_find(int index)
+{
+    GSList *l;
+
+    for (l = hci_ctrls; l; l = l->next) {
+        struct hci_ctrl *ctrl = l->data;
+
+        if (ctrl->index == index)
+            return ctrl;
+    }
+
+    return NULL;
+}
+
+static struct hci_ctrl *hci_ctrl_get(int index)
+{
+    struct hci_ctrl *ctrl = hci_ctrl_find(index);
+    struct hci_filter nf;
+    int dd;
+
+    if (ctrl)
+        return ctrl;
+
+    dd = hci_open_dev(index);
+    if (dd < 0) {
+        DBG("Can't open hci%d: %s", index, strerror(errno));
+        return NULL;
+    }
+
+    /* Our own commands aren't seen on the socket, but those of anyone
+     * else are: an LE Set Scan Enable from elsewhere ends a scan */
+    hci_filter_clear(&nf);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+    hci_filter_set_ptype(HCI_COMMAND_PKT, &nf);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &nf);
+    hci_filter_set_event(EVT_CMD_STATUS, &nf);
+    hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+    if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
+        DBG("Can't set HCI filter: %s", strerror(errno));
+        hci_close_dev(dd);
+        return NULL;
+    }
+
+    ctrl = g_new0(struct hci_ctrl, 1);
+    ctrl->index = index;
+    ctrl->queue = g_queue_new();
+    ctrl->io = io_new(dd);
+    if (!ctrl->io) {
+        hci_close_dev(dd);
+        g_queue_free(ctrl->queue);
+        g_free(ctrl);
+        return NULL;
+    }
+    io_set_close_on_destroy(ctrl->io, true);
+    io_set_read_handler(ctrl->io, hci_monitor_cb, ctrl, NULL);
+
+    hci_ctrls = g_slist_prepend(hci_ctrls, ctrl);
+    return ctrl;
+}
+
+static bool hci_ctrl_close(void *user_data)
+{
+    struct hci_ctrl *ctrl = user_data;
+
+    ctrl->idle = 0;
+    if (ctrl->scanning || ctrl->sent || ctrl->waiting ||
+            !g_queue_is_empty(ctrl->queue))
+        return false;
+
+    DBG("Closing hci%d", ctrl->index);
+    hci_ctrls = g_slist_remove(hci_ctrls, ctrl);
+    io_destroy(ctrl->io);
+    g_queue_free(ctrl->queue);
+    g_free(ctrl);
+    return false;
+}
+
+/* Closed from the loop rather than here, as a callback may still be
+ * reading from it */
+static void hci_ctrl_release(struct hci_ctrl *ctrl)
+{
+    if (!ctrl->idle && !ctrl->scanning && !ctrl->sent && !ctrl->waiting &&
+            g_queue_is_empty(ctrl->queue))
+        ctrl->idle = timeout_add(0, hci_ctrl_close, ctrl, NULL);
+}
+
+static void hci_cmd_done(struct hci_cmd *cmd, uint8_t status,
+                            const uint8_t *rp, uint8_t rlen)
+{
+    struct hci_ctrl *ctrl = cmd->ctrl;
+
+    if (cmd->timer)
+        timeout_remove(cmd->timer);
+    if (cmd->func)
+        cmd->func(status, rp, rlen, cmd->user_data);
+    g_free(cmd);
+
+    hci_ctrl_next(ctrl);
+    hci_ctrl_release(ctrl);
+}
+
+static bool hci_cmd_timeout(void *user_data)
+{
+    struct hci_cmd *cmd = user_data;
+    struct hci_ctrl *ctrl = cmd->ctrl;
+
+    DBG("HCI command 0x%04x timed out", cmd->opcode);
+    cmd->timer = 0;
+    if (ctrl->sent == cmd)
+        ctrl->sent = NULL;
+    else
+        ctrl->waiting = g_slist_remove(ctrl->waiting, cmd);
+    hci_cmd_done(cmd, HCI_NO_REPLY, NULL, 0);
+    return false;
+}
+
+static void hci_ctrl_next(struct hci_ctrl *ctrl)
+{
+    uint8_t pkt[1 + HCI_COMMAND_HDR_SIZE + HCI_MAX_EVENT_SIZE];
+    hci_command_hdr *hdr = (void *) (pkt + 1);
+    struct hci_cmd *cmd;
+    ssize_t len;
+
+    while (!ctrl->sent && (cmd = g_queue_pop_head(ctrl->queue)) != NULL) {
+        pkt[0] = HCI_COMMAND_PKT;
+        hdr->opcode = htobs(cmd->opcode);
+        hdr->plen = cmd->clen;
+        memcpy(pkt + 1 + HCI_COMMAND_HDR_SIZE, cmd->cp, cmd->clen);
+
+        do {
+            len = write(io_get_fd(ctrl->io), pkt,
+                        1 + HCI_COMMAND_HDR_SIZE + cmd->clen);
+        } while (len < 0 && errno == EINTR);
+
+        if (len < 0) {
+            DBG("HCI command 0x%04x not sent: %s", cmd->opcode, strerror(errno));
+            if (cmd->func)
+                cmd->func(HCI_NO_REPLY, NULL, 0, cmd->user_data);
+            g_free(cmd);
+            continue;
+        }
+
+        ctrl->sent = cmd;
+        cmd->timer = timeout_add(cmd->timeout, hci_cmd_timeout, cmd, NULL);
+    }
+}
+
+static struct hci_cmd *hci_cmd_new(uint16_t ocf, const void *cp, uint8_t clen,
+                                    hci_cmd_func func, void *user_data)
+{
+    struct hci_cmd *cmd = g_new0(struct hci_cmd, 1);
+
+    cmd->opcode = cmd_opcode_pack(OGF_LE_CTL, ocf);
+    cmd->timeout = HCI_CMD_TIMEOUT;
+    cmd->clen = clen;
+    if (clen)
+        memcpy(cmd->cp, cp, clen);
+    cmd->func = func;
+    cmd->user_data = user_data;
+    return cmd;
+}
+
+/* Queues an LE controller command; FALSE, without calling func, if the
+ * adapter can't be reached */
+static gboolean hci_cmd_send(int index, struct hci_cmd *cmd)
+{
+    struct hci_ctrl *ctrl = hci_ctrl_get(index);
+
+    if (!ctrl) {
+        g_free(cmd);
+        return FALSE;
+    }
+
+    cmd->ctrl = ctrl;
+    g_queue_push_tail(ctrl->queue, cmd);
+    hci_ctrl_next(ctrl);
+    return TRUE;
+}
+
+static gboolean hci_send(int index, uint16_t ocf, const void *cp, uint8_t clen,
+                            hci_cmd_func func, void *user_data)
+{
+    return hci_cmd_send(index, hci_cmd_new(ocf, cp, clen, func, user_data));
+}
+
+/* Drops the callbacks still to come for user_data */
+static void hci_cancel(void *user_data)
+{
+    GSList *l, *next;
+    GList *q, *qnext;
+
+    for (l = hci_ctrls; l; l = l->next) {
+        struct hci_ctrl *ctrl = l->data;
+
+        if (ctrl->sent && ctrl->sent->user_data == user_data)
+            ctrl->sent->func = NULL;
+
+        for (q = ctrl->queue->head; q; q = qnext) {
+            struct hci_cmd *cmd = q->data;
+
+            qnext = q->next;
+            if (cmd->user_data == user_data) {
+                g_queue_delete_link(ctrl->queue, q);
+                g_free(cmd);
+            }
+        }
+
+        for (next = ctrl->waiting; next; ) {
+            struct hci_cmd *cmd = next->data;
+
+            next = next->next;
+            if (cmd->user_data == user_data) {
+                ctrl->waiting = g_slist_remove(ctrl->waiting, cmd);
+                timeout_remove(cmd->timer);
+                g_free(cmd);
+            }
+        }
+
+        hci_ctrl_release(ctrl);
+    }
+}
+
+/* Command Complete or Command Status for the command sent */
+static void hci_cmd_event(struct hci_ctrl *ctrl, uint8_t evt,
+                            const uint8_t *ptr, uint8_t plen)
+{
+    struct hci_cmd *cmd = ctrl->sent;
+    uint16_t opcode;
+
+    if (evt == EVT_CMD_COMPLETE) {
+        if (plen < EVT_CMD_COMPLETE_SIZE)
+            return;
+        opcode = bt_get_le16(ptr + 1);
+        ptr += EVT_CMD_COMPLETE_SIZE;
+        plen -= EVT_CMD_COMPLETE_SIZE;
+    } else {
+        if (plen < EVT_CMD_STATUS_SIZE)
+            return;
+        opcode = bt_get_le16(ptr + 2);
+    }
+
+    if (!cmd || cmd->opcode != opcode)
+        return;
+
+    ctrl->sent = NULL;
+
+    /* A command still to be answered by a subevent frees the controller
+     * for the next one */
+    if (evt == EVT_CMD_STATUS && ptr[0] == 0 && cmd->meta) {
+        ctrl->waiting = g_slist_append(ctrl->waiting, cmd);
+        hci_ctrl_next(ctrl);
+        return;
+    }
+
+    if (evt == EVT_CMD_COMPLETE)
+        hci_cmd_done(cmd, plen ? ptr[0] : HCI_NO_REPLY, ptr, plen);
+    else
+        hci_cmd_done(cmd, ptr[0], NULL, 0);
+}
+
+/* LE subevent, which may answer a command waiting for it */
+static void hci_meta_event(struct hci_ctrl *ctrl, uint8_t subevent,
+                            const uint8_t *ptr, uint8_t plen)
+{
+    GSList *l;
+
+    /* Status, then the connection handle */
+    if (plen < 3)
+        return;
+
+    for (l = ctrl->waiting; l; l = l->next) {
+        struct hci_cmd *cmd = l->data;
+
+        if (cmd->meta == subevent && cmd->handle == bt_get_le16(ptr + 1)) {
+            ctrl->waiting = g_slist_delete_link(ctrl->waiting, l);
+            hci_cmd_done(cmd, ptr[0], ptr, plen);
+            return;
+        }
+    }
+}
+
+/* Link profile, set with "link [<key> <value>] ..." before "conn". Once
+ * connected, and before the connection is reported, the helper asks for:
+ *
+ *   mtu <n>        ATT MTU (Exchange MTU)
+ *   dle <n>        LE Data Length, max TX octets (1B-FB)
+ *   phy 1m|2m|coded  preferred PHY for both directions
+ *   int <n>        connection interval in 1.25 ms units (6-C80)
+ *   lat <n>        peripheral latency (0-1F3)
+ *   tmo <n>        supervision timeout in 10 ms units (A-C80)
+ *
+ * The HCI steps are taken one after another through the HCI command
+ * queue, bounded by LINK_HCI_TIMEOUT each, so the loop keeps running
+ * meanwhile; what was granted is added to the "stat" response. A failed step
+ * is left out rather than failing the connection. The profile is used by
+ * one connection only.
+ */
+#define OCF_LE_SET_DATA_LENGTH          0x0022
+#define OCF_LE_SET_PHY                  0x0032
+#define EVT_LE_PHY_UPDATE_COMPLETE      0x0C
+#define LINK_HCI_TIMEOUT                1000
+#define LINK_TIMEOUT_DEFAULT            0x01F4
+
+static void link_mtu_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                            gpointer user_data)
+{
+    struct conn *conn = user_data;
+    uint16_t mtu;
+
+    if (conn->state != STATE_CONNECTING)
+        return;
+
+    if (status == 0 && dec_mtu_resp(pdu, plen, &mtu)) {
+        mtu = MIN(mtu, conn->link.mtu);
+        if (mtu >= ATT_DEFAULT_LE_MTU && g_attrib_set_mtu(conn->attrib, mtu))
+            conn->mtu = mtu;
+    }
+
+    memset(&conn->link, 0, sizeof(conn->link));
+    set_state(conn, STATE_CONNECTED);
+}
+
+static void link_step(struct conn *conn);
+
+static void link_dle_cb(uint8_t status, const uint8_t *rp, uint8_t rlen,
+                            void *user_data)
+{
+    struct conn *conn = user_data;
+
+    if (status == 0)
+        conn->granted.dle = conn->link.dle;
+    else
+        DBG("LE Set Data Length failed");
+
+    conn->link.dle = 0;
+    link_step(conn);
+}
+
+static void link_phy_cb(uint8_t status, const uint8_t *rp, uint8_t rlen,
+                            void *user_data)
+{
+    struct conn *conn = user_data;
+
+    /* LE PHY Update Complete: status, handle, TX PHY, RX PHY */
+    if (status == 0 && rlen >= 5) {
+        conn->granted.phys = rp[3];
+        conn->rx_phy = rp[4];
+    } else
+        DBG("LE Set PHY failed");
+
+    conn->link.phys = 0;
+    link_step(conn);
+}
+
+static void link_interval_cb(uint8_t status, const uint8_t *rp, uint8_t rlen,
+                                void *user_data)
+{
+    struct conn *conn = user_data;
+    evt_le_connection_update_complete evt;
+
+    if (status == 0 && rlen >= sizeof(evt)) {
+        memcpy(&evt, rp, sizeof(evt));
+        conn->granted.interval = btohs(evt.interval);
+        conn->granted.latency = btohs(evt.latency);
+        conn->granted.timeout = btohs(evt.supervision_timeout);
+    } else
+        DBG("LE Connection Update failed");
+
+    conn->link.interval = 0;
+    link_step(conn);
+}
+
+/* Queues the command for one step; FALSE if the adapter can't be used */
+static gboolean link_send(struct conn *conn, uint16_t ocf, const void *cp,
+                            uint8_t clen, uint8_t meta, hci_cmd_func func)
+{
+    struct hci_cmd *cmd;
+
+    if (conn->hci_index < 0)
+        return FALSE;
+
+    cmd = hci_cmd_new(ocf, cp, clen, func, conn);
+    cmd->meta = meta;
+    cmd->handle = conn->handle;
+    cmd->timeout = LINK_HCI_TIMEOUT;
+    return hci_cmd_send(conn->hci_index, cmd);
+}
+
+/* Takes the next step of the link profile; each step's callback clears
+ * it from conn->link and comes back here */
+static void link_step(struct conn *conn)
+{
+    struct link_profile *link = &conn->link;
+    uint8_t cp[LE_CONN_UPDATE_CP_SIZE];
+
+    if (link->dle) {
+        /* TX time for that many octets on the 1M PHY */
+        bt_put_le16(conn->handle, cp);
+        bt_put_le16(link->dle, cp + 2);
+        bt_put_le16((link->dle + 14) * 8, cp + 4);
+        if (link_send(conn, OCF_LE_SET_DATA_LENGTH, cp, 6, 0, link_dle_cb))
+            return;
+        link->dle = 0;
+    }
+
+    if (link->phys) {
+        bt_put_le16(conn->handle, cp);
+        cp[2] = 0x00;           /* Preferences for both directions */
+        cp[3] = link->phys;
+        cp[4] = link->phys;
+        bt_put_le16(0x0000, cp + 5);
+        if (link_send(conn, OCF_LE_SET_PHY, cp, 7, EVT_LE_PHY_UPDATE_COMPLETE,
+                        link_phy_cb))
+            return;
+        link->phys = 0;
+    }
+
+    if (link->interval) {
+        le_connection_update_cp ucp;
+
+        memset(&ucp, 0, sizeof(ucp));
+        ucp.handle = htobs(conn->handle);
+        ucp.min_interval = htobs(link->interval);
+        ucp.max_interval = htobs(link->interval);
+        ucp.latency = htobs(link->latency);
+        ucp.supervision_timeout = htobs(link->timeout);
+        ucp.min_ce_length = htobs(0x0001);
+        ucp.max_ce_length = htobs(0x0001);
+        if (link_send(conn, OCF_LE_CONN_UPDATE, &ucp, LE_CONN_UPDATE_CP_SIZE,
+                        EVT_LE_CONN_UPDATE_COMPLETE, link_interval_cb))
+            return;
+        link->interval = 0;
+    }
+
+    if (link->mtu > ATT_DEFAULT_LE_MTU &&
+            gatt_exchange_mtu(conn->attrib, link->mtu, link_mtu_cb, conn) != 0)
+        return;
+
+    memset(link, 0, sizeof(*link));
+    set_state(conn, STATE_CONNECTED);
+}
+
+static void link_apply(struct conn *conn)
+{
+    struct link_profile *link = &conn->link;
+    GError *gerr = NULL;
+    bdaddr_t src;
+
+    conn->hci_index = -1;
+    if (link->dle || link->phys || link->interval) {
+        bt_io_get(conn->iochannel, &gerr, BT_IO_OPT_SOURCE_BDADDR, &src,
+                    BT_IO_OPT_HANDLE, &conn->handle, BT_IO_OPT_INVALID);
+        if (gerr) {
+            DBG("Can't get connection handle: %s", gerr->message);
+            g_error_free(gerr);
+        } else if ((conn->hci_index = hci_get_route(&src)) < 0)
+            DBG("Can't find HCI device: %s", strerror(errno));
+    }
+
+    link_step(conn);
+}
+
+static void cmd_link(int argcp, char **argvp)
+{
+    struct conn *conn = cur_conn;
+    struct link_profile link;
+    long long val;
+    int i;
+
+    if ((argcp - 1) % 2 != 0) {
+        resp_mgmt(err_BAD_PARAM);
+        return;
+    }
+
+    memset(&link, 0, sizeof(link));
+    link.timeout = LINK_TIMEOUT_DEFAULT;
+
+    for (i = 1; i < argcp; i += 2) {
+        const char *key = argvp[i], *arg = argvp[i + 1];
+
+        errno = 0;
+        val = strtoll(arg, NULL, 16);
+
+        if (strcmp(key, "phy") == 0 && strcmp(arg, "1m") == 0)
+            link.phys = 0x01;
+        else if (strcmp(key, "phy") == 0 && strcmp(arg, "2m") == 0)
+            link.phys = 0x02;
+        else if (strcmp(key, "phy") == 0 && strcmp(arg, "coded") == 0)
+            link.phys = 0x04;
+        else if (strcmp(key, "mtu") == 0 && errno == 0 &&
+                                val >= ATT_DEFAULT_LE_MTU && val <= 0xFFFF)
+            link.mtu = val;
+        else if (strcmp(key, "dle") == 0 && errno == 0 &&
+                                val >= 0x001B && val <= 0x00FB)
+            link.dle = val;
+        else if (strcmp(key, "int") == 0 && errno == 0 &&
+                                val >= 0x0006 && val <= 0x0C80)
+            link.interval = val;
+        else if (strcmp(key, "lat") == 0 && errno == 0 &&
+                                val >= 0x0000 && val <= 0x01F3)
+            link.latency = val;
+        else if (strcmp(key, "tmo") == 0 && errno == 0 &&
+                                val >= 0x000A && val <= 0x0C80)
+            link.timeout = val;
+        else {
+            resp_mgmt(err_BAD_PARAM);
+            return;
+        }
+    }
+
+    /* The supervision timeout must outlast two (latency-skipped) events */
+    if (link.interval &&
+            link.timeout * 4 <= (1 + link.latency) * link.interval) {
+        resp_mgmt(err_BAD_PARAM);
+        return;
+    }
+
+    conn->link = link;
+    resp_mgmt(err_SUCCESS);
+}
+
+/* Accept list, set with "whitelist [<address> <type>] ...". A passive
+ * scan programs it into the controller's white list and scans with filter
+ * policy 1, so the host is never woken for other devices. If the list is
+ * longer than the controller can hold (or this fails), and for scans
+ * through mgmt, reports are checked against it in software instead.
+ */
+#define SCAN_WHITELIST_MAX  256
+
+static struct mgmt_addr_info scan_whitelist[SCAN_WHITELIST_MAX];
+static int scan_nwhitelist;
+static gboolean scan_hw_whitelist;  /* controller is doing the filtering */
+
+static gboolean scan_whitelisted(const struct mgmt_addr_info *addr)
+{
+    int i;
+
+    if (scan_nwhitelist == 0 || scan_hw_whitelist)
+        return TRUE;
+
+    for (i = 0; i < scan_nwhitelist; i++)
+        if (memcmp(&scan_whitelist[i], addr, sizeof(*addr)) == 0)
+            return TRUE;
+
+    return FALSE;
+}
+
+static void discover_params(struct conn *conn, uint8_t filter_policy);
+
+static int scan_whitelist_pending;  /* commands still to be answered */
+static gboolean scan_whitelist_failed;
+
+static void scan_whitelist_cb(uint8_t status, const uint8_t *rp, uint8_t rlen,
+                                void *user_data)
+{
+    if (status)
+        scan_whitelist_failed = TRUE;
+    if (--scan_whitelist_pending > 0)
+        return;
+
+    if (scan_whitelist_failed) {
+        DBG("Programming white list failed, filtering in software");
+        hci_send(mgmt_ind, OCF_LE_CLEAR_WHITE_LIST, NULL, 0, NULL, NULL);
+        discover_params(user_data, 0x00);
+        return;
+    }
+
+    scan_hw_whitelist = TRUE;
+    discover_params(user_data, 0x01);
+}
+
+/* The clear and every add are queued at once, and the scan goes on with
+ * the filter policy to use once the last of them is answered */
+static void scan_whitelist_size_cb(uint8_t status, const uint8_t *rp,
+                                    uint8_t rlen, void *user_data)
+{
+    le_add_device_to_white_list_cp cp;
+    int i;
+
+    if (status || rlen < LE_READ_WHITE_LIST_SIZE_RP_SIZE ||
+                                        rp[1] < scan_nwhitelist) {
+        DBG("White list too small, filtering in software");
+        discover_params(user_data, 0x00);
+        return;
+    }
+
+    scan_whitelist_pending = scan_nwhitelist + 1;
+    scan_whitelist_failed = FALSE;
+    hci_send(mgmt_ind, OCF_LE_CLEAR_WHITE_LIST, NULL, 0, scan_whitelist_cb,
+                user_data);
+    for (i = 0; i < scan_nwhitelist; i++) {
+        cp.bdaddr_type = scan_whitelist[i].type == BDADDR_LE_RANDOM ?
+                            LE_RANDOM_ADDRESS : LE_PUBLIC_ADDRESS;
+        bacpy(&cp.bdaddr, &scan_whitelist[i].bdaddr);
+        hci_send(mgmt_ind, OCF_LE_ADD_DEVICE_TO_WHITE_LIST, &cp,
+                    LE_ADD_DEVICE_TO_WHITE_LIST_CP_SIZE, scan_whitelist_cb,
+                    user_data);
+    }
+}
+
+static void cmd_whitelist(int argcp, char **argvp)
+{
+    struct mgmt_addr_info list[SCAN_WHITELIST_MAX];
+    int i, n = 0;
+
+    if ((argcp - 1) % 2 != 0 || (argcp - 1) / 2 > SCAN_WHITELIST_MAX) {
+        resp_mgmt(err_BAD_PARAM);
+        return;
+    }
+
+    for (i = 1; i < argcp; i += 2, n++) {
+        if (str2ba(argvp[i], &list[n].bdaddr) < 0) {
+            resp_mgmt(err_BAD_PARAM);
+            return;
+        }
+
+        if (strcasecmp(argvp[i + 1], "public") == 0)
+            list[n].type = BDADDR_LE_PUBLIC;
+        else if (strcasecmp(argvp[i + 1], "random") == 0)
+            list[n].type = BDADDR_LE_RANDOM;
+        else {
+            resp_mgmt(err_BAD_PARAM);
+            return;
+        }
+    }
+
+    if (scan_config_busy(n == scan_nwhitelist &&
+                memcmp(list, scan_whitelist, n * sizeof(list[0])) == 0))
+        return;
+
+    /* Takes effect when the next scan starts */
+    memcpy(scan_whitelist, list, n * sizeof(list[0]));
+    scan_nwhitelist = n;
+    resp_mgmt(err_SUCCESS);
+}
+
+/* Parameters for scans through the raw HCI socket ("pasv"), set with
+ * "scanparams [<key> <value>] ...":
+ *
+ *   type active|passive   whether to request scan responses
+ *   int <n>, win <n>      scan interval and window, in 0.625ms units (hex)
+ *   own public|random     own address type
+ *   dup on|off            controller duplicate filtering
+ *   burst <ms>, idle <ms> duty cycle (hex); with both set, scanning is
+ *                         switched on for burst ms and off for idle ms
+ *
+ * Keys left out get their defaults back.
+ */
+struct scan_params {
+    uint8_t type;
+    uint16_t interval;
+    uint16_t window;
+    uint8_t own_type;
+    uint8_t filter_dup;
+    guint burst;
+    guint idle;
+};
+
+static const struct scan_params scan_params_default = {
+    0x00, 0x0010, 0x0010, LE_PUBLIC_ADDRESS, 0x00, 0, 0
+};
+
+static struct scan_params scan_params = {
+    0x00, 0x0010, 0x0010, LE_PUBLIC_ADDRESS, 0x00, 0, 0
+};
+
+static gboolean scan_pasv;          /* scan is through the raw HCI socket */
+static unsigned int scan_duty_timer = 0;
+static gboolean scan_duty_idle;
+
+static void scan_duty_sent(uint8_t status, const uint8_t *rp, uint8_t rlen,
+                            void *user_data)
+{
+    if (status)
+        DBG("Scan %s failed", scan_duty_idle ? "pause" : "resume");
+}
+
+static bool scan_duty_cb(void *user_data)
+{
+    le_set_scan_enable_cp cp;
+
+    /* Sent on the watched socket, which doesn't see its own commands,
+     * so the idle period isn't taken for the end of the scan */
+    scan_duty_idle = !scan_duty_idle;
+    cp.enable = scan_duty_idle ? 0x00 : 0x01;
+    cp.filter_dup = scan_params.filter_dup;
+    hci_send(mgmt_ind, OCF_LE_SET_SCAN_ENABLE, &cp,
+                LE_SET_SCAN_ENABLE_CP_SIZE, scan_duty_sent, NULL);
+
+    scan_duty_timer = timeout_add(scan_duty_idle ? scan_params.idle :
+                                scan_params.burst, scan_duty_cb, NULL, NULL);
+    return false;
+}
+
+static void scan_duty_stop(void)
+{
+    if (scan_duty_timer) {
+        timeout_remove(scan_duty_timer);
+        scan_duty_timer = 0;
+    }
+}
+
+static void cmd_scanparams(int argcp, char **argvp)
+{
+    struct scan_params params = scan_params_default;
+    long long val;
+    int i;
+
+    if ((argcp - 1) % 2 != 0) {
+        resp_mgmt(err_BAD_PARAM);
+        return;
+    }
+
+    for (i = 1; i < argcp; i += 2) {
+        const char *key = argvp[i], *arg = argvp[i + 1];
+
+        errno = 0;
+        val = strtoll(arg, NULL, 16);
+
+        if (strcmp(key, "type") == 0 && strcmp(arg, "active") == 0)
+            params.type = 0x01;
+        else if (strcmp(key, "type") == 0 && strcmp(arg, "passive") == 0)
+            params.type = 0x00;
+        else if (strcmp(key, "own") == 0 && strcmp(arg, "public") == 0)
+            params.own_type = LE_PUBLIC_ADDRESS;
+        else if (strcmp(key, "own") == 0 && strcmp(arg, "random") == 0)
+            params.own_type = LE_RANDOM_ADDRESS;
+        else if (strcmp(key, "dup") == 0 && strcmp(arg, "on") == 0)
+            params.filter_dup = 0x01;
+        else if (strcmp(key, "dup") == 0 && strcmp(arg, "off") == 0)
+            params.filter_dup = 0x00;
+        else if (strcmp(key, "int") == 0 && errno == 0 &&
+                                val >= 0x0004 && val <= 0x4000)
+            params.interval = val;
+        else if (strcmp(key, "win") == 0 && errno == 0 &&
+                                val >= 0x0004 && val <= 0x4000)
+            params.window = val;
+        else if (strcmp(key, "burst") == 0 && errno == 0 &&
+                                val >= 0 && val <= G_MAXINT)
+            params.burst = val;
+        else if (strcmp(key, "idle") == 0 && errno == 0 &&
+                                val >= 0 && val <= G_MAXINT)
+            params.idle = val;
+        else {
+            resp_mgmt(err_BAD_PARAM);
+            return;
+        }
+    }
+
+    if (params.window > params.interval) {
+        resp_mgmt(err_BAD_PARAM);
+        return;
+    }
+
+    if (scan_config_busy(params.type == scan_params.type &&
+                params.interval == scan_params.interval &&
+                params.window == scan_params.window &&
+                params.own_type == scan_params.own_type &&
+                params.filter_dup == scan_params.filter_dup &&
+                params.burst == scan_params.burst &&
+                params.idle == scan_params.idle))
+        return;
+
+    /* Takes effect when the next scan starts */
+    scan_params = params;
+    resp_mgmt(err_SUCCESS);
+}
+
+/* Scan filter, set with "scanfilter <rule> ...". The rules are compiled
+ * into a small table and checked against each raw report before anything
+ * is formatted. Values are hex in text commands, raw bytes in binary ones:
+ *
+ *   rssi <n>             drop reports weaker than -n dBm
+ *   addr <addr><mask>    address (display byte order) under mask matches
+ *   ad <type><prefix>    an AD structure of that type starts with prefix
+ *   uuid <uuid16 le>     16-bit service UUID in a UUID list or service data
+ *
+ * A report must pass the RSSI limit, match one of the addr rules if there
+ * are any, and match one of the ad/uuid rules if there are any. With no
+ * rules the filter is removed.
+ */
+#define SCAN_FILTER_MAX     32
+#define SCAN_FILTER_DATA    32
+
+enum filter_kind { FILTER_ADDR, FILTER_AD, FILTER_UUID };
+
+struct scan_rule {
+    enum filter_kind kind;
+    uint8_t len;
+    uint8_t val[SCAN_FILTER_DATA];
+    uint8_t mask[6];
+};
+
+static struct scan_rule scan_rules[SCAN_FILTER_MAX];
+static int scan_nrules;
+static int scan_min_rssi;   /* as a positive number of -dBm, 0 for none */
+static gboolean scan_addr_rules;
+static gboolean scan_data_rules;
+
+static gboolean scan_ad_match(const struct scan_rule *rule, uint8_t type,
+                                const uint8_t *val, size_t vlen)
+{
+    size_t i;
+
+    if (rule->kind == FILTER_AD)
+        return type == rule->val[0] && vlen + 1 >= rule->len &&
+                    memcmp(val, rule->val + 1, rule->len - 1) == 0;
+
+    /* FILTER_UUID: incomplete/complete 16-bit UUID lists, service data */
+    if (type == 0x02 || type == 0x03) {
+        for (i = 0; i + 2 <= vlen; i += 2)
+            if (memcmp(val + i, rule->val, 2) == 0)
+                return TRUE;
+    } else if (type == 0x16)
+        return vlen >= 2 && memcmp(val, rule->val, 2) == 0;
+
+    return FALSE;
+}
+
+/* Returns TRUE if the report passes the filter; rssi is -dBm */
+static gboolean scan_filter(const struct mgmt_addr_info *addr, int rssi,
+                            const uint8_t *data, size_t len)
+{
+    const struct scan_rule *rule;
+    size_t off, adlen;
+    gboolean match;
+    int i, j;
+
+    if (!scan_whitelisted(addr))
+        return FALSE;
+
+    if (scan_min_rssi && rssi > scan_min_rssi)
+        return FALSE;
+
+    if (scan_addr_rules) {
+        match = FALSE;
+        for (i = 0; i < scan_nrules && !match; i++) {
+            rule = &scan_rules[i];
+            if (rule->kind != FILTER_ADDR)
+                continue;
+            for (j = 0; j < 6; j++)
+                if ((addr->bdaddr.b[j] & rule->mask[j]) != rule->val[j])
+                    break;
+            match = (j == 6);
+        }
+        if (!match)
+            return FALSE;
+    }
+
+    if (!scan_data_rules)
+        return TRUE;
+
+    for (off = 0; off + 2 <= len; off += adlen + 1) {
+        adlen = data[off];
+        if (adlen == 0 || off + 1 + adlen > len)
+            break;
+        for (i = 0; i < scan_nrules; i++) {
+            rule = &scan_rules[i];
+            if (rule->kind != FILTER_ADDR &&
+                scan_ad_match(rule, data[off + 1], data + off + 2, adlen - 1))
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void cmd_scanfilter(int argcp, char **argvp)
+{
+    struct scan_rule rules[SCAN_FILTER_MAX];
+    struct scan_rule *rule;
+    int nrules = 0, min_rssi = 0;
+    uint8_t *value;
+    size_t vlen;
+    int i, j;
+
+    /* Zeroed so rules can be compared whole */
+    memset(rules, 0, sizeof(rules));
+
+    if ((argcp - 1) % 2 != 0) {
+        resp_mgmt(err_BAD_PARAM);
+        return;
+    }
+
+    for (i = 1; i < argcp; i += 2) {
+        value = NULL;
+        vlen = arg_data(argvp, i + 1, &value);
+
+        if (strcmp(argvp[i], "rssi") == 0 && vlen == 1) {
+            min_rssi = value[0];
+            g_free(value);
+            continue;
+        }
+
+        if (nrules == SCAN_FILTER_MAX) {
+            g_free(value);
+            resp_mgmt(err_BAD_PARAM);
+            return;
+        }
 
-    if (!add_remote_oob_data(0, &bdaddr, addr_type, C192, R192, C256, R256)) {
-        DBG("Failed to add remote oob data");
+        rule = &rules[nrules];
+        if (strcmp(argvp[i], "addr") == 0 && vlen == 12) {
+            rule->kind = FILTER_ADDR;
+            /* bdaddr_t is stored in reverse of display order */
+            for (j = 0; j < 6; j++) {
+                rule->mask[5-j] = value[6+j];
+                rule->val[5-j] = value[j] & value[6+j];
+            }
+        } else if (strcmp(argvp[i], "ad") == 0 && vlen >= 1 &&
+                                        vlen <= SCAN_FILTER_DATA) {
+            rule->kind = FILTER_AD;
+            rule->len = vlen;
+            memcpy(rule->val, value, vlen);
+        } else if (strcmp(argvp[i], "uuid") == 0 && vlen == 2) {
+            rule->kind = FILTER_UUID;
+            rule->len = vlen;
+            memcpy(rule->val, value, vlen);
+        } else {
+            g_free(value);
+            resp_mgmt(err_BAD_PARAM);
+            return;
+        }
+        g_free(value);
+        nrules++;
     }
-}
-
-static void read_local_oob_data_complete(uint8_t status, uint16_t len,
-                    const void *param, void *user_data)
-{
-    const struct mgmt_rp_read_local_oob_ext_data *rp = param;
-    uint32_t eir_len = rp->eir_len;
-    unsigned int i;
 
-    if (status) {
-        DBG("status returned error : %s (0x%02x)",
-            mgmt_errstr(status), status);
-        resp_mgmt_err(status);
+    if (scan_config_busy(nrules == scan_nrules && min_rssi == scan_min_rssi &&
+                memcmp(rules, scan_rules, nrules * sizeof(rules[0])) == 0))
         return;
+
+    memcpy(scan_rules, rules, nrules * sizeof(rules[0]));
+    scan_nrules = nrules;
+    scan_min_rssi = min_rssi;
+    scan_addr_rules = scan_data_rules = FALSE;
+    for (i = 0; i < nrules; i++) {
+        if (rules[i].kind == FILTER_ADDR)
+            scan_addr_rules = TRUE;
+        else
+            scan_data_rules = TRUE;
     }
-    DBG("received local OOB ext with eir_len = %d",eir_len);
-    for (i = 0; i<eir_len; i++)
-        DBG("0x%02x ", rp->eir[i]);
-    
-    resp_begin(rsp_OOB);
-    send_data(rp->eir, eir_len);
-    resp_end();
+
+    resp_mgmt(err_SUCCESS);
 }
 
-static bool read_local_oob_data(uint16_t index)
+/* Advertisement deduplication, enabled with "dedup on". A table keyed by
+ * address keeps the last two distinct payloads seen from each device
+ * (typically its advertisement and its scan response), and a report is
+ * only passed on for a new device, a new payload, an RSSI change of at
+ * least dedup_rssi_delta, or when dedup_interval has passed since the
+ * device was last reported. A zero delta or interval disables that test.
+ * The table is emptied whenever a scan starts.
+ */
+#define SCAN_DEDUP_MAX  4096
+
+struct scan_dev {
+    struct mgmt_addr_info addr;
+    uint8_t *data[2];
+    size_t len[2];
+    int next;
+    int rssi;
+    gint64 sent;
+};
+
+static GHashTable *scan_devs = NULL;
+static int dedup_rssi_delta;
+static gint64 dedup_interval;   /* microseconds */
+
+static guint scan_dev_hash(gconstpointer key)
 {
-    struct mgmt_cp_read_local_oob_ext_data cp;
+    const uint8_t *p = key;
+    guint h = 5381;
+    size_t i;
 
-    if (!mgmt_master) {
-        resp_error(err_NO_MGMT);
-        return true;
-    }
-    /* For now we only handle BLE OOB */
-    cp.type = 6;
-    if (mgmt_send(mgmt_master, MGMT_OP_READ_LOCAL_OOB_EXT_DATA, mgmt_ind, sizeof(cp), &cp,
-                        read_local_oob_data_complete,
-                        NULL, NULL) == 0) {
-        resp_error(err_SEND_FAIL);
-        return false;
-    }
-    return true;
+    for (i = 0; i < sizeof(struct mgmt_addr_info); i++)
+        h = h * 33 + p[i];
+    return h;
 }
 
-static void cmd_read_oob(int argcp, char **argvp)
+static gboolean scan_dev_equal(gconstpointer a, gconstpointer b)
 {
-    if (!read_local_oob_data(0)) {
-        DBG("Failed to read local oob data");
-    }
+    return memcmp(a, b, sizeof(struct mgmt_addr_info)) == 0;
 }
 
-static void cmd_pairable(int argcp, char **argvp)
+static void scan_dev_free(gpointer data)
 {
-    if (argcp < 2) {
-        resp_mgmt(err_BAD_PARAM);
-        return;
-    }
+    struct scan_dev *dev = data;
 
-    if (!set_mode(MGMT_OP_SET_BONDABLE, argvp[1])) {
-        resp_mgmt(err_BAD_PARAM);
-    }
+    g_free(dev->data[0]);
+    g_free(dev->data[1]);
+    g_free(dev);
 }
 
-static void pair_device_complete(uint8_t status, uint16_t length,
-                    const void *param, void *user_data)
+static void scan_dedup_reset(void)
 {
-    if (status != MGMT_STATUS_SUCCESS) {
-        DBG("status returned error : %s (0x%02x)",
-                mgmt_errstr(status), status);
-        resp_mgmt_err(status);
-        return;
+    if (scan_devs)
+        g_hash_table_remove_all(scan_devs);
+}
+
+/* Returns TRUE if the report should be sent to the client */
+static gboolean scan_dedup(const struct mgmt_addr_info *addr, int rssi,
+                            const uint8_t *data, size_t len)
+{
+    struct scan_dev *dev;
+    gint64 now;
+    int i;
+
+    if (!scan_devs)
+        return TRUE;
+
+    now = g_get_monotonic_time();
+    dev = g_hash_table_lookup(scan_devs, addr);
+    if (!dev) {
+        /* Random addresses come and go; don't let the table grow forever */
+        if (g_hash_table_size(scan_devs) >= SCAN_DEDUP_MAX)
+            g_hash_table_remove_all(scan_devs);
+        dev = g_new0(struct scan_dev, 1);
+        dev->addr = *addr;
+        g_hash_table_insert(scan_devs, &dev->addr, dev);
+    } else {
+        for (i = 0; i < 2; i++) {
+            if (dev->data[i] && dev->len[i] == len &&
+                        memcmp(dev->data[i], data, len) == 0)
+                break;
+        }
+
+        if (i < 2 &&
+            (dedup_rssi_delta == 0 || abs(rssi - dev->rssi) < dedup_rssi_delta) &&
+            (dedup_interval == 0 || now - dev->sent < dedup_interval))
+            return FALSE;
+
+        if (i < 2)
+            goto forward;
     }
 
-    resp_mgmt(err_SUCCESS);
+    g_free(dev->data[dev->next]);
+    dev->data[dev->next] = g_memdup(data, len ? len : 1);
+    dev->len[dev->next] = len;
+    dev->next ^= 1;
+
+forward:
+    dev->rssi = rssi;
+    dev->sent = now;
+    return TRUE;
 }
 
-static void cmd_pair(int argcp, char **argvp)
+static void cmd_dedup(int argcp, char **argvp)
 {
-    struct mgmt_cp_pair_device cp;
-    bdaddr_t bdaddr;
-    uint8_t io_cap = IO_CAPABILITY_NOINPUTNOOUTPUT;
-    uint8_t addr_type = BDADDR_LE_RANDOM;
+    long long delta = 0, interval = 0;
 
-    if (!mgmt_master) {
-        resp_error(err_NO_MGMT);
+    if (argcp < 2) {
+        resp_mgmt(err_BAD_PARAM);
         return;
     }
 
-    if (conn_state != STATE_CONNECTED) {
-        resp_mgmt(err_BAD_STATE);
+    if (strcasecmp(argvp[1], "off") == 0) {
+        if (scan_config_busy(!scan_devs))
+            return;
+        if (scan_devs) {
+            g_hash_table_destroy(scan_devs);
+            scan_devs = NULL;
+        }
+        resp_mgmt(err_SUCCESS);
         return;
     }
 
-    if (str2ba(opt_dst, &bdaddr)) {
-        resp_mgmt(err_NOT_FOUND);
+    if (strcasecmp(argvp[1], "on") != 0) {
+        resp_mgmt(err_BAD_PARAM);
         return;
     }
 
-    if (!memcmp(opt_dst_type, "public", 6)) {
-        addr_type = BDADDR_LE_PUBLIC;
-    }
-
-    memset(&cp, 0, sizeof(cp));
-    bacpy(&cp.addr.bdaddr, &bdaddr);
-    cp.addr.type = addr_type;
-    cp.io_cap = io_cap;
-
-    if (mgmt_send(mgmt_master, MGMT_OP_PAIR_DEVICE,
-            mgmt_ind, sizeof(cp), &cp,
-                pair_device_complete, NULL,
-                NULL) == 0) {
-        DBG("mgmt_send(MGMT_OP_PAIR_DEVICE) failed for %s for hci%u", opt_dst, mgmt_ind);
-        resp_mgmt(err_SEND_FAIL);
+    errno = 0;
+    if (argcp > 2)
+        delta = strtoll(argvp[2], NULL, 16);
+    if (argcp > 3)
+        interval = strtoll(argvp[3], NULL, 16);
+    if (errno != 0 || delta < 0 || delta > 255 || interval < 0) {
+        resp_mgmt(err_BAD_PARAM);
         return;
     }
-}
 
-static void unpair_device_complete(uint8_t status, uint16_t length,
-                    const void *param, void *user_data)
-{
-    if (status != MGMT_STATUS_SUCCESS) {
-        DBG("status returned error : %s (0x%02x)",
-                mgmt_errstr(status), status);
-        resp_mgmt_err(status);
+    if (scan_config_busy(scan_devs && delta == dedup_rssi_delta &&
+                interval * 1000 == dedup_interval))
         return;
-    }
 
+    dedup_rssi_delta = delta;
+    dedup_interval = interval * 1000;
+    if (!scan_devs)
+        scan_devs = g_hash_table_new_full(scan_dev_hash, scan_dev_equal,
+                                                NULL, scan_dev_free);
+    scan_dedup_reset();
     resp_mgmt(err_SUCCESS);
 }
 
-static void cmd_unpair(int argcp, char **argvp)
+/* Identity resolution, set with "irks [<irk> <address> <type>] ...". Each
+ * resolvable private address seen while scanning is checked against every
+ * IRK at once (bt_crypto_ah_resolve), and reports carry the identity
+ * address and type of the device it belongs to: "id" is empty and
+ * "idtype" 0 for addresses which don't resolve. As the address includes
+ * its prand, results (failures too) are cached per address until the
+ * device picks a new one.
+ */
+#define SCAN_RPA_CACHE_MAX  4096
+
+static struct bt_crypto *scan_crypto = NULL;
+static struct bt_crypto_ah_keys *scan_irk_keys = NULL;
+static struct mgmt_addr_info *scan_irk_ids = NULL;
+static uint8_t (*scan_irks)[16] = NULL;    /* as given, for comparison */
+static int scan_nirks = 0;
+static GHashTable *scan_rpas = NULL;   /* address -> index + 1, or 0 */
+
+static void cmd_irks(int argcp, char **argvp)
 {
-    struct mgmt_cp_unpair_device cp;
-    bdaddr_t bdaddr;
-    uint8_t addr_type = BDADDR_LE_RANDOM;
+    uint8_t (*irks)[16];
+    struct mgmt_addr_info *ids;
+    uint8_t *irk;
+    int i, n = 0;
 
-    if (!mgmt_master) {
-        resp_error(err_NO_MGMT);
+    if ((argcp - 1) % 3 != 0) {
+        resp_mgmt(err_BAD_PARAM);
         return;
     }
 
-    if (str2ba(opt_dst, &bdaddr)) {
-        DBG("str2ba failed");
-        resp_mgmt(err_NOT_FOUND);
+    irks = g_malloc0(16 * ((argcp - 1) / 3 + 1));
+    ids = g_new0(struct mgmt_addr_info, (argcp - 1) / 3 + 1);
+
+    for (i = 1; i < argcp; i += 3, n++) {
+        /* Least significant octet first, as BlueZ stores it */
+        if (arg_data(argvp, i, &irk) != 16) {
+            g_free(irk);
+            goto fail;
+        }
+        memcpy(irks[n], irk, 16);
+        g_free(irk);
+
+        if (str2ba(argvp[i + 1], &ids[n].bdaddr) < 0)
+            goto fail;
+
+        if (strcasecmp(argvp[i + 2], "public") == 0)
+            ids[n].type = BDADDR_LE_PUBLIC;
+        else if (strcasecmp(argvp[i + 2], "random") == 0)
+            ids[n].type = BDADDR_LE_RANDOM;
+        else
+            goto fail;
+    }
+
+    if (scan_config_busy(n == scan_nirks && (n == 0 ||
+                (memcmp(irks, scan_irks, n * 16) == 0 &&
+                 memcmp(ids, scan_irk_ids, n * sizeof(ids[0])) == 0)))) {
+        g_free(irks);
+        g_free(ids);
         return;
     }
 
-    if (!memcmp(opt_dst_type, "public", 6)) {
-        addr_type = BDADDR_LE_PUBLIC;
+    bt_crypto_ah_keys_free(scan_irk_keys);
+    scan_irk_keys = NULL;
+    scan_nirks = 0;
+
+    if (n && !scan_crypto)
+        scan_crypto = bt_crypto_new();
+    if (n && scan_crypto)
+        scan_irk_keys = bt_crypto_ah_keys_new(scan_crypto,
+                                (const uint8_t (*)[16]) irks, n);
+    if (n && !scan_irk_keys) {
+        DBG("Can't set up crypto for address resolution");
+        g_free(irks);
+        g_free(ids);
+        resp_mgmt(err_CALL_FAIL);
+        return;
     }
 
-    memset(&cp, 0, sizeof(cp));
-    bacpy(&cp.addr.bdaddr, &bdaddr);
-    cp.addr.type = addr_type;
-    cp.disconnect = 1;
+    g_free(scan_irk_ids);
+    scan_irk_ids = ids;
+    g_free(scan_irks);
+    scan_irks = irks;
+    scan_nirks = n;
 
-    if (mgmt_send(mgmt_master, MGMT_OP_UNPAIR_DEVICE,
-            mgmt_ind, sizeof(cp), &cp,
-            unpair_device_complete, NULL,
-                NULL) == 0) {
-        DBG("mgmt_send(MGMT_OP_UNPAIR_DEVICE) failed for %s for hci%u", opt_dst, mgmt_ind);
-        resp_mgmt(err_SEND_FAIL);
-        return;
+    if (!scan_rpas)
+        scan_rpas = g_hash_table_new_full(scan_dev_hash, scan_dev_equal,
+                                                g_free, NULL);
+    g_hash_table_remove_all(scan_rpas);
+    resp_mgmt(err_SUCCESS);
+    return;
+
+fail:
+    g_free(irks);
+    g_free(ids);
+    resp_mgmt(err_BAD_PARAM);
+}
+
+/* Back to no filtering, deduplication or resolution, and default
+ * parameters */
+static void scan_config_reset(void)
+{
+    scan_nwhitelist = 0;
+    scan_params = scan_params_default;
+    scan_nrules = 0;
+    scan_min_rssi = 0;
+    scan_addr_rules = scan_data_rules = FALSE;
+
+    if (scan_devs) {
+        g_hash_table_destroy(scan_devs);
+        scan_devs = NULL;
     }
+
+    bt_crypto_ah_keys_free(scan_irk_keys);
+    scan_irk_keys = NULL;
+    g_free(scan_irk_ids);
+    scan_irk_ids = NULL;
+    g_free(scan_irks);
+    scan_irks = NULL;
+    scan_nirks = 0;
+    if (scan_rpas)
+        g_hash_table_remove_all(scan_rpas);
 }
 
-static void scan_cb(uint8_t status, uint16_t length, const void *param, void *user_data)
+static void send_identity(const struct mgmt_addr_info *addr)
 {
-    if (status != MGMT_STATUS_SUCCESS) {
-        DBG("Scan error: %s (0x%02x)", mgmt_errstr(status), status);
-        if (status==MGMT_STATUS_BUSY)
-          resp_mgmt(err_BUSY);
-        else
-          resp_mgmt_err(status);
+    const struct mgmt_addr_info *id = NULL;
+    const uint8_t *b = addr->bdaddr.b;
+    gpointer val;
+    uint8_t rev[6] = { 0 };
+    int i;
+
+    if (!scan_irk_keys)
         return;
+
+    /* Resolvable private addresses have 01 as their top two bits */
+    if (addr->type == BDADDR_LE_RANDOM && (b[5] & 0xc0) == 0x40) {
+        if (!g_hash_table_lookup_extended(scan_rpas, addr, NULL, &val)) {
+            i = bt_crypto_ah_resolve(scan_crypto, scan_irk_keys, b + 3, b);
+            val = GINT_TO_POINTER(i + 1);
+            if (g_hash_table_size(scan_rpas) >= SCAN_RPA_CACHE_MAX)
+                g_hash_table_remove_all(scan_rpas);
+            g_hash_table_insert(scan_rpas, g_memdup(addr, sizeof(*addr)), val);
+        }
+        if (GPOINTER_TO_INT(val))
+            id = &scan_irk_ids[GPOINTER_TO_INT(val) - 1];
     }
 
-    resp_mgmt(err_SUCCESS);
+    /* Sent for every report, so batched reports can be split up again */
+    for (i = 0; id && i < 6; i++)
+        rev[i] = id->bdaddr.b[5 - i];
+    if (RESP_BINARY)
+        bin_put_bytes(tag_IDENTITY, 'b', rev, id ? sizeof(rev) : 0);
+    if (RESP_TEXT) {
+        g_string_append_printf(text_resp, RESP_DELIM "%s=b", tag_IDENTITY);
+        text_put_hex(rev, id ? sizeof(rev) : 0);
+    }
+    send_uint(tag_ID_TYPE, id ? id->type : 0);
 }
 
 // Unlike Bluez, we follow BT 4.0 spec which renammed Device Discovery by Scan
@@ -1618,6 +4655,7 @@ static void scan(bool start)
     uint16_t opcode = start? MGMT_OP_START_DISCOVERY : MGMT_OP_STOP_DISCOVERY;
 
     if (!mgmt_master) {
+        scan_subs = g_slist_remove(scan_subs, cur_conn);
         resp_error(err_NO_MGMT);
         return;
     }
@@ -1625,9 +4663,10 @@ static void scan(bool start)
     DBG("Scan %s", start? "start" : "stop");
 
     if (mgmt_send(mgmt_master, opcode, mgmt_ind, sizeof(cp),
-        &cp, scan_cb, NULL, NULL) == 0)
+        &cp, scan_cb, cur_conn, NULL) == 0)
     {
         DBG("mgmt_send(MGMT_OP_%s_DISCOVERY) failed", start? "START" : "STOP");
+        scan_subs = g_slist_remove(scan_subs, cur_conn);
         resp_mgmt(err_SEND_FAIL);
         return;
     }
@@ -1637,7 +4676,7 @@ static void cmd_scanend(int argcp, char **argvp)
 {
     if (1 < argcp) {
         resp_mgmt(err_BAD_PARAM);
-    } else {
+    } else if (!scan_leave()) {
         scan(FALSE);
     }
 }
@@ -1646,52 +4685,113 @@ static void cmd_scan(int argcp, char **argvp)
 {
     if (1 < argcp) {
         resp_mgmt(err_BAD_PARAM);
-    } else {
+    } else if (!scan_join()) {
+        if (!daemon_path)
+            scan_conn = cur_conn;
+        scan_dedup_reset();
+        scan_hw_whitelist = FALSE;
         scan(TRUE);
     }
 }
 
-#include "hci.h"
-#include "hci_lib.h"
 
-static gboolean hci_monitor_cb(GIOChannel *chan, GIOCondition cond, gpointer user_data)
+/* The raw HCI socket delivers one packet per datagram, so whole packets
+ * are pulled with recvmmsg() into a reusable buffer until the socket is
+ * drained. Every report in every LE advertising event read this way goes
+ * into a single "scan" response, which always carries addr, type, rssi,
+ * flag and d for each report so the client can split it up again.
+ */
+#define HCI_SCAN_BATCH  32
+
+static unsigned char hci_scan_buf[HCI_SCAN_BATCH][HCI_MAX_FRAME_SIZE];
+
+static void hci_adv_reports(const uint8_t *ptr, size_t plen, int *nreports)
 {
-    unsigned char buf[HCI_MAX_FRAME_SIZE], *ptr;
-    int type;
-    gsize len;
-    GError *err= NULL;
-    int r;
+    const le_advertising_info *info;
+    struct mgmt_addr_info addr;
+    uint8_t num_reports, rssi;
+    size_t off = 1;
 
-    if ((r= g_io_channel_read_chars(chan, (gchar *) buf, 1, &len, &err)) != G_IO_STATUS_NORMAL) {
-        if (err) DBG("reading pkt type reports state %d: %s", r, err->message);
-        //andy: stop passive scan
-        return TRUE;
+    if (plen < 1)
+        return;
+    num_reports = ptr[0];
+
+    while (num_reports-- > 0) {
+        info = (const le_advertising_info *) (ptr + off);
+        if (off + LE_ADVERTISING_INFO_SIZE + 1 > plen ||
+                off + LE_ADVERTISING_INFO_SIZE + info->length + 1 > plen) {
+            DBG("Truncated advertising report");
+            return;
+        }
+        off += LE_ADVERTISING_INFO_SIZE + info->length + 1;
+        rssi = info->data[info->length];
+
+        switch (info->bdaddr_type) {
+            case LE_PUBLIC_ADDRESS: addr.type= BDADDR_LE_PUBLIC; break;
+            case LE_RANDOM_ADDRESS: addr.type= BDADDR_LE_RANDOM; break;
+            default: addr.type= 0;
+        }
+        addr.bdaddr= info->bdaddr;
+
+        if (scan_conn->state != STATE_SCANNING ||
+                !scan_filter(&addr, 256-rssi, info->data, info->length) ||
+                !scan_dedup(&addr, 256-rssi, info->data, info->length))
+            continue;
+
+        if ((*nreports)++ == 0) {
+            cur_conn = scan_conn;
+            resp_begin(rsp_SCAN);
+        }
+        send_addr(&addr);
+        send_uint(tag_RSSI, 256-rssi);
+        /* ADV_SCAN_IND (2) and ADV_NONCONN_IND (3) are not connectable */
+        send_uint(tag_FLAG, (info->evt_type == 0x02 || info->evt_type == 0x03) ?
+                                MGMT_DEV_FOUND_NOT_CONNECTABLE : 0);
+        send_data(info->data, info->length);
+        send_identity(&addr);
+    }
+}
+
+/* Reports gathered so far go out before any other response */
+static void hci_scan_flush(int *nreports)
+{
+    if (*nreports) {
+        resp_end();
+        *nreports = 0;
     }
-    type= *buf;
-    switch (type) {
+}
+
+static void hci_scan_packet(struct hci_ctrl *ctrl, const unsigned char *buf,
+                                size_t len, int *nreports)
+{
+    const unsigned char *ptr;
+
+    if (len < 1)
+        return;
+
+    switch (buf[0]) {
         case HCI_COMMAND_PKT: {
-            hci_command_hdr *ch;
-            if ((r= g_io_channel_read_chars(chan, (gchar *) buf, HCI_COMMAND_HDR_SIZE, &len, &err)) != G_IO_STATUS_NORMAL) {
-                if (err) DBG("g_io_channel_read_chars() reports state %d: %s", r, err->message);
-                return TRUE;
-            }
-            ch = (hci_command_hdr *) buf;
-            ptr = buf + HCI_COMMAND_HDR_SIZE;
-            if ((r= g_io_channel_read_chars(chan, (gchar *) ptr, ch->plen, &len, &err)) != G_IO_STATUS_NORMAL) {
-                if (err) DBG("g_io_channel_read_chars() reports state %d: %s", r, err->message);
-                return TRUE;
-            }
+            const hci_command_hdr *ch = (const void *) (buf + 1);
+            if (len < 1 + HCI_COMMAND_HDR_SIZE ||
+                    len < 1 + HCI_COMMAND_HDR_SIZE + (size_t) ch->plen)
+                return;
+            ptr = buf + 1 + HCI_COMMAND_HDR_SIZE;
             switch(ch->opcode) {
                 case 0x2000|OCF_LE_SET_SCAN_ENABLE: {
-                    le_set_scan_enable_cp *lescan = (le_set_scan_enable_cp *) ptr;
+                    const le_set_scan_enable_cp *lescan = (const void *) ptr;
                     if (lescan->enable) {
                         DBG("Start of passive scan.");
-                    } else {
-                        if (conn_state == STATE_SCANNING) {
-                            set_state(STATE_DISCONNECTED);
+                    } else if (ctrl->scanning) {
+                        /* Someone else has stopped our scan */
+                        hci_scan_flush(nreports);
+                        ctrl->scanning = FALSE;
+                        scan_pasv = FALSE;
+                        scan_duty_stop();
+                        if (scan_conn->state == STATE_SCANNING) {
+                            scan_set_state(STATE_DISCONNECTED);
                         }
-                        DBG("End of passive scan - removing watch.");
-                        return FALSE; // remove watch
+                        DBG("End of passive scan.");
+                        hci_ctrl_release(ctrl);
                     }
                 }
                 break;
@@ -1702,163 +4802,227 @@ static gboolean hci_monitor_cb(GIOChannel *chan, GIOCondition cond, gpointer use
         } break;
 
         case HCI_EVENT_PKT: {
-            hci_event_hdr *eh;
-            if ((r= g_io_channel_read_chars(chan, (gchar *) buf, HCI_EVENT_HDR_SIZE, &len, &err)) != G_IO_STATUS_NORMAL) {
-                if (err) DBG("g_io_channel_read_chars() reports state %d: %s", r, err->message);
-                return TRUE;
-            }
-            eh = (hci_event_hdr *) buf;
-            ptr = buf + HCI_EVENT_HDR_SIZE;
-            if ((r= g_io_channel_read_chars(chan, (gchar *) ptr, eh->plen, &len, &err)) != G_IO_STATUS_NORMAL) {
-                if (err) DBG("g_io_channel_read_chars() reports state %d: %s", r, err->message);
-                return TRUE;
-            }
+            const hci_event_hdr *eh = (const void *) (buf + 1);
+            if (len < 1 + HCI_EVENT_HDR_SIZE ||
+                    len < 1 + HCI_EVENT_HDR_SIZE + (size_t) eh->plen)
+                return;
+            ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
             switch(eh->evt) {
-                case EVT_CMD_COMPLETE: {
-                    // evt_cmd_complete *cmpl = (void *) ptr;
-                    // DBG("command complete (0x%02x|0x%04x) 0x%02x 0x%02x", cmpl->ncmd, cmpl->opcode, *(uint8_t *)(ptr+3), *(uint8_t *)(ptr+4));
-                }
+                case EVT_CMD_COMPLETE:
+                case EVT_CMD_STATUS:
+                    hci_scan_flush(nreports);
+                    hci_cmd_event(ctrl, eh->evt, ptr, eh->plen);
                 break;
 
                 case EVT_LE_META_EVENT: {
-                    evt_le_meta_event *meta = (void *) ptr;
-
-                    switch(meta->subevent) {
-                        case EVT_LE_ADVERTISING_REPORT: {
-                            le_advertising_info *ev = (le_advertising_info *) (meta->data + 1);
-                            // const uint8_t *val= ev->bdaddr.b;
-                            const uint8_t rssi= ev->data[ev->length];
-                            struct mgmt_addr_info addr;
-                            switch (ev->bdaddr_type) {
-                                case LE_PUBLIC_ADDRESS: addr.type= BDADDR_LE_PUBLIC; break;
-                                case LE_RANDOM_ADDRESS: addr.type= BDADDR_LE_RANDOM; break;
-                                default: addr.type= 0;
-                            }
-                            addr.bdaddr= ev->bdaddr;
-                            // DBG("Device found: %02X:%02X:%02X:%02X:%02X:%02X type=%X length=%d data[0]=0x%02x rssi=0x%02x",
-                            //     val[5], val[4], val[3], val[2], val[1], val[0],
-                            //     ev->bdaddr_type, ev->length, ev->data[0], ev->data[ev->length]);
-                            if (0) {
-                                int i=0;
-                                for (i=0; i<ev->length; i++)
-                                    DBG("buf: %02x", ev->data[i]);
-                            }
-
-                            if (conn_state == STATE_SCANNING) {
-                                resp_begin(rsp_SCAN);
-                                send_addr(&addr);
-                                send_uint(tag_RSSI, 256-rssi);
-                                send_uint(tag_FLAG, 0);   //andy: where do we get these from?
-                                if (ev->length)
-                                    send_data(ev->data, ev->length);
-                                resp_end();
-                            }
-                        }
+                    const evt_le_meta_event *meta = (const void *) ptr;
+
+                    if (eh->plen < 1)
                         break;
+                    if (meta->subevent == EVT_LE_ADVERTISING_REPORT) {
+                        if (ctrl->scanning)
+                            hci_adv_reports(meta->data, eh->plen - 1, nreports);
+                    } else {
+                        hci_scan_flush(nreports);
+                        hci_meta_event(ctrl, meta->subevent, meta->data,
+                                        eh->plen - 1);
+                    }
+                }
+                break;
+
+                default:
+                    DBG("Ignoring event %02x", eh->evt);
+            } // switch(eh->evt)
+        } break;
+
+        default:
+            DBG("Ignoring packet type %02x", buf[0]);
+    }// switch (type)
+}
+
+static bool hci_monitor_cb(struct io *io, void *user_data)
+{
+    struct hci_ctrl *ctrl = user_data;
+    struct mmsghdr msgs[HCI_SCAN_BATCH];
+    struct iovec iovs[HCI_SCAN_BATCH];
+    int fd = io_get_fd(io);
+    int nreports = 0;
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < HCI_SCAN_BATCH; i++) {
+        iovs[i].iov_base = hci_scan_buf[i];
+        iovs[i].iov_len = HCI_MAX_FRAME_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(fd, msgs, HCI_SCAN_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                DBG("recvmmsg() failed: %s", strerror(errno));
+            //andy: stop passive scan
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+            hci_scan_packet(ctrl, hci_scan_buf[i], msgs[i].msg_len, &nreports);
+    } while (n == HCI_SCAN_BATCH);
+
+    if (nreports)
+        resp_end();
+
+    return true;
+}
+
+/* Perform a scan through the raw HCI socket; by default a passive one, i.e.
+ * report ADV_IND packets but do not request SCN_RSP packets (see
+ * scanparams). Starting takes a chain of HCI commands: scanning is
+ * disabled, the white list programmed, the parameters set and scanning
+ * enabled, each step in the callback of the one before; the requesting
+ * connection hears the outcome at the end. A stop asked for meanwhile
+ * fails the start.
+ */
+static void discover_fail(struct conn *conn)
+{
+    struct hci_ctrl *ctrl = hci_ctrl_find(mgmt_ind);
+
+    cur_conn = conn;
+    scan_pasv = FALSE;
+    if (ctrl)
+        ctrl->scanning = FALSE;
+    scan_subs = g_slist_remove(scan_subs, cur_conn);
+    resp_mgmt(err_BAD_STATE);
+
+    /* Sessions which joined meanwhile were told it had started */
+    if (scan_subs)
+        scan_set_state(STATE_DISCONNECTED);
+}
+
+static void discover_enable_cb(uint8_t status, const uint8_t *rp, uint8_t rlen,
+                                void *user_data)
+{
+    struct hci_ctrl *ctrl = hci_ctrl_find(mgmt_ind);
+
+    if (!scan_pasv || status || !ctrl) {
+        DBG("Enable scan failed");
+        discover_fail(user_data);
+        return;
+    }
+
+    ctrl->scanning = TRUE;
+    scan_duty_stop();
+    if (scan_params.burst && scan_params.idle) {
+        scan_duty_idle = FALSE;
+        scan_duty_timer = timeout_add(scan_params.burst, scan_duty_cb, NULL, NULL);
+    }
+
+    cur_conn = user_data;
+    resp_mgmt(err_SUCCESS);
+    if (!daemon_path)
+        scan_conn = cur_conn;
+    scan_set_state(STATE_SCANNING);
+}
+
+static void discover_params_cb(uint8_t status, const uint8_t *rp, uint8_t rlen,
+                                void *user_data)
+{
+    le_set_scan_enable_cp cp;
+
+    if (!scan_pasv || status) {
+        DBG("Set scan parameters failed");
+        discover_fail(user_data);
+        return;
+    }
 
-                        default:
-                            DBG("Ignoring EVT_LE_ADVERTISING_REPORT subevent %02x", meta->subevent);
-                            return TRUE;
-                    } // switch (meta->subevent)
+    scan_dedup_reset();
+    DBG("LE Scan ...");
+    cp.enable = 0x01;
+    cp.filter_dup = scan_params.filter_dup;
+    if (!hci_send(mgmt_ind, OCF_LE_SET_SCAN_ENABLE, &cp,
+                    LE_SET_SCAN_ENABLE_CP_SIZE, discover_enable_cb, user_data))
+        discover_fail(user_data);
+}
 
-                } // case EVT_LE_META_EVENT
-                break;
-                default:
-                    DBG("Ignoring event %02x", eh->evt);
-                    return TRUE;
-            } // switch(eh->evt)
+static void discover_params(struct conn *conn, uint8_t filter_policy)
+{
+    le_set_scan_parameters_cp cp;
 
-        } // case HCI_EVENT_PKT
-        break;
+    if (!scan_pasv) {
+        discover_fail(conn);
+        return;
+    }
 
-        default:
-            DBG("Ignoring packet type %02x", type);
-            return TRUE;
-    }// switch (type)
-    return TRUE;
+    cp.type = scan_params.type;
+    cp.interval = htobs(scan_params.interval);
+    cp.window = htobs(scan_params.window);
+    cp.own_bdaddr_type = scan_params.own_type;
+    cp.filter = filter_policy;
+    if (!hci_send(mgmt_ind, OCF_LE_SET_SCAN_PARAMETERS, &cp,
+                    LE_SET_SCAN_PARAMETERS_CP_SIZE, discover_params_cb, conn))
+        discover_fail(conn);
 }
 
+static void discover_stop_cb(uint8_t status, const uint8_t *rp, uint8_t rlen,
+                                void *user_data)
+{
+    struct hci_ctrl *ctrl = hci_ctrl_find(mgmt_ind);
+
+    /* An enable still queued ahead of this one may have set it again */
+    if (ctrl)
+        ctrl->scanning = FALSE;
+
+    if (status)
+        DBG("Disable scan failed");
+    if (scan_hw_whitelist) {
+        hci_send(mgmt_ind, OCF_LE_CLEAR_WHITE_LIST, NULL, 0, NULL, NULL);
+        scan_hw_whitelist = FALSE;
+    }
+
+    cur_conn = user_data;
+    resp_mgmt(status ? err_BAD_STATE : err_SUCCESS);
+    scan_set_state(STATE_DISCONNECTED);
+}
 
-// perform a passive scan, i.e. report ADV_IND packets but do not request SCN_RSP packets
 static void discover(bool start)
 {
-    int err;
-    uint8_t own_type = LE_PUBLIC_ADDRESS;
-    uint8_t scan_type = 0x00;  // passive
-    uint8_t filter_policy = 0x00;
-    uint16_t interval = htobs(0x0010);
-    uint16_t window = htobs(0x0010);
-    uint8_t filter_dup = 0x00;  // do not filter duplicates
+    struct hci_ctrl *ctrl;
+    le_set_scan_enable_cp cp;
 
-    struct hci_filter nf, of;
-    //struct sigaction sa;
-    socklen_t olen;
+    DBG("Passive scan %s on hci%d", start ? "start" : "stop", mgmt_ind);
+    cp.enable = 0x00;
+    cp.filter_dup = scan_params.filter_dup;
 
-    hci_dd = hci_open_dev(mgmt_ind);
-    DBG("hcidev handle is 0x%x, mgmt_ind is %d", hci_dd, mgmt_ind);
     if (start) {
-        err = hci_le_set_scan_enable(hci_dd, 0x00, filter_dup, 10000);
-        err = hci_le_set_scan_parameters(hci_dd, scan_type, interval, window,
-                                             own_type, filter_policy, 10000);
-        if (err < 0) {
-            DBG("Set scan parameters failed");
-            resp_mgmt(err_BAD_STATE);
-            return;
-        }
-        hci_io = g_io_channel_unix_new(hci_dd);
-        g_io_channel_set_encoding(hci_io, NULL, NULL);
-        g_io_channel_set_close_on_unref(hci_io, TRUE);
-        g_io_add_watch(hci_io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL, hci_monitor_cb, NULL);
-        g_io_channel_unref(hci_io);
-
-        // setup filter
-        olen = sizeof(of);
-        if (getsockopt(hci_dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
-            printf("Could not get socket options\n");
-            resp_mgmt(err_BAD_STATE);
-            return;
-        }
-        hci_filter_clear(&nf);
-        hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
-        hci_filter_set_event(EVT_LE_META_EVENT, &nf);
-        hci_filter_set_event(EVT_CMD_COMPLETE, &nf);
-        hci_filter_set_ptype(HCI_COMMAND_PKT, &nf);
-        hci_filter_set_event(OCF_LE_SET_SCAN_ENABLE, &nf);
-
-        if (setsockopt(hci_dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
-            printf("Could not set socket options\n");
-            resp_mgmt(err_BAD_STATE);
-            return;
-        }
-
-        DBG("LE Scan ...");
-        err = hci_le_set_scan_enable(hci_dd, 0x01, filter_dup, 10000);
-        if (err < 0) {
-            //andy: signal error
-            DBG("Enable scan failed");
-            resp_mgmt(err_BAD_STATE);
+        scan_hw_whitelist = FALSE;
+        scan_pasv = TRUE;
+        if (!hci_send(mgmt_ind, OCF_LE_SET_SCAN_ENABLE, &cp,
+                        LE_SET_SCAN_ENABLE_CP_SIZE, NULL, NULL)) {
+            discover_fail(cur_conn);
             return;
         }
 
-        resp_mgmt(err_SUCCESS);
-        set_state(STATE_SCANNING);
+        if (scan_nwhitelist == 0)
+            discover_params(cur_conn, 0x00);
+        else
+            hci_send(mgmt_ind, OCF_LE_READ_WHITE_LIST_SIZE, NULL, 0,
+                        scan_whitelist_size_cb, cur_conn);
     } else {
-        const char* errcode = err_SUCCESS;
-
-        // set filter to receive no events
         DBG(" stop pasv scan -----------------------------------");
-        setsockopt(hci_dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+        scan_pasv = FALSE;
+        scan_duty_stop();
+
+        /* No more reports once asked to stop */
+        ctrl = hci_ctrl_find(mgmt_ind);
+        if (ctrl)
+            ctrl->scanning = FALSE;
 
-        err = hci_le_set_scan_enable(hci_dd, 0x00, filter_dup, 10000);
-        if (err < 0) {
-            DBG("Disable scan failed");
-            errcode = err_BAD_STATE;
+        if (!hci_send(mgmt_ind, OCF_LE_SET_SCAN_ENABLE, &cp,
+                        LE_SET_SCAN_ENABLE_CP_SIZE, discover_stop_cb, cur_conn)) {
+            resp_mgmt(err_BAD_STATE);
+            scan_set_state(STATE_DISCONNECTED);
         }
-        hci_close_dev(hci_dd);
-        hci_dd= -1;
-        hci_io= NULL;
-        resp_mgmt(errcode);
-        set_state(STATE_DISCONNECTED);
     }
 }
 
@@ -1866,7 +5030,7 @@ static void cmd_pasvend(int argcp, char **argvp)
 {
     if (1 < argcp) {
         resp_mgmt(err_BAD_PARAM);
-    } else {
+    } else if (!scan_leave()) {
         discover(FALSE);
     }
 }
@@ -1875,11 +5039,35 @@ static void cmd_pasv(int argcp, char **argvp)
 {
     if (1 < argcp) {
         resp_mgmt(err_BAD_PARAM);
-    } else {
+    } else if (!scan_join()) {
         discover(TRUE);
     }
 }
 
+static void cmd_proto(int argcp, char **argvp)
+{
+    if (argcp < 2) {
+        resp_error(err_BAD_PARAM);
+        return;
+    }
+
+    if (strcasecmp(argvp[1], "bin") == 0)
+        proto_mode = PROTO_BINARY;
+    else if (strcasecmp(argvp[1], "text") == 0)
+        proto_mode = PROTO_TEXT;
+    else {
+        resp_error(err_BAD_PARAM);
+        return;
+    }
+    if (cur_session)
+        cur_session->proto = proto_mode;
+
+    /* Acknowledged in the newly selected framing */
+    resp_begin(rsp_PROTO);
+    send_sym(tag_PROTO, proto_mode == PROTO_BINARY ? "bin" : "text");
+    resp_end();
+}
+
 static struct {
     const char *cmd;
     void (*func)(int argcp, char **argvp);
@@ -1904,18 +5092,34 @@ static struct {
         "Characteristics Discovery" },
     { "desc",       cmd_char_desc,  "[start hnd] [end hnd]",
         "Characteristics Descriptor Discovery" },
+    { "tree",       cmd_tree,   "",
+        "Discover all services, characteristics and descriptors at once" },
     { "rd",         cmd_read_hnd,   "<handle>",
         "Characteristics Value/Descriptor Read by handle" },
     { "rdu",        cmd_read_uuid,  "<UUID> [start hnd] [end hnd]",
         "Characteristics Value/Descriptor Read by UUID" },
+    { "rdm",        cmd_read_multi, "<handle> <handle> ...",
+        "Read Multiple: values concatenated in one response" },
+    { "rdmv",       cmd_read_multi_vl, "<handle> <handle> ...",
+        "Read Multiple Variable Length: one value per handle" },
     { "wrr",        cmd_char_write_rsp, "<handle> [<new value>]",
         "Characteristic Value Write (Write Request)" },
     { "wr",         cmd_char_write, "<handle> [<new value>]",
         "Characteristic Value Write (No response)" },
+    { "wrs",        cmd_write_stream, "<handle> <value>",
+        "Stream a long value as Write Without Response chunks" },
+    { "wrt",        cmd_write_txn, "<handle> <value> [<handle> <value>] ...",
+        "Write several values atomically with Prepare/Execute Write" },
+    { "sub",        cmd_subscribe, "<ntfy | ind | off> <handle> ...",
+        "Find and write the CCCD of each characteristic value handle" },
+    { "batch",      cmd_batch,  "<rd hnd | wrr hnd value | wr hnd value> ...",
+        "Issue several reads and writes back-to-back, one response" },
     { "secu",       cmd_sec_level,  "[low | medium | high]",
         "Set security level. Default: low" },
     { "mtu",        cmd_mtu,    "<value>",
         "Exchange MTU for GATT/ATT" },
+    { "link",       cmd_link,   "[mtu|dle|phy|int|lat|tmo <value>] ...",
+        "Link settings to negotiate on the next connection" },
     { "le",      cmd_le,  "[on | off]",
         "Control LE feature on the controller" },
     { "remote_oob",      cmd_add_oob,  "address [[C_192 c192] [R_192 r192]] [[C_256 c256] [R_256 r256]]",
@@ -1936,6 +5140,20 @@ static struct {
         "Start passive scan" },
     { "pasvend",    cmd_pasvend,  "",
         "Force passive scan end" },
+    { "ring",       cmd_ring,   "[path]",
+        "Deliver notifications through a shared-memory ring" },
+    { "scanfilter", cmd_scanfilter, "[rssi n | addr a+m | ad t+prefix | uuid u] ...",
+        "Only report advertisements matching these rules" },
+    { "scanparams", cmd_scanparams, "[type t | int n | win n | own t | dup on/off | burst ms | idle ms] ...",
+        "Set parameters for scans through the HCI socket (pasv)" },
+    { "whitelist",  cmd_whitelist,  "[address type] ...",
+        "Only report these devices, filtering in the controller if possible" },
+    { "dedup",      cmd_dedup,  "[off | on [rssi delta [interval ms]]]",
+        "Only report new or changed advertisements while scanning" },
+    { "irks",       cmd_irks,   "[irk address type] ...",
+        "Resolve private addresses in scan reports with these IRKs" },
+    { "proto",      cmd_proto,  "[text | bin]",
+        "Select text or binary framing for commands and responses" },
     { NULL, NULL, NULL}
 };
 
@@ -1944,25 +5162,46 @@ static void cmd_help(int argcp, char **argvp)
     int i;
 
     for (i = 0; commands[i].cmd; i++)
-        printf("#%-15s %-30s %s\n", commands[i].cmd,
+        helper_comment("#%-15s %-30s %s\n", commands[i].cmd,
                 commands[i].params, commands[i].desc);
     cmd_status(0, NULL);
 }
 
-static void parse_line(char *line_read)
+static void dispatch_cmd(int argcp, char **argvp)
 {
-    gchar **argvp;
-    int argcp;
     int i;
 
-    line_read = g_strstrip(line_read);
+    cur_conn = client_conn(0);
 
-    if (*line_read == '\0')
-        goto done;
+    /* Optional connection selector */
+    if (argvp[0][0] == '@') {
+        char *e;
+        unsigned long id;
 
-    if (!g_shell_parse_argv(line_read, &argcp, &argvp, NULL)) {
-        resp_error(err_BAD_CMD);
-        goto done;
+        errno = 0;
+        id = strtoul(argvp[0] + 1, &e, 16);
+        if (errno != 0 || *e != '\0' || e == argvp[0] + 1 || argcp < 2) {
+            resp_error(err_BAD_PARAM);
+            return;
+        }
+
+        cur_conn = client_conn(id);
+        if (!cur_conn) {
+            cur_conn = client_conn(0);
+            resp_error(err_BAD_PARAM);
+            return;
+        }
+
+        argcp--;
+        argvp++;
+        if (cmd_arglen)
+            cmd_arglen++;
+    }
+
+    /* Other sessions of a daemon hold every entry */
+    if (!cur_conn) {
+        resp_error(err_BUSY);
+        return;
     }
 
     for (i = 0; commands[i].cmd; i++)
@@ -1973,37 +5212,454 @@ static void parse_line(char *line_read)
         commands[i].func(argcp, argvp);
     else
         resp_error(err_BAD_CMD);
+}
+
+#ifndef BLUEPY_EXTENSION
+static void parse_line(char *line_read)
+{
+    gchar **argvp;
+    int argcp;
+
+    line_read = g_strstrip(line_read);
+
+    if (*line_read == '\0')
+        goto done;
+
+    if (!g_shell_parse_argv(line_read, &argcp, &argvp, NULL)) {
+        resp_error(err_BAD_CMD);
+        goto done;
+    }
+
+    dispatch_cmd(argcp, argvp);
 
     g_strfreev(argvp);
 
 done:
-    free(line_read);
+    g_free(line_read);
 }
+#endif
 
-static gboolean prompt_read(GIOChannel *chan, GIOCondition cond,
-                            gpointer user_data)
+static void parse_frame(const uint8_t *frame, size_t flen)
 {
-    gchar *myline;
+    gchar **argvp;
+    gsize *arglen;
+    size_t pos;
+    int argcp, i;
 
-    if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
-        DBG("Quitting IO channel error");
-        g_main_loop_quit(event_loop);
-        return FALSE;
+    /* Count arguments first, rejecting truncated ones */
+    for (pos = 0, argcp = 0; pos + 2 <= flen; argcp++)
+        pos += 2 + bt_get_le16(frame + pos);
+
+    if (pos != flen || argcp == 0) {
+        resp_error(err_BAD_CMD);
+        return;
     }
 
-    if ( G_IO_STATUS_NORMAL != g_io_channel_read_line(chan, &myline, NULL, NULL, NULL)
-            || myline == NULL
-    )
-    {
+    argvp = g_new0(gchar *, argcp + 1);
+    arglen = g_new(gsize, argcp);
+    for (pos = 0, i = 0; i < argcp; i++) {
+        arglen[i] = bt_get_le16(frame + pos);
+        /* Raw values may contain NULs, so copy rather than g_strndup() */
+        argvp[i] = g_malloc(arglen[i] + 1);
+        memcpy(argvp[i], frame + pos + 2, arglen[i]);
+        argvp[i][arglen[i]] = '\0';
+        pos += 2 + arglen[i];
+    }
+
+    cmd_arglen = arglen;
+    dispatch_cmd(argcp, argvp);
+    cmd_arglen = NULL;
+
+    g_free(arglen);
+    g_strfreev(argvp);
+}
+
+#ifndef BLUEPY_EXTENSION
+/* Dispatches every complete command in cmd_buf; a partial one waits for
+ * more input. Each is taken in the framing selected when it is reached,
+ * as "proto" may change it part way through the buffer. */
+static void input_dispatch(GByteArray *cmd_buf)
+{
+    guint8 *nl;
+    uint32_t flen;
+    size_t used;
+
+    while (!(cur_session && cur_session->closing)) {
+        if (proto_mode == PROTO_BINARY) {
+            if (cmd_buf->len < 4)
+                break;
+            flen = bt_get_le32(cmd_buf->data);
+            if (cmd_buf->len - 4 < flen)
+                break;
+            used = 4 + flen;
+            parse_frame(cmd_buf->data + 4, flen);
+        } else {
+            nl = memchr(cmd_buf->data, '\n', cmd_buf->len);
+            if (nl == NULL)
+                break;
+            used = nl - cmd_buf->data + 1;
+            parse_line(g_strndup((const gchar *) cmd_buf->data, used));
+        }
+        g_byte_array_remove_range(cmd_buf, 0, used);
+    }
+}
+
+/* Reads what is available on fd and dispatches the commands completed by
+ * it: the number of bytes read, -1 if there were none yet, 0 at the end
+ * of input */
+static gssize input_read(int fd, GByteArray *cmd_buf)
+{
+    uint8_t buf[4096];
+    ssize_t len;
+
+    len = read(fd, buf, sizeof(buf));
+    if (len < 0)
+        return (errno == EAGAIN || errno == EINTR) ? -1 : 0;
+
+    if (len == 0) {
+        /* A last line without its newline is still a command */
+        if (proto_mode == PROTO_TEXT && cmd_buf->len > 0) {
+            g_byte_array_append(cmd_buf, (const guint8 *) "\n", 1);
+            input_dispatch(cmd_buf);
+        }
+        return 0;
+    }
+
+    g_byte_array_append(cmd_buf, buf, len);
+    input_dispatch(cmd_buf);
+
+    return len;
+}
+
+static GByteArray *prompt_buf = NULL;
+
+static bool prompt_read(struct io *io, void *user_data)
+{
+    if (input_read(io_get_fd(io), prompt_buf) == 0) {
         DBG("Quitting on input read fail");
-        g_main_loop_quit(event_loop);
-        return FALSE;
+        loop_quit();
+        return false;
+    }
+
+    return true;
+}
+
+static bool prompt_hup(struct io *io, void *user_data)
+{
+    DBG("Quitting IO channel error");
+
+    /* Commands written just before stdin was closed still count */
+    while (input_read(io_get_fd(io), prompt_buf) > 0)
+        ;
+
+    loop_quit();
+    return false;
+}
+#endif
+
+/* A session's responses are queued and written as its socket allows; a
+ * client which lets SESSION_OUT_MAX bytes back up is dropped.
+ */
+#define SESSION_OUT_MAX     (4 * 1024 * 1024)
+
+static void session_stop_scan(void)
+{
+    cur_conn = scan_conn;
+    if (scan_pasv)
+        discover(FALSE);
+    else
+        scan(FALSE);
+}
+
+static bool session_close(void *user_data)
+{
+    struct session *s = user_data;
+    gboolean scanning = (scan_subs != NULL);
+    int i;
+
+    DBG("Closing session %p", s);
+    s->closing = TRUE;
+
+    /* Its connections go back to the pool for later sessions */
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        struct conn *conn = s->conns[i];
+
+        if (!conn)
+            continue;
+
+        scan_subs = g_slist_remove(scan_subs, conn);
+        if (conn->iochannel)
+            disconnect_io(conn);
+        ring_close(conn);
+        conn->state = STATE_DISCONNECTED;
+        conn->session = NULL;
+    }
+
+    if (scanning && !scan_subs)
+        session_stop_scan();
+
+    if (scan_config_owner == s) {
+        scan_config_owner = NULL;
+        if (!scan_subs)
+            scan_config_reset();
+    }
+
+    io_destroy(s->io);
+    g_byte_array_free(s->cmd_buf, TRUE);
+    g_byte_array_free(s->out, TRUE);
+    g_free(s);
+
+    return false;
+}
+
+static void session_drop(struct session *s)
+{
+    s->closing = TRUE;
+    if (!s->close_idle)
+        s->close_idle = timeout_add(0, session_close, s, NULL);
+}
+
+static gboolean session_flush(struct session *s)
+{
+    ssize_t len;
+
+    while (s->out->len > 0) {
+        len = send(io_get_fd(s->io), s->out->data, s->out->len, MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && errno == EAGAIN)
+            return TRUE;
+        if (len <= 0)
+            return FALSE;
+        g_byte_array_remove_range(s->out, 0, len);
     }
 
-    parse_line(myline);
     return TRUE;
 }
 
+static bool session_write_cb(struct io *io, void *user_data)
+{
+    struct session *s = user_data;
+
+    if (!session_flush(s)) {
+        s->writing = FALSE;
+        session_drop(s);
+        return false;
+    }
+
+    if (s->out->len > 0)
+        return true;
+
+    s->writing = FALSE;
+    return false;
+}
+
+/* Queues the response just built for the session, giving it the id the
+ * session knows its connection by */
+static void session_resp(struct session *s, unsigned int cid)
+{
+  if (s->closing)
+    return;
+
+  if (s->proto == PROTO_BINARY) {
+    uint8_t hdr[5], field[9];
+
+    field[0] = strlen(tag_CONN);
+    memcpy(field + 1, tag_CONN, 3);
+    field[4] = 'h';
+    bt_put_le32(cid, field + 5);
+
+    hdr[0] = BIN_FRAME_START;
+    bt_put_le32(bin_resp->len + sizeof(field), hdr + 1);
+    g_byte_array_append(s->out, hdr, sizeof(hdr));
+    g_byte_array_append(s->out, bin_resp->data, bin_cid_pos);
+    g_byte_array_append(s->out, field, sizeof(field));
+    g_byte_array_append(s->out, bin_resp->data + bin_cid_pos,
+                          bin_resp->len - bin_cid_pos);
+  } else {
+    char field[16];
+    int flen = snprintf(field, sizeof(field), RESP_DELIM "%s=h%X", tag_CONN, cid);
+
+    g_byte_array_append(s->out, (const guint8 *) text_resp->str, text_cid_pos);
+    g_byte_array_append(s->out, (const guint8 *) field, flen);
+    g_byte_array_append(s->out, (const guint8 *) text_resp->str + text_cid_pos,
+                          text_resp->len - text_cid_pos);
+    g_byte_array_append(s->out, (const guint8 *) "\n", 1);
+  }
+
+  if (s->writing)
+    return;
+
+  if (!session_flush(s) || s->out->len > SESSION_OUT_MAX)
+    session_drop(s);
+  else if (s->out->len > 0) {
+    s->writing = TRUE;
+    if (!io_set_write_handler(s->io, session_write_cb, s, NULL))
+      session_drop(s);
+  }
+}
+
+static void daemon_resp_end(void)
+{
+  GSList *l;
+
+  /* Scan results go to every session sharing the scan */
+  if (cur_conn == scan_conn) {
+    if (resp_type == rsp_SCAN)
+      for (l = scan_subs; l; l = l->next) {
+        struct conn *conn = l->data;
+
+        session_resp(conn->session, conn->cid);
+      }
+    return;
+  }
+
+  if (cur_conn && cur_conn->session)
+    session_resp(cur_conn->session, cur_conn->cid);
+  else if (!cur_conn && cur_session)
+    session_resp(cur_session, 0);
+}
+
+#ifndef BLUEPY_EXTENSION
+static bool session_read(struct io *io, void *user_data)
+{
+    struct session *s = user_data;
+
+    if (!s->closing) {
+        cur_session = s;
+        proto_mode = s->proto;
+        if (input_read(io_get_fd(io), s->cmd_buf) == 0)
+            s->closing = TRUE;
+        cur_session = NULL;
+    }
+
+    if (s->closing) {
+        session_drop(s);
+        return false;
+    }
+
+    return true;
+}
+
+static bool session_hup(struct io *io, void *user_data)
+{
+    struct session *s = user_data;
+
+    /* Commands sent just before the client went away are still run */
+    cur_session = s;
+    proto_mode = s->proto;
+    while (!s->closing && input_read(io_get_fd(io), s->cmd_buf) > 0)
+        ;
+    cur_session = NULL;
+
+    session_drop(s);
+    return false;
+}
+
+static bool daemon_accept(struct io *io, void *user_data)
+{
+    struct session *s;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int fd;
+
+    fd = accept4(io_get_fd(io), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        DBG("accept() failed: %s", strerror(errno));
+        return true;
+    }
+
+    /* Only the daemon's own user (and root) may drive the adapter */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+            (cred.uid != geteuid() && cred.uid != 0)) {
+        DBG("Refused session from uid %d", (int) cred.uid);
+        close(fd);
+        return true;
+    }
+
+    s = g_new0(struct session, 1);
+    s->io = io_new(fd);
+    if (!s->io) {
+        close(fd);
+        g_free(s);
+        return true;
+    }
+    io_set_close_on_destroy(s->io, true);
+
+    s->proto = PROTO_TEXT;
+    s->cmd_buf = g_byte_array_new();
+    s->out = g_byte_array_new();
+    io_set_read_handler(s->io, session_read, s, NULL);
+    io_set_disconnect_handler(s->io, session_hup, s, NULL);
+    DBG("New session %p", s);
+
+    return true;
+}
+
+static struct io *daemon_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    struct io *io;
+    mode_t mask;
+    int fd, probe, err;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        helper_comment("# ERROR: socket path '%s' too long\n", path);
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+
+    /* Only a socket left behind by a daemon which did not exit cleanly
+     * is replaced; one which still answers is in use */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            helper_comment("# ERROR: '%s' exists and is not a socket\n", path);
+            close(fd);
+            return NULL;
+        }
+        probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        err = probe < 0 ? -1 :
+                connect(probe, (struct sockaddr *) &addr, sizeof(addr));
+        if (err == 0 || errno != ECONNREFUSED) {
+            helper_comment("# ERROR: a daemon is already listening on '%s'\n", path);
+            if (probe >= 0)
+                close(probe);
+            close(fd);
+            return NULL;
+        }
+        close(probe);
+        unlink(path);
+    }
+
+    mask = umask(0177);
+    err = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (err < 0 || listen(fd, 16) < 0) {
+        helper_comment("# ERROR: cannot listen on '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    io = io_new(fd);
+    if (!io) {
+        close(fd);
+        return NULL;
+    }
+    io_set_close_on_destroy(io, true);
+    io_set_read_handler(io, daemon_accept, NULL, NULL);
+
+    return io;
+}
+#endif
+
 
 static void read_version_complete(uint8_t status, uint16_t length,
                     const void *param, void *user_data)
@@ -2039,7 +5695,7 @@ static void mgmt_scanning(uint16_t index, uint16_t length,
 
     DBG("Scanning (0x%x): %s", ev->type, ev->discovering? "started" : "ended");
 
-    set_state(ev->discovering? STATE_SCANNING : STATE_DISCONNECTED);
+    scan_set_state(ev->discovering? STATE_SCANNING : STATE_DISCONNECTED);
 }
 
 static void mgmt_device_found(uint16_t index, uint16_t length,
@@ -2051,16 +5707,22 @@ static void mgmt_device_found(uint16_t index, uint16_t length,
     // DBG("Device found: %02X:%02X:%02X:%02X:%02X:%02X type=%X flags=%X", val[5], val[4], val[3], val[2], val[1], val[0], ev->addr.type, ev->flags);
 
     // Result sometimes sent too early
-    if (conn_state != STATE_SCANNING)
+    if (scan_conn->state != STATE_SCANNING)
         return;
     //confirm_name(&ev->addr, 1);
 
+    if (!scan_filter(&ev->addr, -ev->rssi, ev->eir, ev->eir_len) ||
+        !scan_dedup(&ev->addr, -ev->rssi, ev->eir, ev->eir_len))
+        return;
+
+    cur_conn = scan_conn;
     resp_begin(rsp_SCAN);
     send_addr(&ev->addr);
     send_uint(tag_RSSI, -ev->rssi);
     send_uint(tag_FLAG, -ev->flags);
     if (ev->eir_len)
         send_data(ev->eir, ev->eir_len);
+    send_identity(&ev->addr);
     resp_end();
 }
 
@@ -2101,24 +5763,52 @@ static void mgmt_setup(unsigned int idx)
     }
 }
 
+#ifdef BLUEPY_EXTENSION
+/* Runs the helper on the calling thread, which the extension starts */
+void helper_run(int index)
+{
+    bin_resp = g_byte_array_new();
+    text_resp = g_string_new(NULL);
+    proto_mode = PROTO_BINARY;
+    cur_conn = scan_conn = conn_get(0);
+
+    loop_init();
+    mgmt_setup(index);
+    loop_run();
+}
+
+/* A command frame from Python, less its length; called on the loop thread */
+void helper_command(const uint8_t *frame, size_t flen)
+{
+    parse_frame(frame, flen);
+}
+#else
 int main(int argc, char *argv[])
 {
-    GIOChannel *pchan;
-    gint events;
+    struct io *pio;
+    int i;
+
+    bin_resp = g_byte_array_new();
+    text_resp = g_string_new(NULL);
+    cur_conn = scan_conn = conn_get(0);
 
-    opt_sec_level = g_strdup("low");
+    /* Before mgmt_setup(), whose socket is watched through the loop */
+    loop_init();
 
-    opt_src = NULL;
-    opt_dst = NULL;
-    opt_dst_type = g_strdup("public");
+    helper_comment("# " __FILE__ " version " VERSION_STRING " built at " __TIME__ " on " __DATE__ "\n");
 
-    printf("# " __FILE__ " version " VERSION_STRING " built at " __TIME__ " on " __DATE__ "\n");
+    /* bluepy-helper [-s <socket path>] [<index>] */
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        daemon_path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
 
     if (argc > 1) {
         int index;
 
         if (sscanf (argv[1], "%i", &index)!=1) {
-            printf("# ERROR: cannot convert '%s' to device index integer\n",argv[1]);
+            helper_comment("# ERROR: cannot convert '%s' to device index integer\n",argv[1]);
             exit(1);
         } else {
             mgmt_setup(index);
@@ -2128,25 +5818,46 @@ int main(int argc, char *argv[])
         mgmt_setup(0);
     }
 
-    event_loop = g_main_loop_new(NULL, FALSE);
-
-    pchan = g_io_channel_unix_new(fileno(stdin));
-    g_io_channel_set_close_on_unref(pchan, TRUE);
-    events = G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-    g_io_add_watch(pchan, events, prompt_read, NULL);
+    if (daemon_path) {
+        pio = daemon_listen(daemon_path);
+        if (!pio)
+            exit(1);
+    } else {
+        pio = io_new(fileno(stdin));
+        if (!pio) {
+            helper_comment("# ERROR: cannot watch stdin\n");
+            exit(1);
+        }
+        prompt_buf = g_byte_array_new();
+        io_set_close_on_destroy(pio, true);
+        io_set_read_handler(pio, prompt_read, NULL, NULL);
+        io_set_disconnect_handler(pio, prompt_hup, NULL, NULL);
+    }
+    fflush(stdout);
 
     DBG("Starting loop");
-    g_main_loop_run(event_loop);
+    loop_run();
 
     DBG("Exiting loop");
-    cmd_disconnect(0, NULL);
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        struct conn *conn = conns[i];
+
+        if (!conn)
+            continue;
+
+        disconnect_io(conn);
+        ring_close(conn);
+        g_free(conn->src);
+        g_free(conn->dst);
+        g_free(conn->dst_type);
+        g_free(conn->sec_level);
+        g_free(conn);
+        conns[i] = NULL;
+    }
     fflush(stdout);
-    g_io_channel_unref(pchan);
-    g_main_loop_unref(event_loop);
-
-    g_free(opt_src);
-    g_free(opt_dst);
-    g_free(opt_sec_level);
+    io_destroy(pio);
+    if (daemon_path)
+        unlink(daemon_path);
 
     mgmt_unregister_index(mgmt_master, mgmt_ind);
     mgmt_cancel_index(mgmt_master, mgmt_ind);
@@ -2155,5 +5866,4 @@ int main(int argc, char *argv[])
 
     return EXIT_SUCCESS;
 }
-
-
+#endif
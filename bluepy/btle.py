@@ -5,14 +5,25 @@ from __future__ import print_function
 """Bluetooth Low Energy Python interface"""
 import sys
 import os
+import stat
 import time
 import subprocess
 import binascii
 import select
 import struct
 import signal
+import socket
+import mmap
+import tempfile
+import json
+import bisect
 from queue import Queue, Empty
-from threading import Thread
+from threading import Thread, Lock
+
+try:
+    from . import _bluepy       # Optional, built by "make extension"
+except ImportError:
+    _bluepy = None
 
 def preexec_function():
     # Ignore the SIGINT signal by setting the handler to the standard
@@ -20,9 +31,17 @@ def preexec_function():
     signal.signal(signal.SIGINT, signal.SIG_IGN)
 
 Debugging = False
+UseBinaryProtocol = False  # Negotiate binary framing with bluepy-helper
+UseExtension = False       # Run the helper in-process if _bluepy is available
+GattCacheDir = None        # Directory for cached GATT databases (None: off)
 script_path = os.path.join(os.path.abspath(os.path.dirname(__file__)))
 helperExe = os.path.join(script_path, "bluepy-helper")
 
+# Socket of a bluepy-helper daemon ("bluepy-helper -s <path> <iface>"), with
+# %d standing for the interface number. While a daemon is listening there,
+# it is used instead of starting a helper process; None never looks for one.
+helperSocket = os.environ.get("BLUEPY_HELPER_SOCKET")
+
 SEC_LEVEL_LOW = "low"
 SEC_LEVEL_MEDIUM = "medium"
 SEC_LEVEL_HIGH = "high"
@@ -30,6 +49,43 @@ SEC_LEVEL_HIGH = "high"
 ADDR_TYPE_PUBLIC = "public"
 ADDR_TYPE_RANDOM = "random"
 
+# First byte of a binary response frame from bluepy-helper
+BIN_FRAME_START = b'\x02'
+
+# Connection ids understood by bluepy-helper; 0 is the default connection
+MAX_CONNECTIONS = 256
+
+# Shared-memory notification ring layout (see cmd_ring in bluepy-helper.c)
+RING_MAGIC = 0x676e6952
+RING_HDR_LEN = 64
+RING_REC_LEN = 16
+RING_PAD = 0x0001
+
+# Handles per Read Multiple request; (ATT_MTU - 1) / 2 at the default MTU of 23
+ReadMultipleMax = 11
+ATT_ECODE_REQ_NOT_SUPP = 0x06
+ATT_ECODE_ATTR_NOT_FOUND = 0x0A
+
+# PHY names for link parameters, in the order of their HCI values (1, 2, 3)
+LINK_PHYS = ("1m", "2m", "coded")
+
+def daemonPath(iface=None):
+    if helperSocket is None:
+        return None
+    if '%' not in helperSocket:
+        path = helperSocket
+    else:
+        path = helperSocket % (int(iface) if iface is not None else 0)
+    # Only a socket which we or root created: anyone else's could be an
+    # impostor answering for the adapter
+    try:
+        st = os.lstat(path)
+    except OSError:
+        return None
+    if not stat.S_ISSOCK(st.st_mode) or st.st_uid not in (0, os.getuid()):
+        return None
+    return path
+
 def DBG(*args):
     if Debugging:
         msg = " ".join([str(a) for a in args])
@@ -261,12 +317,98 @@ class DefaultDelegate:
     def handleDiscovery(self, scanEntry, isNewDev, isNewData):
         DBG("Discovered device", scanEntry.addr)
 
+class DaemonSession:
+    """A session with a bluepy-helper daemon, standing in for a helper
+       process: it has the same stdin, stdout, poll() and wait()"""
+    def __init__(self, path):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            self._sock.connect(path)
+        except OSError:
+            self._sock.close()
+            raise
+        self.stdin = self._sock.makefile('wb')
+        self.stdout = self._sock.makefile('rb')
+        self.returncode = None
+
+    def poll(self):
+        # The daemon closing the session shows as end of file
+        if self.returncode is None:
+            try:
+                if self._sock.recv(1, socket.MSG_PEEK | socket.MSG_DONTWAIT) == b'':
+                    self.returncode = 0
+            except BlockingIOError:
+                pass
+            except OSError:
+                self.returncode = -1
+        return self.returncode
+
+    def wait(self):
+        # After "quit" the session is over; this also ends the reader thread
+        try:
+            self._sock.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+        self.stdin.close()
+        self._sock.close()
+        self.returncode = 0
+        return self.returncode
+
+
+class ExtensionSession:
+    """A connection id on the helper running in-process in the _bluepy
+       extension, standing in for a helper process. Responses come back
+       already parsed, from get()."""
+    _lock = Lock()
+    _cids = set()
+    _nextCid = 1
+
+    def __init__(self, iface=None):
+        _bluepy.start(int(iface) if iface is not None else 0)
+        with ExtensionSession._lock:
+            # Round robin, as for SharedHelper
+            n = MAX_CONNECTIONS - 1
+            free = [ (ExtensionSession._nextCid + i - 1) % n + 1 for i in range(n) ]
+            free = [ c for c in free if c not in ExtensionSession._cids ]
+            if not free:
+                raise BTLEInternalError("No free connections in in-process helper")
+            self.cid = free[0]
+            ExtensionSession._nextCid = self.cid % n + 1
+            ExtensionSession._cids.add(self.cid)
+        _bluepy.discard(self.cid)
+        self.stdin = self
+        self.returncode = None
+
+    def write(self, frame):
+        _bluepy.send(frame)
+
+    def flush(self):
+        pass
+
+    def get(self, block=True, timeout=None):
+        return _bluepy.get(self.cid, timeout if block else 0)
+
+    def poll(self):
+        return self.returncode
+
+    def wait(self):
+        # "quit" only disconnected this connection; the id is free again
+        if self.returncode is None:
+            self.returncode = 0
+            with ExtensionSession._lock:
+                ExtensionSession._cids.discard(self.cid)
+        return self.returncode
+
+
 class BluepyHelper:
-    def __init__(self):
+    def __init__(self, shared=None):
         self._helper = None
         self._lineq = None
         self._stderr = None
         self._mtu = 0
+        self._binary = False
+        self._shared = shared
+        self._cid = None
         self.delegate = DefaultDelegate()
 
     def withDelegate(self, delegate_):
@@ -274,38 +416,91 @@ class BluepyHelper:
         return self
 
     def _startHelper(self,iface=None):
+        if self._shared is not None:
+            if self._helper is None:
+                (self._cid, self._lineq) = self._shared._attach()
+                self._helper = self._shared._helper
+                self._binary = self._shared._binary
+                self._mtu = 0
+            return
         if self._helper is None:
-            DBG("Running ", helperExe)
             self._lineq = Queue()
             self._mtu = 0
-            self._stderr = open(os.devnull, "w")
-            args=[helperExe]
-            if iface is not None: args.append(str(iface))
-            self._helper = subprocess.Popen(args,
-                                            stdin=subprocess.PIPE,
-                                            stdout=subprocess.PIPE,
-                                            stderr=self._stderr,
-                                            universal_newlines=True,
-                                            preexec_fn = preexec_function)
+            self._binary = False
+            path = daemonPath(iface)
+            if path is not None:
+                try:
+                    self._helper = DaemonSession(path)
+                    DBG("Using daemon at ", path)
+                except OSError:
+                    pass        # Left behind by a daemon no longer running
+            if self._helper is None and _bluepy is not None and UseExtension:
+                try:
+                    self._helper = ExtensionSession(iface)
+                except ValueError:
+                    pass        # Serving another interface
+                else:
+                    DBG("Using in-process helper, connection ", self._helper.cid)
+                    (self._cid, self._lineq, self._binary) = (self._helper.cid, self._helper, True)
+                    return
+            if self._helper is None:
+                DBG("Running ", helperExe)
+                self._stderr = open(os.devnull, "w")
+                args=[helperExe]
+                if iface is not None: args.append(str(iface))
+                self._helper = subprocess.Popen(args,
+                                                stdin=subprocess.PIPE,
+                                                stdout=subprocess.PIPE,
+                                                stderr=self._stderr,
+                                                preexec_fn = preexec_function)
             t = Thread(target=self._readToQueue)
             t.daemon = True               # don't wait for it to exit
             t.start()
+            if UseBinaryProtocol:
+                self._negotiateBinary()
+
+    def _negotiateBinary(self):
+        self._sendCmd("proto", "bin")
+        try:
+            rsp = self._waitResp('proto')
+        except BTLEException:
+            # Older helper: stay with the text protocol
+            return
+        self._binary = (rsp is not None and rsp['proto'][0] == 'bin')
 
     def _readToQueue(self):
-        """Thread to read lines from stdout and insert in queue."""
+        """Thread to read lines and binary frames from stdout and insert in queue."""
+        stdout = self._helper.stdout
         while self._helper:
-            line = self._helper.stdout.readline()
-            if not line:                  # EOF
+            first = stdout.read(1)
+            if not first:                 # EOF
                 break
-            self._lineq.put(line)
+            if first == BIN_FRAME_START:
+                hdr = stdout.read(4)
+                if len(hdr) < 4:
+                    break
+                frame = stdout.read(struct.unpack('<I', hdr)[0])
+                self._enqueue(frame)
+            else:
+                line = first + stdout.readline()
+                self._enqueue(line.decode('utf-8', 'replace'))
+
+    def _enqueue(self, item):
+        self._lineq.put(item)
 
     def _stopHelper(self):
+        if self._shared is not None:
+            if self._helper is not None:
+                self._shared._detach(self._cid)
+                self._helper = None
+                self._cid = None
+            return
         if self._helper is not None:
             DBG("Stopping ", helperExe)
-            self._helper.stdin.write("quit\n")
-            self._helper.stdin.flush()
+            self._sendCmd("quit")
             self._helper.wait()
             self._helper = None
+            self._cid = None
         if self._stderr is not None:
             self._stderr.close()
             self._stderr = None
@@ -313,16 +508,54 @@ class BluepyHelper:
     def _writeCmd(self, cmd):
         if self._helper is None:
             raise BTLEInternalError("Helper not started (did you call connect()?)")
-        DBG("Sent: ", cmd)
+        if self._shared is not None:
+            self._shared._writeCmd(cmd)
+            return
+        DBG("Sent: ", repr(cmd))
+        if not isinstance(cmd, bytes):
+            cmd = cmd.encode('utf-8')
         self._helper.stdin.write(cmd)
         self._helper.stdin.flush()
 
-    def _mgmtCmd(self, cmd):
-        self._writeCmd(cmd + '\n')
+    def _sendCmd(self, *args):
+        if self._cid is not None:
+            args = ("@%x" % self._cid,) + args
+        if self._binary:
+            self._writeCmd(BluepyHelper.encodeCmd(args))
+        else:
+            self._writeCmd(BluepyHelper.formatCmd(args))
+
+    def _mgmtCmd(self, *args):
+        self._sendCmd(*args)
         rsp = self._waitResp('mgmt')
         if rsp['code'][0] != 'success':
             self._stopHelper()
-            raise BTLEManagementError("Failed to execute management command '%s'" % (cmd), rsp)
+            raise BTLEManagementError("Failed to execute management command '%s'" % (" ".join(str(a) for a in args)), rsp)
+
+    @staticmethod
+    def formatCmd(args):
+        """Text command line: ints are handles in hex, bytes are hex data"""
+        words = []
+        for a in args:
+            if isinstance(a, int):
+                words.append("%X" % a)
+            elif isinstance(a, bytes):
+                words.append(binascii.b2a_hex(a).decode('utf-8'))
+            else:
+                words.append(a)
+        return " ".join(words) + "\n"
+
+    @staticmethod
+    def encodeCmd(args):
+        """Binary command frame: ints are u16 handles, bytes are raw data"""
+        body = b''
+        for a in args:
+            if isinstance(a, int):
+                a = struct.pack('<H', a)
+            elif not isinstance(a, bytes):
+                a = a.encode('utf-8')
+            body += struct.pack('<H', len(a)) + a
+        return struct.pack('<I', len(body)) + body
 
     @staticmethod
     def parseResp(line):
@@ -346,6 +579,32 @@ class BluepyHelper:
                 resp[tag].append(val)
         return resp
 
+    @staticmethod
+    def parseFrame(frame):
+        resp = {}
+        pos = 0
+        while pos < len(frame):
+            taglen = frame[pos]
+            tag = frame[pos+1 : pos+1+taglen].decode('utf-8')
+            vtype = frame[pos+1+taglen : pos+2+taglen]
+            pos += 2 + taglen
+            if vtype == b'h':
+                val = struct.unpack_from('<I', frame, pos)[0]
+                pos += 4
+            else:
+                vlen = struct.unpack_from('<H', frame, pos)[0]
+                val = frame[pos+2 : pos+2+vlen]
+                pos += 2 + vlen
+                if vtype == b'$' or vtype == b"'":
+                    val = val.decode('utf-8')
+                elif vtype != b'b':
+                    raise BTLEInternalError("Cannot understand response type %s" % repr(vtype))
+            if tag not in resp:
+                resp[tag] = [val]
+            else:
+                resp[tag].append(val)
+        return resp
+
     def _waitResp(self, wantType, timeout=None):
         while True:
             if self._helper.poll() is not None:
@@ -358,57 +617,153 @@ class BluepyHelper:
                 return None
 
             DBG("Got:", repr(rv))
-            if rv.startswith('#') or rv == '\n' or len(rv)==0:
+            if isinstance(rv, dict):
+                resp = rv               # Already parsed by a SharedHelper
+            elif isinstance(rv, bytes):
+                resp = BluepyHelper.parseFrame(rv)
+            elif rv.startswith('#') or rv == '\n' or len(rv)==0:
                 continue
+            else:
+                resp = BluepyHelper.parseResp(rv)
+            if self._checkResp(resp, wantType):
+                return resp
 
-            resp = BluepyHelper.parseResp(rv)
-            if 'rsp' not in resp:
-                raise BTLEInternalError("No response type indicator", resp)
+    def _checkResp(self, resp, wantType):
+        """True if resp is one of wantType, False if it should be skipped;
+           raises the exception for an error response"""
+        if 'rsp' not in resp:
+            raise BTLEInternalError("No response type indicator", resp)
 
-            respType = resp['rsp'][0]
+        respType = resp['rsp'][0]
 
-            # always check for MTU updates
-            if 'mtu' in resp and len(resp['mtu']) > 0:
-                new_mtu = int(resp['mtu'][0])
-                if self._mtu != new_mtu:
-                    self._mtu = new_mtu
-                    DBG("Updated MTU: " + str(self._mtu))
+        # always check for MTU updates
+        if 'mtu' in resp and len(resp['mtu']) > 0:
+            new_mtu = int(resp['mtu'][0])
+            if self._mtu != new_mtu:
+                self._mtu = new_mtu
+                DBG("Updated MTU: " + str(self._mtu))
 
-            if respType in wantType:
-                return resp
-            elif respType == 'stat':
-                if 'state' in resp and len(resp['state']) > 0 and resp['state'][0] == 'disc':
-                    self._stopHelper()
-                    raise BTLEDisconnectError("Device disconnected", resp)
-            elif respType == 'err':
-                errcode=resp['code'][0]
-                if errcode=='nomgmt':
-                    raise BTLEManagementError("Management not available (permissions problem?)", resp)
-                elif errcode=='atterr':
-                    raise BTLEGattError("Bluetooth command failed", resp)
-                else:
-                    raise BTLEException("Error from bluepy-helper (%s)" % errcode, resp)
-            elif respType == 'scan':
-                # Scan response when we weren't interested. Ignore it
-                continue
+        if respType in wantType:
+            return True
+        elif respType == 'stat':
+            if 'state' in resp and len(resp['state']) > 0 and resp['state'][0] == 'disc':
+                self._stopHelper()
+                raise BTLEDisconnectError("Device disconnected", resp)
+            return False
+        elif respType == 'err':
+            errcode=resp['code'][0]
+            if errcode=='nomgmt':
+                raise BTLEManagementError("Management not available (permissions problem?)", resp)
+            elif errcode=='atterr':
+                raise BTLEGattError("Bluetooth command failed", resp)
             else:
-                raise BTLEInternalError("Unexpected response (%s)" % respType, resp)
+                raise BTLEException("Error from bluepy-helper (%s)" % errcode, resp)
+        elif respType == 'scan':
+            # Scan response when we weren't interested. Ignore it
+            return False
+        else:
+            raise BTLEInternalError("Unexpected response (%s)" % respType, resp)
 
     def status(self):
-        self._writeCmd("stat\n")
+        self._sendCmd("stat")
         return self._waitResp(['stat'])
 
 
-class Peripheral(BluepyHelper):
-    def __init__(self, deviceAddr=None, addrType=ADDR_TYPE_PUBLIC, iface=None, timeout=None):
+class SharedHelper(BluepyHelper):
+    """A single bluepy-helper process carrying connections for many
+       Peripheral objects. Each Peripheral gets its own connection id, and
+       responses are routed to it by the 'cid' tag."""
+    def __init__(self, iface=None):
         BluepyHelper.__init__(self)
+        self._lock = Lock()
+        self._queues = {}
+        self._nextCid = 1
+        self.iface = iface
+        self._startHelper(iface)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        self.close()
+
+    def close(self):
+        self._stopHelper()
+
+    def _attach(self):
+        if isinstance(self._helper, ExtensionSession):
+            # Ids are shared by everything in the process using the extension
+            session = ExtensionSession(self.iface)
+            with self._lock:
+                self._queues[session.cid] = session
+            return (session.cid, session)
+        with self._lock:
+            # Round robin, so late responses for an id just given up go nowhere
+            for i in range(MAX_CONNECTIONS - 1):
+                cid = (self._nextCid + i - 1) % (MAX_CONNECTIONS - 1) + 1
+                if cid not in self._queues:
+                    self._queues[cid] = Queue()
+                    self._nextCid = cid % (MAX_CONNECTIONS - 1) + 1
+                    return (cid, self._queues[cid])
+        raise BTLEInternalError("No free connections in shared helper")
+
+    def _detach(self, cid):
+        with self._lock:
+            q = self._queues.pop(cid, None)
+        # The helper may still be connecting (say after a timeout)
+        args = ("@%x" % cid, "quit" if isinstance(q, ExtensionSession) else "disc")
+        try:
+            if self._binary:
+                self._writeCmd(BluepyHelper.encodeCmd(args))
+            else:
+                self._writeCmd(BluepyHelper.formatCmd(args))
+        except (BTLEException, OSError):
+            pass        # The helper has gone, and the connection with it
+        if isinstance(q, ExtensionSession):
+            q.wait()
+
+    def _enqueue(self, item):
+        if not isinstance(item, bytes) and (item.startswith('#') or len(item.strip()) == 0):
+            return
+        try:
+            if isinstance(item, bytes):
+                resp = BluepyHelper.parseFrame(item)
+            else:
+                resp = BluepyHelper.parseResp(item)
+        except (BTLEException, ValueError, struct.error):
+            DBG("Cannot parse:", repr(item))
+            return
+        cid = resp.get('cid', [0])[0]
+        q = self._lineq if cid == 0 else self._queues.get(cid)
+        if q is not None:
+            q.put(resp)
+
+    def _writeCmd(self, cmd):
+        with self._lock:
+            BluepyHelper._writeCmd(self, cmd)
+
+
+class Peripheral(BluepyHelper):
+    def __init__(self, deviceAddr=None, addrType=ADDR_TYPE_PUBLIC, iface=None, timeout=None, helper=None,
+                 linkParams=None):
+        BluepyHelper.__init__(self, helper)
         self._serviceMap = None # Indexed by UUID
+        self._gattCache = None
+        self._ring = None
+        self._ringView = None
+        self._draining = False
+        self._readMultiVL = True
+        self._handlers = {}
+        self._notifyError = None
+        self.notificationTime = None
+        self.notificationsDropped = 0
+        self.linkInfo = {}
         (self.deviceAddr, self.addrType, self.iface) = (None, None, None)
 
         if isinstance(deviceAddr, ScanEntry):
-            self._connect(deviceAddr.addr, deviceAddr.addrType, deviceAddr.iface, timeout)
+            self._connect(deviceAddr.addr, deviceAddr.addrType, deviceAddr.iface, timeout, linkParams)
         elif deviceAddr is not None:
-            self._connect(deviceAddr, addrType, iface, timeout)
+            self._connect(deviceAddr, addrType, iface, timeout, linkParams)
 
     def setDelegate(self, delegate_): # same as withDelegate(), deprecated
         return self.withDelegate(delegate_)
@@ -424,21 +779,67 @@ class Peripheral(BluepyHelper):
             wantType = [wantType]
 
         while True:
-            resp = self._waitResp(wantType + ['ntfy', 'ind'], timeout)
+            resp = self._waitResp(wantType + ['ntfy', 'ind', 'ring'], timeout)
             if resp is None:
                 return None
 
             respType = resp['rsp'][0]
+            if respType == 'ring':
+                # Doorbell: notifications are waiting in the ring
+                if self._drainRing() > 0 and 'ntfy' in wantType:
+                    return resp
+                continue
+            if respType == 'ind' and self._gattCache is not None:
+                if resp['hnd'][0] in self._gattCache['changed']:
+                    self._dropGattCache()
             if respType == 'ntfy' or respType == 'ind':
-                hnd = resp['hnd'][0]
-                data = resp['d'][0]
-                if self.delegate is not None:
-                    self.delegate.handleNotification(hnd, data)
+                self._dispatchNotification(resp['hnd'][0], resp['d'][0])
             if respType not in wantType:
                 continue
             return resp
 
-    def _connect(self, addr, addrType=ADDR_TYPE_PUBLIC, iface=None, timeout=None):
+    @staticmethod
+    def linkCmd(params):
+        # Helper 'link' command for a dict of link parameters; see connect()
+        args = ["link"]
+        for key in params:
+            val = params[key]
+            if key == 'mtu':
+                args += ["mtu", "%x" % val]
+            elif key == 'dataLength':
+                args += ["dle", "%x" % val]
+            elif key == 'phy':
+                if val not in LINK_PHYS:
+                    raise ValueError("Unknown PHY %s" % repr(val))
+                args += ["phy", val]
+            elif key == 'interval':
+                args += ["int", "%x" % int(round(val / 1.25))]
+            elif key == 'latency':
+                args += ["lat", "%x" % val]
+            elif key == 'supervisionTimeout':
+                args += ["tmo", "%x" % int(round(val / 10.0))]
+            else:
+                raise ValueError("Unknown link parameter %s" % repr(key))
+        return args
+
+    @staticmethod
+    def parseLinkInfo(rsp, params=None):
+        # Every status carries the MTU, so it only counts if it was asked for
+        info = {}
+        if params and 'mtu' in params and rsp.get('mtu', [0])[0]:
+            info['mtu'] = rsp['mtu'][0]
+        if 'dle' in rsp:
+            info['dataLength'] = rsp['dle'][0]
+        if 'txphy' in rsp:
+            info['txPhy'] = LINK_PHYS[rsp['txphy'][0] - 1]
+            info['rxPhy'] = LINK_PHYS[rsp['rxphy'][0] - 1]
+        if 'intv' in rsp:
+            info['interval'] = rsp['intv'][0] * 1.25
+            info['latency'] = rsp['lat'][0]
+            info['supervisionTimeout'] = rsp['tmo'][0] * 10
+        return info
+
+    def _connect(self, addr, addrType=ADDR_TYPE_PUBLIC, iface=None, timeout=None, linkParams=None):
         if len(addr.split(":")) != 6:
             raise ValueError("Expected MAC address, got %s" % repr(addr))
         if addrType not in (ADDR_TYPE_PUBLIC, ADDR_TYPE_RANDOM):
@@ -447,10 +848,16 @@ class Peripheral(BluepyHelper):
         self.addr = addr
         self.addrType = addrType
         self.iface = iface
+        self._readMultiVL = True
+        if linkParams:
+            self._sendCmd(*self.linkCmd(linkParams))
+            rsp = self._getResp('mgmt')
+            if rsp['code'][0] != 'success':
+                raise BTLEManagementError("Bad link parameters %s" % repr(linkParams), rsp)
         if iface is not None:
-            self._writeCmd("conn %s %s %s\n" % (addr, addrType, "hci"+str(iface)))
+            self._sendCmd("conn", addr, addrType, "hci"+str(iface))
         else:
-            self._writeCmd("conn %s %s\n" % (addr, addrType))
+            self._sendCmd("conn", addr, addrType)
         rsp = self._getResp('stat', timeout)
         timeout_exception = BTLEDisconnectError(
             "Timed out while trying to connect to peripheral %s, addr type: %s" %
@@ -466,12 +873,15 @@ class Peripheral(BluepyHelper):
             else:
                 raise BTLEDisconnectError("Failed to connect to peripheral %s, addr type: %s"
                                           % (addr, addrType), rsp)
+        self.linkInfo = self.parseLinkInfo(rsp, linkParams)
+        if GattCacheDir is not None:
+            self._loadGattCache()
 
-    def connect(self, addr, addrType=ADDR_TYPE_PUBLIC, iface=None, timeout=None):
+    def connect(self, addr, addrType=ADDR_TYPE_PUBLIC, iface=None, timeout=None, linkParams=None):
         if isinstance(addr, ScanEntry):
-            self._connect(addr.addr, addr.addrType, addr.iface, timeout)
+            self._connect(addr.addr, addr.addrType, addr.iface, timeout, linkParams)
         elif addr is not None:
-            self._connect(addr, addrType, iface, timeout)
+            self._connect(addr, addrType, iface, timeout, linkParams)
 
     def disconnect(self):
         if self._helper is None:
@@ -479,13 +889,219 @@ class Peripheral(BluepyHelper):
         # Unregister the delegate first
         self.setDelegate(None)
 
-        self._writeCmd("disc\n")
+        self._sendCmd("disc")
         self._getResp('stat')
         self._stopHelper()
 
+    def _stopHelper(self):
+        self._closeRing()
+        BluepyHelper._stopHelper(self)
+
+    def enableNotificationRing(self, size=65536):
+        # Notifications are delivered through a shared-memory ring instead
+        # of being hex-encoded on the helper's stdout
+        self.disableNotificationRing()
+        size = 1 << max(8, (size - 1).bit_length())
+        shmdir = "/dev/shm" if os.path.isdir("/dev/shm") else None
+        (fd, path) = tempfile.mkstemp(prefix="bluepy-ring-", dir=shmdir)
+        try:
+            os.ftruncate(fd, RING_HDR_LEN + size)
+            ring = mmap.mmap(fd, RING_HDR_LEN + size)
+            struct.pack_into('=II', ring, 0, RING_MAGIC, size)
+            self._sendCmd("ring", path)
+            try:
+                self._getResp('stat')
+            except BTLEException:
+                ring.close()
+                raise
+        finally:
+            # The helper has it mapped now; nothing else needs the name
+            os.close(fd)
+            os.unlink(path)
+        self._ring = ring
+        self._ringView = memoryview(ring)
+        self.notificationsDropped = 0
+
+    def disableNotificationRing(self):
+        if self._ring is None:
+            return
+        self._sendCmd("ring")
+        self._getResp('stat')
+        self._drainRing()
+        self._closeRing()
+
+    def _closeRing(self):
+        if self._ring is not None:
+            self._ringView.release()
+            self._ring.close()
+            self._ring = None
+            self._ringView = None
+
+    def setNotificationHandler(self, handle, callback, fmt=None):
+        # Notifications and indications for handle go to callback(handle, data)
+        # instead of the delegate. With fmt, data is the tuple unpacked from the
+        # value by a precompiled struct.Struct. A callback of None removes it.
+        if callback is None:
+            self._handlers.pop(handle, None)
+        else:
+            self._handlers[handle] = (callback, struct.Struct(fmt) if fmt else None)
+        return self
+
+    def _dispatchNotification(self, hnd, data):
+        handler = self._handlers.get(hnd)
+        if handler is not None:
+            (callback, decoder) = handler
+            if decoder is None:
+                return callback(hnd, data)
+            try:
+                values = Peripheral._decodeNotification(hnd, decoder, data)
+            except BTLEGattError as e:
+                # Raised by waitForNotifications(); raising here could leave
+                # the response some other call is waiting for in the queue
+                if self._notifyError is None:
+                    self._notifyError = e
+                return
+            return callback(hnd, values)
+        if self.delegate is not None:
+            self.delegate.handleNotification(hnd, data)
+
+    @staticmethod
+    def _decodeNotification(hnd, decoder, data):
+        if len(data) != decoder.size:
+            raise BTLEGattError("Notification for handle 0x%X is %d bytes, format '%s' needs %d"
+                                % (hnd, len(data), decoder.format, decoder.size))
+        return decoder.unpack(data)
+
+    def _drainRing(self):
+        if self._ring is None or self._draining:
+            return 0
+        ring = self._ring
+        size = struct.unpack_from('=I', ring, 4)[0]
+        (head, tail) = struct.unpack_from('=II', ring, 8)
+        count = 0
+        self._draining = True
+        try:
+            while tail != head:
+                off = RING_HDR_LEN + (tail & (size - 1))
+                (hnd, dlen, flags, ts) = struct.unpack_from('<HHIQ', ring, off)
+                if flags & RING_PAD:
+                    tail += size - (tail & (size - 1))
+                else:
+                    nxt = (tail + ((RING_REC_LEN + dlen + 15) & ~15)) & 0xFFFFFFFF
+                    if self.delegate is not None or self._handlers:
+                        # data is only valid until the handler returns
+                        self.notificationTime = ts / 1e9
+                        data = self._ringView[off + RING_REC_LEN : off + RING_REC_LEN + dlen]
+                        try:
+                            self._dispatchNotification(hnd, data)
+                        finally:
+                            data.release()
+                            # Past this record even if the handler raised
+                            if self._ring is not None:
+                                struct.pack_into('=I', ring, 12, nxt)
+                        if self._ring is None:
+                            break
+                    tail = nxt
+                    count += 1
+                tail &= 0xFFFFFFFF
+                struct.pack_into('=I', ring, 12, tail)
+                if tail == head:
+                    head = struct.unpack_from('=I', ring, 8)[0]
+        finally:
+            self._draining = False
+        if self._ring is not None:
+            # Notifications the helper found no room for
+            self.notificationsDropped = struct.unpack_from('=I', ring, 16)[0]
+        return count
+
+    # GATT cache: discovery responses are kept on disk per device address,
+    # together with the device's Database Hash. They are reused on later
+    # connections while the hash is unchanged, and thrown away when a
+    # Service Changed indication arrives. A device without a Database Hash
+    # can't show that its database has changed, so it is never cached.
+    def _gattCachePath(self):
+        return os.path.join(GattCacheDir, self.addr.replace(":", "").lower() + ".json")
+
+    def _readDatabaseHash(self):
+        try:
+            # Database Hash characteristic (GATT 5.1)
+            rsp = self._readCharacteristicByUUID(0x2B2A, 1, 0xFFFF)
+        except BTLEGattError:
+            return None
+        if rsp is None or 'd' not in rsp:
+            return None
+        return binascii.b2a_hex(rsp['d'][0]).decode('utf-8')
+
+    def _loadGattCache(self):
+        dbHash = self._readDatabaseHash()
+        if dbHash is None:
+            DBG("No Database Hash: not caching GATT database for", self.addr)
+            self._gattCache = None
+            return
+        self._gattCache = { 'hash': dbHash, 'queries': {}, 'changed': [] }
+        try:
+            with open(self._gattCachePath()) as fp:
+                cache = json.load(fp)
+        except (IOError, OSError, ValueError):
+            return
+        if cache.get('hash') != dbHash:
+            DBG("GATT cache for", self.addr, "is out of date")
+            return
+        self._gattCache = cache
+        self._watchServiceChanged(cache['changed'])
+        if "svcs" in cache['queries']:
+            self.discoverServices()
+
+    def _saveGattCache(self):
+        path = self._gattCachePath()
+        try:
+            if not os.path.isdir(GattCacheDir):
+                os.makedirs(GattCacheDir)
+            with open(path + ".tmp", "w") as fp:
+                json.dump(self._gattCache, fp)
+            os.rename(path + ".tmp", path)
+        except (IOError, OSError) as e:
+            DBG("Cannot write GATT cache:", e)
+
+    def _dropGattCache(self):
+        DBG("Service Changed: dropping GATT cache for", self.addr)
+        # The hash is stale too; the next connection reads it again
+        self._gattCache = None
+        self._serviceMap = None
+        try:
+            os.unlink(self._gattCachePath())
+        except OSError:
+            pass
+
+    def _discover(self, rspType, *args):
+        key = BluepyHelper.formatCmd(args).strip()
+        if self._gattCache is not None and key in self._gattCache['queries']:
+            return self._gattCache['queries'][key]
+        self._sendCmd(*args)
+        rsp = self._getResp(rspType)
+        if self._gattCache is not None:
+            rsp = dict((tag, vals) for (tag, vals) in rsp.items() if tag != 'cid')
+            self._gattCache['queries'][key] = rsp
+            # Characteristics are 'uuid' in 'find' responses, 'cuuid' in 'tree'
+            uuids = rsp.get('cuuid' if rspType == 'tree' else 'uuid', [])
+            changed = [ vhnd for (uuid, vhnd) in zip(uuids, rsp.get('vhnd', []))
+                        if UUID(uuid) == AssignedNumbers.service_changed and
+                           vhnd not in self._gattCache['changed'] ]
+            self._gattCache['changed'] += changed
+            self._saveGattCache()
+            self._watchServiceChanged(changed)
+        return rsp
+
+    def _watchServiceChanged(self, handles):
+        # Service Changed is only indicated once enabled, which a device
+        # only remembers across connections if bonded
+        try:
+            self._subscribe("ind", handles, None)
+        except BTLEGattError as e:
+            DBG("Cannot enable Service Changed indications:", e)
+
     def discoverServices(self):
-        self._writeCmd("svcs\n")
-        rsp = self._getResp('find')
+        rsp = self._discover('find', "svcs")
         starts = rsp['hstart']
         ends   = rsp['hend']
         uuids  = rsp['uuid']
@@ -496,6 +1112,12 @@ class Peripheral(BluepyHelper):
             self._serviceMap[UUID(uuids[i])] = Service(self, uuids[i], starts[i], ends[i])
         return self._serviceMap
 
+    def discoverAll(self):
+        # Services, characteristics and descriptors with one helper command
+        rsp = self._discover('tree', "tree")
+        self._serviceMap = buildServiceTree(self, rsp)
+        return self._serviceMap
+
     def getState(self):
         status = self.status()
         return status['state'][0]
@@ -513,8 +1135,7 @@ class Peripheral(BluepyHelper):
         uuid = UUID(uuidVal)
         if self._serviceMap is not None and uuid in self._serviceMap:
             return self._serviceMap[uuid]
-        self._writeCmd("svcs %s\n" % uuid)
-        rsp = self._getResp('find')
+        rsp = self._discover('find', "svcs", str(uuid))
         if 'hstart' not in rsp:
             raise BTLEGattError("Service %s not found" % (uuid.getCommonName()), rsp)
         svc = Service(self, uuid, rsp['hstart'][0], rsp['hend'][0])
@@ -526,22 +1147,20 @@ class Peripheral(BluepyHelper):
 
     def _getIncludedServices(self, startHnd=1, endHnd=0xFFFF):
         # TODO: No working example of this yet
-        self._writeCmd("incl %X %X\n" % (startHnd, endHnd))
+        self._sendCmd("incl", startHnd, endHnd)
         return self._getResp('find')
 
     def getCharacteristics(self, startHnd=1, endHnd=0xFFFF, uuid=None):
-        cmd = 'char %X %X' % (startHnd, endHnd)
+        args = ['char', startHnd, endHnd]
         if uuid:
-            cmd += ' %s' % UUID(uuid)
-        self._writeCmd(cmd + "\n")
-        rsp = self._getResp('find')
+            args.append(str(UUID(uuid)))
+        rsp = self._discover('find', *args)
         nChars = len(rsp['hnd'])
         return [Characteristic(self, rsp['uuid'][i], rsp['hnd'][i],
                                rsp['props'][i], rsp['vhnd'][i])
                 for i in range(nChars)]
 
     def getDescriptors(self, startHnd=1, endHnd=0xFFFF):
-        self._writeCmd("desc %X %X\n" % (startHnd, endHnd) )
         # Historical note:
         # Certain Bluetooth LE devices are not capable of sending back all
         # descriptors in one packet due to the limited size of MTU. So the
@@ -550,29 +1169,153 @@ class Peripheral(BluepyHelper):
         # In bluez 5.25 and later, gatt_discover_desc() in attrib/gatt.c does the retry
         # so bluetooth_helper always returns a full list.
         # This was broken in earlier versions.
-        resp = self._getResp('desc')
+        resp = self._discover('desc', "desc", startHnd, endHnd)
         ndesc = len(resp['hnd'])
         return [Descriptor(self, resp['uuid'][i], resp['hnd'][i]) for i in range(ndesc)]
 
     def readCharacteristic(self, handle):
-        self._writeCmd("rd %X\n" % handle)
+        self._sendCmd("rd", handle)
         resp = self._getResp('rd')
         return resp['d'][0]
 
+    def readCharacteristics(self, handles, lengths=None):
+        # Reads several values with one Read Multiple request per group of
+        # handles. Without lengths, the Read Multiple Variable Length request
+        # is used; peers which don't support it (and any value too long to
+        # fit in the response) fall back to queued single reads. With
+        # lengths, the plain request is used and its reply split to match.
+        handles = list(handles)
+        values = []
+        for i in range(0, len(handles), ReadMultipleMax):
+            group = handles[i:i+ReadMultipleMax]
+            if len(group) < 2:
+                got = []
+            elif lengths is not None:
+                got = self._readMultiple(group, lengths[i:i+ReadMultipleMax])
+            elif self._readMultiVL:
+                got = self._readMultipleVL(group)
+            else:
+                got = []
+            if len(got) < len(group):
+                got += self.batch([("rd", h) for h in group[len(got):]])
+            values += got
+        return values
+
+    def _readMultiple(self, handles, lengths):
+        self._sendCmd("rdm", *handles)
+        data = self._getResp('rd')['d'][0]
+        values = []
+        ofs = 0
+        for n in lengths:
+            if ofs + n > len(data):
+                break   # Truncated at the ATT MTU
+            values.append(data[ofs:ofs+n])
+            ofs += n
+        return values
+
+    def _readMultipleVL(self, handles):
+        self._sendCmd("rdmv", *handles)
+        try:
+            return self._getResp('rd')['d']
+        except BTLEGattError as e:
+            if e.estat != ATT_ECODE_REQ_NOT_SUPP:
+                raise
+            self._readMultiVL = False
+            return []
+
     def _readCharacteristicByUUID(self, uuid, startHnd, endHnd):
-        # Not used at present
-        self._writeCmd("rdu %s %X %X\n" % (UUID(uuid), startHnd, endHnd))
+        # The helper repeats Read By Type until the range is exhausted
+        self._sendCmd("rdu", str(UUID(uuid)), startHnd, endHnd)
         return self._getResp('rd')
 
+    def readCharacteristicsByUUID(self, uuid, startHnd=1, endHnd=0xFFFF):
+        try:
+            rsp = self._readCharacteristicByUUID(uuid, startHnd, endHnd)
+        except BTLEGattError as e:
+            if e.estat == ATT_ECODE_ATTR_NOT_FOUND:
+                return []
+            raise
+        return list(zip(rsp.get('hnd', []), rsp.get('d', [])))
+
     def writeCharacteristic(self, handle, val, withResponse=False, timeout=None):
         # Without response, a value too long for one packet will be truncated,
         # but with response, it will be sent as a queued write
         cmd = "wrr" if withResponse else "wr"
-        self._writeCmd("%s %X %s\n" % (cmd, handle, binascii.b2a_hex(val).decode('utf-8')))
+        self._sendCmd(cmd, handle, bytes(val))
         return self._getResp('wr', timeout)
 
+    def _subscribe(self, mode, handles, timeout):
+        handles = list(handles)
+        if not handles:
+            return {}
+        self._sendCmd("sub", mode, *handles)
+        resp = self._getResp('sub', timeout)
+        if resp is None:
+            return None
+        for (hnd, estat) in zip(resp['hnd'], resp['estat']):
+            if estat != 0:
+                raise BTLEGattError("Cannot configure notifications for handle 0x%X" % hnd,
+                                    {'estat': [estat]})
+        return dict(zip(resp['hnd'], resp['dhnd']))
+
+    def subscribe(self, handles, indicate=False, timeout=None):
+        # Enables notifications (or indications) for each characteristic value
+        # handle; the helper finds each CCCD and writes them all in one go.
+        # Returns a dict mapping each value handle to its CCCD handle.
+        return self._subscribe("ind" if indicate else "ntfy", handles, timeout)
+
+    def unsubscribe(self, handles, timeout=None):
+        return self._subscribe("off", handles, timeout)
+
+    def writeCharacteristics(self, writes, timeout=None):
+        # writes is a list of (handle, value) pairs. They are queued on the
+        # peripheral with Prepare Write requests and applied together by one
+        # Execute Write, so either all of them take effect or none do.
+        args = ["wrt"]
+        for (handle, val) in writes:
+            args += [handle, bytes(val)]
+        self._sendCmd(*args)
+        return self._getResp('wr', timeout)
+
+    def writeStream(self, handle, val, timeout=None):
+        # Sends a long value as a series of Write Without Response PDUs of
+        # (MTU - 3) bytes each. The helper queues them as fast as the link
+        # drains and answers once, with the number of bytes written.
+        self._sendCmd("wrs", handle, bytes(val))
+        resp = self._getResp('wrs', timeout)
+        if resp is None:
+            return None
+        if resp['estat'][0] != 0:
+            raise BTLEGattError("Stream write to handle 0x%X failed after %d bytes"
+                                % (handle, resp['len'][0]), resp)
+        return resp['len'][0]
+
+    def batch(self, ops, timeout=None):
+        # ops is a list of ("rd", handle), ("wrr", handle, val) or
+        # ("wr", handle, val). They are all sent in one command and queued
+        # back-to-back by the helper; the result is a list with the value
+        # read (or None for a write) for each operation.
+        args = ["batch"]
+        for op in ops:
+            if op[0] == "rd":
+                args += ["rd", op[1]]
+            elif op[0] in ("wr", "wrr"):
+                args += [op[0], op[1], bytes(op[2])]
+            else:
+                raise ValueError("Unknown batch operation %s" % repr(op[0]))
+        self._sendCmd(*args)
+        resp = self._getResp('batch', timeout)
+        if resp is None:
+            return None
+        for (hnd, estat) in zip(resp['hnd'], resp['estat']):
+            if estat != 0:
+                raise BTLEGattError("Batch operation on handle 0x%X failed" % hnd,
+                                    {'estat': [estat]})
+        return [ (resp['d'][i] if ops[i][0] == "rd" else None)
+                 for i in range(len(ops)) ]
+
     def setSecurityLevel(self, level):
-        self._writeCmd("secu %s\n" % level)
+        self._sendCmd("secu", level)
         return self._getResp('stat')
 
     def unpair(self):
@@ -585,27 +1328,34 @@ class Peripheral(BluepyHelper):
         return self._mtu
 
     def setMTU(self, mtu):
-        self._writeCmd("mtu %x\n" % mtu)
+        self._sendCmd("mtu", "%x" % mtu)
         return self._getResp('stat')
 
     def waitForNotifications(self, timeout):
+         self._raiseNotifyError()
          resp = self._getResp(['ntfy','ind'], timeout)
+         self._raiseNotifyError()
          return (resp != None)
 
+    def _raiseNotifyError(self):
+        (e, self._notifyError) = (self._notifyError, None)
+        if e is not None:
+            raise e
+
     def _setRemoteOOB(self, address, address_type, oob_data, iface=None):
         if self._helper is None:
             self._startHelper(iface)
         self.addr = address
         self.addrType = address_type
         self.iface = iface
-        cmd = "remote_oob " + address + " " + address_type
+        args = ["remote_oob", address, address_type]
         if oob_data['C_192'] is not None and oob_data['R_192'] is not None:
-            cmd += " C_192 " + oob_data['C_192'] + " R_192 " + oob_data['R_192']
+            args += ["C_192", oob_data['C_192'], "R_192", oob_data['R_192']]
         if oob_data['C_256'] is not None and oob_data['R_256'] is not None:
-            cmd += " C_256 " + oob_data['C_256'] + " R_256 " + oob_data['R_256']
+            args += ["C_256", oob_data['C_256'], "R_256", oob_data['R_256']]
         if iface is not None:
-            cmd += " hci"+str(iface)
-        self._writeCmd(cmd)
+            args.append("hci"+str(iface))
+        self._sendCmd(*args)
 
     def setRemoteOOB(self, address, address_type, oob_data, iface=None):
         if len(address.split(":")) != 6:
@@ -621,7 +1371,7 @@ class Peripheral(BluepyHelper):
         if self._helper is None:
             self._startHelper(iface)
         self.iface = iface
-        self._writeCmd("local_oob\n")
+        self._sendCmd("local_oob")
         if iface is not None:
             cmd += " hci"+str(iface)
         resp = self._getResp('oob')
@@ -662,6 +1412,38 @@ class Peripheral(BluepyHelper):
     def __del__(self):
         self.disconnect()
 
+def buildServiceTree(peripheral, rsp):
+    """Service, Characteristic and Descriptor objects from a 'tree' response,
+       as a dictionary of services indexed by UUID"""
+    serviceMap = {}
+    services = []
+    for (start, end, uuid) in zip(rsp.get('hstart', []), rsp.get('hend', []), rsp.get('uuid', [])):
+        svc = Service(peripheral, uuid, start, end)
+        serviceMap[svc.uuid] = svc
+        services.append(svc)
+    chars = [ Characteristic(peripheral, uuid, hnd, props, vhnd)
+              for (hnd, props, vhnd, uuid) in zip(rsp.get('hnd', []), rsp.get('props', []),
+                                                  rsp.get('vhnd', []), rsp.get('cuuid', [])) ]
+    descs = sorted([ Descriptor(peripheral, uuid, hnd)
+                     for (hnd, uuid) in zip(rsp.get('dhnd', []), rsp.get('duuid', [])) ],
+                   key=lambda d: d.handle)
+    descHandles = [ d.handle for d in descs ]
+
+    # Same division of descriptors as Service/Characteristic.getDescriptors()
+    for svc in services:
+        svc.chars = [ ch for ch in chars if svc.hndStart <= ch.handle <= svc.hndEnd ]
+        svc.descs = [ d for d in descs[bisect.bisect_right(descHandles, svc.hndStart) :
+                                       bisect.bisect_right(descHandles, svc.hndEnd)]
+                      if d.uuid != 0x2803 ]
+    for ch in chars:
+        ch.descs = []
+        for d in descs[bisect.bisect_right(descHandles, ch.valHandle):]:
+            if d.uuid in (0x2800, 0x2801, 0x2803):
+                break
+            ch.descs.append(d)
+    return serviceMap
+
+
 class ScanEntry:
     addrTypes = { 1 : ADDR_TYPE_PUBLIC,
                   2 : ADDR_TYPE_RANDOM
@@ -719,6 +1501,8 @@ class ScanEntry:
         self.addrType = None
         self.rssi = None
         self.connectable = False
+        self.identity = None
+        self.identityType = None
         self.rawData = None
         self.scanData = {}
         self.updateCount = 0
@@ -730,6 +1514,11 @@ class ScanEntry:
         self.addrType = addrType
         self.rssi = -resp['rssi'][0]
         self.connectable = ((resp['flag'][0] & 0x4) == 0)
+        if resp.get('id', [b''])[0]:
+            # Resolved with one of Scanner.setIdentityKeys()
+            ident = binascii.b2a_hex(resp['id'][0]).decode('utf-8')
+            self.identity = ':'.join([ident[i:i+2] for i in range(0,12,2)])
+            self.identityType = self.addrTypes.get(resp['idtype'][0], None)
         data = resp.get('d', [''])[0]
         self.rawData = data
 
@@ -813,15 +1602,23 @@ class Scanner(BluepyHelper):
         self.scanned = {}
         self.iface=iface
         self.passive=False
+        self._dedup=None
+        self._filter=None
+        self._whitelist=None
+        self._irks=None
+        self._scanParams=None
 
     def _cmd(self):
-        return "pasv" if self.passive else "scan"
+        return "pasv" if (self.passive or self._scanParams) else "scan"
 
-    def start(self, passive=False):
-        self.passive = passive
+    def start(self, passive=False, interval=None, window=None, ownAddrType=None,
+              filterDuplicates=None, burst=None, idle=None):
+        setup = self._setupCmds(passive, interval, window, ownAddrType,
+                                filterDuplicates, burst, idle)
         self._startHelper(iface=self.iface)
-        self._mgmtCmd("le on")
-        self._writeCmd(self._cmd()+"\n")
+        for args in setup:
+            self._mgmtCmd(*args)
+        self._sendCmd(self._cmd())
         rsp = self._waitResp("mgmt")
         if rsp["code"][0] == "success":
             return
@@ -832,12 +1629,154 @@ class Scanner(BluepyHelper):
             assert rsp["state"][0] == "disc"
             self._mgmtCmd(self._cmd())
 
+    def _setupCmds(self, passive=False, interval=None, window=None, ownAddrType=None,
+                   filterDuplicates=None, burst=None, idle=None):
+        # Helper commands which configure a scan, before the scan command.
+        # Any of the scan parameters makes the helper scan through its HCI
+        # socket (as for a passive scan) rather than through the kernel.
+        # interval and window are in ms, burst and idle in seconds.
+        self.passive = passive
+        params = []
+        if interval is not None:
+            params += ["int", "%x" % int(round(interval / 0.625))]
+        if window is not None:
+            params += ["win", "%x" % int(round(window / 0.625))]
+        if ownAddrType is not None:
+            params += ["own", ownAddrType]
+        if filterDuplicates is not None:
+            params += ["dup", "on" if filterDuplicates else "off"]
+        if burst is not None and idle is not None:
+            params += ["burst", "%x" % int(burst * 1000), "idle", "%x" % int(idle * 1000)]
+        if params:
+            params = ["type", "passive" if passive else "active"] + params
+        # Defaults need no command (which a shared daemon scan could refuse),
+        # unless they replace parameters this scanner set before
+        prev = self._scanParams
+        self._scanParams = params
+        cmds = [("le", "on")]
+        if params or prev:
+            cmds.append(("scanparams",) + tuple(params))
+        if self._dedup is not None:
+            cmds.append(self._dedupCmd())
+        if self._filter is not None:
+            cmds.append(("scanfilter",) + tuple(self._filter))
+        if self._whitelist is not None:
+            cmds.append(("whitelist",) + tuple(self._whitelist))
+        if self._irks is not None:
+            cmds.append(("irks",) + tuple(self._irks))
+        return cmds
+
     def stop(self):
         self._mgmtCmd(self._cmd()+"end")
         self._stopHelper()
 
+    def setWhiteList(self, devices=None):
+        # Only report these devices: each is an address (taken as public),
+        # an (address, addrType) tuple or a ScanEntry. Passive scans put the
+        # list in the controller when it fits. None clears the list.
+        args = []
+        for dev in (devices or []):
+            if isinstance(dev, ScanEntry):
+                (addr, addrType) = (dev.addr, dev.addrType)
+            elif isinstance(dev, tuple):
+                (addr, addrType) = dev
+            else:
+                (addr, addrType) = (dev, ADDR_TYPE_PUBLIC)
+            if len(addr.split(":")) != 6:
+                raise ValueError("Expected MAC address, got %s" % repr(addr))
+            if addrType not in (ADDR_TYPE_PUBLIC, ADDR_TYPE_RANDOM):
+                raise ValueError("Expected address type public or random, got {}".format(addrType))
+            args += [addr, addrType]
+        self._whitelist = args if args else None
+        if self._helper is not None:
+            self._mgmtCmd("whitelist", *args)
+
+    def setIdentityKeys(self, keys=None):
+        # Resolve private addresses while scanning: keys is a list of
+        # (irk, identityAddr, addrType) tuples, where irk is the 16-byte
+        # Identity Resolving Key (bytes, or hex as in BlueZ's info files,
+        # least significant byte first). Devices using an address made
+        # with one of them get its identityAddr and addrType as their
+        # ScanEntry's identity and identityType. None removes the keys.
+        args = []
+        for (irk, addr, addrType) in (keys or []):
+            if not isinstance(irk, (bytes, bytearray)):
+                irk = binascii.a2b_hex(irk)
+            if len(irk) != 16:
+                raise ValueError("Expected 16-byte IRK, got %s" % repr(irk))
+            if len(addr.split(":")) != 6:
+                raise ValueError("Expected MAC address, got %s" % repr(addr))
+            if addrType not in (ADDR_TYPE_PUBLIC, ADDR_TYPE_RANDOM):
+                raise ValueError("Expected address type public or random, got {}".format(addrType))
+            args += [bytes(irk), addr, addrType]
+        self._irks = args if args else None
+        if self._helper is not None:
+            self._mgmtCmd("irks", *args)
+
+    def setScanFilter(self, minRSSI=None, addresses=None, uuids=None,
+                      manufacturers=None, adData=None):
+        # Have the helper report only matching advertisements. A report must
+        # be at least minRSSI (dBm), match one of the addresses (if given;
+        # '*' or missing trailing parts match any byte), and contain one of
+        # the 16-bit service uuids, manufacturers (company id, or a tuple of
+        # company id and data prefix) or adData (AD type, data prefix) pairs,
+        # if any of those are given. With no arguments the filter is removed.
+        args = []
+        if minRSSI is not None:
+            args += ["rssi", bytes([max(0, min(255, -int(minRSSI)))])]
+        for addr in (addresses or []):
+            args += ["addr", Scanner.addrFilterRule(addr)]
+        for uuid in (uuids or []):
+            uuid = UUID(uuid)
+            if uuid.binVal[0:2] != b'\0\0' or uuid.binVal[4:] != UUID(0).binVal[4:]:
+                raise ValueError("Scan filter needs a 16-bit UUID, got %s" % str(uuid))
+            args += ["uuid", uuid.binVal[3:1:-1]]
+        for mfr in (manufacturers or []):
+            (company, prefix) = mfr if isinstance(mfr, tuple) else (mfr, b'')
+            args += ["ad", struct.pack('<BH', 0xFF, company) + bytes(prefix)]
+        for (adtype, prefix) in (adData or []):
+            args += ["ad", bytes([adtype]) + bytes(prefix)]
+        self._filter = args if args else None
+        if self._helper is not None:
+            self._mgmtCmd("scanfilter", *args)
+
+    @staticmethod
+    def addrFilterRule(addr):
+        """Address and mask for an address pattern such as 'aa:bb:cc:*:*:*'"""
+        parts = addr.split(":")
+        if len(parts) > 6:
+            raise ValueError("Expected MAC address pattern, got %s" % repr(addr))
+        parts += ["*"] * (6 - len(parts))
+        val = bytes([0 if p == "*" else int(p, 16) for p in parts])
+        mask = bytes([0 if p == "*" else 0xFF for p in parts])
+        return val + mask
+
+    def setDuplicateFilter(self, enable=True, rssiDelta=0, interval=0):
+        # Have the helper drop repeated advertisements; a device is reported
+        # again only if its data changes, its RSSI moves by rssiDelta or more,
+        # or interval seconds pass (zero disables either of the last two)
+        self._dedup = (int(rssiDelta), int(interval * 1000)) if enable else None
+        if self._helper is not None:
+            self._sendDedup()
+
+    def _sendDedup(self):
+        self._mgmtCmd(*self._dedupCmd())
+
+    def _dedupCmd(self):
+        if self._dedup is None:
+            return ("dedup", "off")
+        return ("dedup", "on", "%x" % self._dedup[0], "%x" % self._dedup[1])
+
     def clear(self):
         self.scanned = {}
+        if self._helper is not None and self._dedup is not None:
+            # Let the helper report every device again; a daemon refuses
+            # (busy) while other clients share the scan, as they would
+            # all see the devices again
+            self._sendCmd(*self._dedupCmd())
+            rsp = self._waitResp('mgmt')
+            if rsp['code'][0] not in ('success', 'busy'):
+                raise BTLEManagementError("Failed to reset duplicate filter", rsp)
 
     def process(self, timeout=10.0):
         if self._helper is None:
@@ -862,27 +1801,42 @@ class Scanner(BluepyHelper):
                     self._mgmtCmd(self._cmd())
 
             elif respType == 'scan':
-                # device found
-                addr = binascii.b2a_hex(resp['addr'][0]).decode('utf-8')
-                addr = ':'.join([addr[i:i+2] for i in range(0,12,2)])
-                if addr in self.scanned:
-                    dev = self.scanned[addr]
-                else:
-                    dev = ScanEntry(addr, self.iface)
-                    self.scanned[addr] = dev
-                isNewData = dev._update(resp)
-                if self.delegate is not None:
-                    self.delegate.handleDiscovery(dev, (dev.updateCount <= 1), isNewData)
+                # device(s) found
+                for report in Scanner.splitScanResp(resp):
+                    (dev, isNewDev, isNewData) = self._addReport(report)
+                    if self.delegate is not None:
+                        self.delegate.handleDiscovery(dev, isNewDev, isNewData)
 
             else:
                 raise BTLEInternalError("Unexpected response: " + respType, resp)
 
+    def _addReport(self, report):
+        addr = binascii.b2a_hex(report['addr'][0]).decode('utf-8')
+        addr = ':'.join([addr[i:i+2] for i in range(0,12,2)])
+        if addr in self.scanned:
+            dev = self.scanned[addr]
+        else:
+            dev = ScanEntry(addr, self.iface)
+            self.scanned[addr] = dev
+        isNewData = dev._update(report)
+        return (dev, (dev.updateCount <= 1), isNewData)
+
+    @staticmethod
+    def splitScanResp(resp):
+        """A passive scan batches several reports into one response, each
+           with a full set of fields; split it into one response per report"""
+        n = len(resp['addr'])
+        if n == 1:
+            return [resp]
+        return [ dict((tag, [vals[i]]) for (tag, vals) in resp.items() if len(vals) == n)
+                 for i in range(n) ]
+
     def getDevices(self):
         return self.scanned.values()
 
-    def scan(self, timeout=10, passive=False):
+    def scan(self, timeout=10, passive=False, **params):
         self.clear()
-        self.start(passive=passive)
+        self.start(passive=passive, **params)
         self.process(timeout)
         self.stop()
         return self.getDevices()
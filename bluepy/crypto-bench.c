@@ -0,0 +1,240 @@
+/*
+ * crypto-bench: bt_crypto's in-process AES against the kernel's AF_ALG
+ *
+ * Times bt_crypto_e and bt_crypto_ah (one AES block each, as for every
+ * resolvable private address checked against an IRK), bt_crypto_sign_att
+ * (AES-CMAC over a signed write) and bt_crypto_ah_resolve (an address
+ * against BENCH_IRKS IRKs at once) with each backend.
+ * The in-process results are first checked against the FIPS-197, RFC 4493
+ * and Bluetooth sample data, and against AF_ALG where the kernel has it.
+ *
+ *   make crypto-bench && ./crypto-bench [iterations]
+ */
+#include "src/shared/crypto.c"
+
+#include <stdio.h>
+#include <time.h>
+
+static const uint8_t fips_key[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+static const uint8_t fips_pt[16] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+    0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+};
+static const uint8_t fips_ct[16] = {
+    0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+    0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+};
+
+static const uint8_t cmac_key[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+    0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+static const uint8_t cmac_msg[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+    0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+    0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+    0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+    0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+static const struct {
+    size_t len;
+    uint8_t mac[16];
+} cmac_vectors[] = {
+    { 0, { 0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28,
+           0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46 } },
+    { 16, { 0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44,
+            0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c } },
+    { 40, { 0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30,
+            0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27 } },
+    { 64, { 0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92,
+            0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe } },
+};
+
+/* Core spec Vol 3 Part H D.7, least significant octet first */
+static const uint8_t ah_irk[16] = {
+    0x9b, 0x7d, 0x39, 0x0a, 0xa6, 0x10, 0x10, 0x34,
+    0x05, 0xad, 0xc8, 0x57, 0xa3, 0x34, 0x02, 0xec,
+};
+static const uint8_t ah_prand[3] = { 0x94, 0x81, 0x70 };
+static const uint8_t ah_hash[3] = { 0xaa, 0xfb, 0x0d };
+
+static int check_known(struct bt_crypto *crypto, const char *name)
+{
+    uint8_t rk[AES_ROUND_KEYS], out[16];
+    unsigned int i;
+    int bad = 0;
+
+    aes_expand_key(fips_key, rk);
+    aes_encrypt(rk, fips_pt, out);
+    if (memcmp(out, fips_ct, 16) != 0) {
+        printf("%s: AES-128 sample mismatch\n", name);
+        bad++;
+    }
+
+    for (i = 0; i < sizeof(cmac_vectors) / sizeof(cmac_vectors[0]); i++) {
+        aes_cmac_soft(cmac_key, cmac_msg, cmac_vectors[i].len, out);
+        if (memcmp(out, cmac_vectors[i].mac, 16) != 0) {
+            printf("%s: AES-CMAC sample mismatch, %zu octets\n", name,
+                        cmac_vectors[i].len);
+            bad++;
+        }
+    }
+
+    if (!bt_crypto_ah(crypto, ah_irk, ah_prand, out) ||
+                                    memcmp(out, ah_hash, 3) != 0) {
+        printf("%s: ah sample mismatch\n", name);
+        bad++;
+    }
+
+    return bad;
+}
+
+/* Both backends must agree on e and on signatures of every length */
+static int check_same(struct bt_crypto *a, struct bt_crypto *b)
+{
+    uint8_t key[16], m[64], x[16], y[16];
+    int i, bad = 0;
+
+    for (i = 0; i < (int) sizeof(m); i++) {
+        bt_crypto_random_bytes(a, key, sizeof(key));
+        bt_crypto_random_bytes(a, m, sizeof(m));
+
+        if (!bt_crypto_e(a, key, m, x) || !bt_crypto_e(b, key, m, y) ||
+                                                memcmp(x, y, 16) != 0)
+            bad++;
+
+        if (!bt_crypto_sign_att(a, key, m, i, i, x) ||
+                    !bt_crypto_sign_att(b, key, m, i, i, y) ||
+                    memcmp(x, y, 12) != 0)
+            bad++;
+    }
+
+    if (bad)
+        printf("in-process and AF_ALG results differ (%d)\n", bad);
+
+    return bad;
+}
+
+#define BENCH_IRKS  5000
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *backend, const char *op, long n, double t)
+{
+    printf("%-10s %-12s %10.0f ns/op %12.0f op/s\n", backend, op,
+                t / n * 1e9, n / t);
+}
+
+static void bench(struct bt_crypto *crypto, const char *name, long n)
+{
+    uint8_t key[16], m[20], out[16];
+    double t;
+    long i;
+
+    bt_crypto_random_bytes(crypto, key, sizeof(key));
+    bt_crypto_random_bytes(crypto, m, sizeof(m));
+
+    t = now();
+    for (i = 0; i < n; i++)
+        bt_crypto_e(crypto, key, m, out);
+    report(name, "e", n, now() - t);
+
+    t = now();
+    for (i = 0; i < n; i++)
+        bt_crypto_ah(crypto, key, m, out);
+    report(name, "ah", n, now() - t);
+
+    /* A signed Write Command with a 16 octet value */
+    t = now();
+    for (i = 0; i < n; i++)
+        bt_crypto_sign_att(crypto, key, m, sizeof(m) - 4, i, out);
+    report(name, "sign_att", n, now() - t);
+}
+
+/* Resolving an address which matches the last of BENCH_IRKS keys */
+static int bench_resolve(struct bt_crypto *crypto, const char *name, long n)
+{
+    uint8_t (*k)[16] = malloc(BENCH_IRKS * 16);
+    struct bt_crypto_ah_keys *keys;
+    uint8_t r[3], hash[3];
+    double t;
+    long i;
+    int bad = 0;
+
+    for (i = 0; i < BENCH_IRKS; i++)
+        bt_crypto_random_bytes(crypto, k[i], 16);
+    bt_crypto_random_bytes(crypto, r, sizeof(r));
+    r[2] = (r[2] & 0x3f) | 0x40;
+    bt_crypto_ah(crypto, k[BENCH_IRKS - 1], r, hash);
+
+    keys = bt_crypto_ah_keys_new(crypto, (const uint8_t (*)[16]) k, BENCH_IRKS);
+    if (bt_crypto_ah_resolve(crypto, keys, r, hash) != BENCH_IRKS - 1) {
+        printf("%s: address not resolved\n", name);
+        bad++;
+    }
+
+    t = now();
+    for (i = 0; i < n; i++)
+        bt_crypto_ah_resolve(crypto, keys, r, hash);
+    report(name, "resolve", n, now() - t);
+
+    bt_crypto_ah_keys_free(keys);
+    free(k);
+
+    return bad;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bt_crypto *local, *alg;
+    long n = argc > 1 ? atol(argv[1]) : 100000;
+    int bad;
+
+    local = crypto_new(false);
+    if (!local) {
+        printf("Can't open /dev/urandom\n");
+        return 1;
+    }
+
+    bad = check_known(local, aes_encrypt == aes_encrypt_soft ?
+                                    "portable" : "aes-ni");
+    if (aes_encrypt != aes_encrypt_soft) {
+        aes_expand_key = aes_expand_key_soft;
+        aes_encrypt = aes_encrypt_soft;
+        aes_match = aes_match_soft;
+        bad += check_known(local, "portable");
+        bench(local, "portable", n);
+        bad += bench_resolve(local, "portable", n / 1000 + 1);
+        aes_select();
+        bench(local, "aes-ni", n);
+        bad += bench_resolve(local, "aes-ni", n / 100 + 1);
+    } else {
+        bench(local, "portable", n);
+        bad += bench_resolve(local, "portable", n / 1000 + 1);
+    }
+
+    alg = crypto_new(true);
+    if (alg) {
+        bad += check_same(local, alg);
+        bench(alg, "af_alg", n / 10 ? n / 10 : 1);
+        bad += bench_resolve(alg, "af_alg", n / 10000 + 1);
+        bt_crypto_unref(alg);
+    } else
+        printf("AF_ALG not available\n");
+
+    bt_crypto_unref(local);
+
+    return bad ? 1 : 0;
+}
@@ -819,6 +819,64 @@ ssize_t dec_read_resp(const uint8_t *pdu, size_t len, uint8_t *value,
 	return len - 1;
 }
 
+uint16_t enc_read_multi_req(uint8_t opcode, const uint16_t *handles,
+				size_t num, uint8_t *pdu, size_t len)
+{
+	size_t i;
+
+	if (pdu == NULL || handles == NULL)
+		return 0;
+
+	if (opcode != ATT_OP_READ_MULTI_REQ &&
+					opcode != ATT_OP_READ_MULTI_VL_REQ)
+		return 0;
+
+	/* At least two handles are required by the specification */
+	if (num < 2 || len < 1 + num * 2)
+		return 0;
+
+	/* Attribute Opcode (1 octet) */
+	pdu[0] = opcode;
+	/* Set Of Handles (4 to (ATT_MTU-1) octets) */
+	for (i = 0; i < num; i++)
+		put_le16(handles[i], &pdu[1 + i * 2]);
+
+	return 1 + num * 2;
+}
+
+/*
+ * Splits a Read Multiple Variable Length response into the values it
+ * carries. The entries point into the PDU. Returns the number of values
+ * which were received complete; a value cut short by the ATT_MTU is not
+ * counted, so the caller can read it (and those after it) separately.
+ */
+int dec_read_multi_vl_resp(const uint8_t *pdu, size_t len,
+				const uint8_t **values, uint16_t *vlens, int num)
+{
+	size_t off;
+	int n;
+
+	if (pdu == NULL || len < 1)
+		return -EINVAL;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_VL_RESP)
+		return -EINVAL;
+
+	/* Length Value Tuple List (4 to (ATT_MTU-1) octets) */
+	for (off = 1, n = 0; n < num && off + 2 <= len; n++) {
+		uint16_t vlen = get_le16(&pdu[off]);
+
+		if (off + 2 + vlen > len)
+			break;
+
+		values[n] = &pdu[off + 2];
+		vlens[n] = vlen;
+		off += 2 + vlen;
+	}
+
+	return n;
+}
+
 uint16_t enc_error_resp(uint8_t opcode, uint16_t handle, uint8_t status,
 						uint8_t *pdu, size_t len)
 {
@@ -1174,7 +1232,7 @@ uint16_t dec_prep_write_resp(const uint8_t *pdu, size_t len, uint16_t *handle,
 	if (len < min_len)
 		return 0;
 
-	if (pdu[0] != ATT_OP_PREP_WRITE_REQ)
+	if (pdu[0] != ATT_OP_PREP_WRITE_RESP)
 		return 0;
 
 	*handle = get_le16(&pdu[1]);
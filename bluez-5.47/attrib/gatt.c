@@ -875,6 +875,24 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 	return id;
 }
 
+guint gatt_read_multi(GAttrib *attrib, const uint16_t *handles, size_t num,
+				gboolean variable, GAttribResultFunc func,
+				gpointer user_data)
+{
+	uint8_t *buf;
+	size_t buflen;
+	guint16 plen;
+
+	buf = g_attrib_get_buffer(attrib, &buflen);
+	plen = enc_read_multi_req(variable ? ATT_OP_READ_MULTI_VL_REQ :
+						ATT_OP_READ_MULTI_REQ,
+						handles, num, buf, buflen);
+	if (plen == 0)
+		return 0;
+
+	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
+}
+
 struct write_long_data {
 	GAttrib *attrib;
 	GAttribResultFunc func;
@@ -989,9 +1007,9 @@ guint gatt_execute_write(GAttrib *attrib, uint8_t flags,
 	return execute_write(attrib, flags, func, user_data);
 }
 
-guint gatt_reliable_write_char(GAttrib *attrib, uint16_t handle,
-					const uint8_t *value, size_t vlen,
-					GAttribResultFunc func,
+guint gatt_prepare_write_char(GAttrib *attrib, uint16_t handle,
+					uint16_t offset, const uint8_t *value,
+					size_t vlen, GAttribResultFunc func,
 					gpointer user_data)
 {
 	uint8_t *buf;
@@ -1000,13 +1018,22 @@ guint gatt_reliable_write_char(GAttrib *attrib, uint16_t handle,
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 
-	plen = enc_prep_write_req(handle, 0, value, vlen, buf, buflen);
+	plen = enc_prep_write_req(handle, offset, value, vlen, buf, buflen);
 	if (!plen)
 		return 0;
 
 	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
 }
 
+guint gatt_reliable_write_char(GAttrib *attrib, uint16_t handle,
+					const uint8_t *value, size_t vlen,
+					GAttribResultFunc func,
+					gpointer user_data)
+{
+	return gatt_prepare_write_char(attrib, handle, 0, value, vlen, func,
+								user_data);
+}
+
 guint gatt_exchange_mtu(GAttrib *attrib, uint16_t mtu, GAttribResultFunc func,
 							gpointer user_data)
 {
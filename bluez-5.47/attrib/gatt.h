@@ -84,6 +84,10 @@ guint gatt_discover_char(GAttrib *attrib, uint16_t start, uint16_t end,
 guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 							gpointer user_data);
 
+guint gatt_read_multi(GAttrib *attrib, const uint16_t *handles, size_t num,
+				gboolean variable, GAttribResultFunc func,
+				gpointer user_data);
+
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 					size_t vlen, GAttribResultFunc func,
 					gpointer user_data);
@@ -92,6 +96,11 @@ guint gatt_discover_desc(GAttrib *attrib, uint16_t start, uint16_t end,
 						bt_uuid_t *uuid, gatt_cb_t func,
 						gpointer user_data);
 
+guint gatt_prepare_write_char(GAttrib *attrib, uint16_t handle,
+					uint16_t offset, const uint8_t *value,
+					size_t vlen, GAttribResultFunc func,
+					gpointer user_data);
+
 guint gatt_reliable_write_char(GAttrib *attrib, uint16_t handle,
 					const uint8_t *value, size_t vlen,
 					GAttribResultFunc func,
@@ -331,6 +331,14 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 
 	pend_id = bt_att_send(attrib->att, pdu[0], (void *) pdu + 1, len - 1,
 						response_cb, cb, destroy_cb);
+	if (pend_id == 0) {
+		/* Nothing was queued, so the callbacks must never run */
+		if (cb) {
+			queue_remove(attrib->callbacks, cb);
+			free(cb);
+		}
+		return 0;
+	}
 
 	/*
 	 * We store here pair as it is easier to handle it in response and in
@@ -43,6 +43,10 @@
 
 #include "btio.h"
 
+#ifdef BLUEPY_MAINLOOP
+#include "src/shared/mainloop.h"
+#endif
+
 #ifndef BT_FLUSHABLE
 #define BT_FLUSHABLE	8
 #endif
@@ -268,6 +272,90 @@ static gboolean server_cb(GIOChannel *io, GIOCondition cond,
 	return TRUE;
 }
 
+#ifdef BLUEPY_MAINLOOP
+/* Without GLib's main loop sockets are watched through mainloop.c. A watch
+ * is taken off the loop while its callback runs, as a connect callback
+ * hands the socket on to an io of its own, and is put back if still
+ * wanted. */
+struct io_watch {
+	GIOChannel *io;
+	uint32_t events;
+	GIOFunc func;
+	gpointer user_data;
+	GDestroyNotify destroy;
+	gboolean running;
+};
+
+static void watch_free(void *user_data)
+{
+	struct io_watch *watch = user_data;
+
+	if (watch->running)
+		return;
+
+	if (watch->destroy)
+		watch->destroy(watch->user_data);
+	g_io_channel_unref(watch->io);
+	g_free(watch);
+}
+
+static void watch_event(int fd, uint32_t events, void *user_data)
+{
+	struct io_watch *watch = user_data;
+	GIOCondition cond = 0;
+	gboolean keep;
+
+	if (events & EPOLLIN)
+		cond |= G_IO_IN;
+	if (events & EPOLLOUT)
+		cond |= G_IO_OUT;
+	if (events & EPOLLERR)
+		cond |= G_IO_ERR;
+	if (events & EPOLLHUP)
+		cond |= G_IO_HUP;
+
+	watch->running = TRUE;
+	mainloop_remove_fd(fd);
+	keep = watch->func(watch->io, cond, watch->user_data);
+	watch->running = FALSE;
+
+	if (keep && mainloop_add_fd(fd, watch->events, watch_event, watch,
+							watch_free) == 0)
+		return;
+
+	watch_free(watch);
+}
+
+static void io_add_watch(GIOChannel *io, GIOCondition cond, GIOFunc func,
+				gpointer user_data, GDestroyNotify destroy)
+{
+	struct io_watch *watch;
+	int fd = g_io_channel_unix_get_fd(io);
+
+	watch = g_new0(struct io_watch, 1);
+	watch->io = g_io_channel_ref(io);
+	watch->func = func;
+	watch->user_data = user_data;
+	watch->destroy = destroy;
+
+	if (cond & G_IO_IN)
+		watch->events |= EPOLLIN;
+	if (cond & G_IO_OUT)
+		watch->events |= EPOLLOUT;
+
+	if (mainloop_add_fd(fd, watch->events, watch_event, watch,
+							watch_free) < 0)
+		watch_free(watch);
+}
+#else
+static void io_add_watch(GIOChannel *io, GIOCondition cond, GIOFunc func,
+				gpointer user_data, GDestroyNotify destroy)
+{
+	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, func, user_data,
+								destroy);
+}
+#endif
+
 static void server_add(GIOChannel *io, BtIOConnect connect,
 				BtIOConfirm confirm, gpointer user_data,
 				GDestroyNotify destroy)
@@ -282,7 +370,7 @@ static void server_add(GIOChannel *io, BtIOConnect connect,
 	server->destroy = destroy;
 
 	cond = G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, server_cb, server,
+	io_add_watch(io, cond, server_cb, server,
 					(GDestroyNotify) server_remove);
 }
 
@@ -298,7 +386,7 @@ static void connect_add(GIOChannel *io, BtIOConnect connect,
 	conn->destroy = destroy;
 
 	cond = G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, connect_cb, conn,
+	io_add_watch(io, cond, connect_cb, conn,
 					(GDestroyNotify) connect_remove);
 }
 
@@ -314,7 +402,7 @@ static void accept_add(GIOChannel *io, BtIOConnect connect, gpointer user_data,
 	accept->destroy = destroy;
 
 	cond = G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, accept_cb, accept,
+	io_add_watch(io, cond, accept_cb, accept,
 					(GDestroyNotify) accept_remove);
 }
 
@@ -33,6 +33,12 @@
 #include "src/shared/util.h"
 #include "src/shared/crypto.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define HAVE_AESNI 1
+#endif
+
 #ifndef HAVE_LINUX_IF_ALG_H
 #ifndef HAVE_LINUX_TYPES_H
 typedef uint8_t __u8;
@@ -75,6 +81,14 @@ struct af_alg_iv {
 /* Maximum message length that can be passed to aes_cmac */
 #define CMAC_MSG_MAX	80
 
+/*
+ * AES-128 and AES-CMAC are done in-process unless built with
+ * BT_CRYPTO_AF_ALG, which sends every block through the kernel's AF_ALG
+ * sockets instead, at the cost of a few system calls each. In-process,
+ * blocks are encrypted with AES-NI when the CPU has it and with a
+ * portable implementation otherwise. ecb_aes and cmac_aes are -1 when
+ * AF_ALG isn't used.
+ */
 struct bt_crypto {
 	int ref_count;
 	int ecb_aes;
@@ -82,6 +96,310 @@ struct bt_crypto {
 	int cmac_aes;
 };
 
+#define AES_ROUND_KEYS	176
+
+static const uint8_t aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static const uint8_t aes_rcon[10] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36,
+};
+
+/* Expands key, most significant octet first, into the 11 round keys */
+static void aes_expand_key_soft(const uint8_t key[16],
+					uint8_t rk[AES_ROUND_KEYS])
+{
+	uint8_t t[4], u;
+	int i, j;
+
+	memcpy(rk, key, 16);
+
+	for (i = 16; i < AES_ROUND_KEYS; i += 4) {
+		memcpy(t, rk + i - 4, 4);
+
+		if (i % 16 == 0) {
+			/* RotWord, SubWord and the round constant */
+			u = t[0];
+			t[0] = aes_sbox[t[1]] ^ aes_rcon[i / 16 - 1];
+			t[1] = aes_sbox[t[2]];
+			t[2] = aes_sbox[t[3]];
+			t[3] = aes_sbox[u];
+		}
+
+		for (j = 0; j < 4; j++)
+			rk[i + j] = rk[i + j - 16] ^ t[j];
+	}
+}
+
+static inline uint8_t aes_xtime(uint8_t x)
+{
+	return (x << 1) ^ ((x >> 7) * 0x1b);
+}
+
+static void aes_encrypt_soft(const uint8_t rk[AES_ROUND_KEYS],
+					const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t s[16], t[16], a0, a1, a2, a3, all;
+	int r, c, i;
+
+	for (i = 0; i < 16; i++)
+		s[i] = in[i] ^ rk[i];
+
+	for (r = 1; r <= 10; r++) {
+		/* SubBytes and ShiftRows; the state is column by column */
+		for (c = 0; c < 4; c++)
+			for (i = 0; i < 4; i++)
+				t[4 * c + i] = aes_sbox[s[4 * ((c + i) % 4) + i]];
+
+		if (r == 10) {
+			memcpy(s, t, 16);
+		} else {
+			/* MixColumns */
+			for (c = 0; c < 16; c += 4) {
+				a0 = t[c];
+				a1 = t[c + 1];
+				a2 = t[c + 2];
+				a3 = t[c + 3];
+				all = a0 ^ a1 ^ a2 ^ a3;
+
+				s[c] = a0 ^ all ^ aes_xtime(a0 ^ a1);
+				s[c + 1] = a1 ^ all ^ aes_xtime(a1 ^ a2);
+				s[c + 2] = a2 ^ all ^ aes_xtime(a2 ^ a3);
+				s[c + 3] = a3 ^ all ^ aes_xtime(a3 ^ a0);
+			}
+		}
+
+		for (i = 0; i < 16; i++)
+			s[i] ^= rk[16 * r + i];
+	}
+
+	memcpy(out, s, 16);
+}
+
+#ifdef HAVE_AESNI
+__attribute__((target("aes,sse2")))
+static inline __m128i aes_ni_expand(__m128i k, __m128i t)
+{
+	t = _mm_shuffle_epi32(t, 0xff);
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+
+	return _mm_xor_si128(k, t);
+}
+
+/* The round constant has to be an immediate operand */
+#define AES_NI_ROUND_KEY(k, i, rcon) \
+	k[i] = aes_ni_expand(k[i - 1], _mm_aeskeygenassist_si128(k[i - 1], rcon))
+
+__attribute__((target("aes,sse2")))
+static void aes_expand_key_ni(const uint8_t key[16],
+					uint8_t rk[AES_ROUND_KEYS])
+{
+	__m128i k[11];
+	int i;
+
+	k[0] = _mm_loadu_si128((const __m128i *) key);
+	AES_NI_ROUND_KEY(k, 1, 0x01);
+	AES_NI_ROUND_KEY(k, 2, 0x02);
+	AES_NI_ROUND_KEY(k, 3, 0x04);
+	AES_NI_ROUND_KEY(k, 4, 0x08);
+	AES_NI_ROUND_KEY(k, 5, 0x10);
+	AES_NI_ROUND_KEY(k, 6, 0x20);
+	AES_NI_ROUND_KEY(k, 7, 0x40);
+	AES_NI_ROUND_KEY(k, 8, 0x80);
+	AES_NI_ROUND_KEY(k, 9, 0x1b);
+	AES_NI_ROUND_KEY(k, 10, 0x36);
+
+	for (i = 0; i < 11; i++)
+		_mm_storeu_si128((__m128i *) (rk + 16 * i), k[i]);
+}
+
+__attribute__((target("aes,sse2")))
+static void aes_encrypt_ni(const uint8_t rk[AES_ROUND_KEYS],
+					const uint8_t in[16], uint8_t out[16])
+{
+	const __m128i *k = (const __m128i *) rk;
+	__m128i s;
+	int r;
+
+	s = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in),
+						_mm_loadu_si128(k));
+
+	for (r = 1; r < 10; r++)
+		s = _mm_aesenc_si128(s, _mm_loadu_si128(k + r));
+
+	s = _mm_aesenclast_si128(s, _mm_loadu_si128(k + 10));
+	_mm_storeu_si128((__m128i *) out, s);
+}
+#endif
+
+/*
+ * Index of the first of count keys under which in encrypts to a block
+ * whose last three octets are tail, or -1; what resolving an address
+ * against many IRKs takes
+ */
+static int aes_match_soft(const uint8_t (*rk)[AES_ROUND_KEYS], size_t count,
+				const uint8_t in[16], const uint8_t tail[3])
+{
+	uint8_t out[16];
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		aes_encrypt_soft(rk[i], in, out);
+		if (memcmp(out + 13, tail, 3) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+#ifdef HAVE_AESNI
+#define AES_NI_LANES	8
+
+/* Blocks for AES_NI_LANES keys go through each round together, so the
+ * latency of one AESENC is hidden behind the others */
+__attribute__((target("aes,sse2")))
+static int aes_match_ni(const uint8_t (*rk)[AES_ROUND_KEYS], size_t count,
+				const uint8_t in[16], const uint8_t tail[3])
+{
+	__m128i p = _mm_loadu_si128((const __m128i *) in);
+	__m128i s[AES_NI_LANES];
+	uint8_t out[16];
+	size_t i, n;
+	int j, r;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i < AES_NI_LANES ? count - i : AES_NI_LANES;
+
+		for (j = 0; j < (int) n; j++)
+			s[j] = _mm_xor_si128(p,
+				_mm_loadu_si128((const __m128i *) rk[i + j]));
+
+		for (r = 1; r < 10; r++)
+			for (j = 0; j < (int) n; j++)
+				s[j] = _mm_aesenc_si128(s[j], _mm_loadu_si128(
+					(const __m128i *) (rk[i + j] + 16 * r)));
+
+		for (j = 0; j < (int) n; j++) {
+			s[j] = _mm_aesenclast_si128(s[j], _mm_loadu_si128(
+					(const __m128i *) (rk[i + j] + 160)));
+			_mm_storeu_si128((__m128i *) out, s[j]);
+			if (memcmp(out + 13, tail, 3) == 0)
+				return i + j;
+		}
+	}
+
+	return -1;
+}
+#endif
+
+static void (*aes_expand_key)(const uint8_t key[16],
+				uint8_t rk[AES_ROUND_KEYS]);
+static void (*aes_encrypt)(const uint8_t rk[AES_ROUND_KEYS],
+				const uint8_t in[16], uint8_t out[16]);
+static int (*aes_match)(const uint8_t (*rk)[AES_ROUND_KEYS], size_t count,
+				const uint8_t in[16], const uint8_t tail[3]);
+
+static void aes_select(void)
+{
+#ifdef HAVE_AESNI
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES)) {
+		aes_expand_key = aes_expand_key_ni;
+		aes_encrypt = aes_encrypt_ni;
+		aes_match = aes_match_ni;
+		return;
+	}
+#endif
+	aes_expand_key = aes_expand_key_soft;
+	aes_encrypt = aes_encrypt_soft;
+	aes_match = aes_match_soft;
+}
+
+/* Doubling in GF(2^128), for the CMAC subkeys */
+static void cmac_double(uint8_t b[16])
+{
+	uint8_t carry = b[0] >> 7;
+	int i;
+
+	for (i = 0; i < 15; i++)
+		b[i] = (b[i] << 1) | (b[i + 1] >> 7);
+
+	b[15] = (b[15] << 1) ^ (carry ? 0x87 : 0x00);
+}
+
+/* AES-CMAC as in RFC 4493, all values most significant octet first */
+static void aes_cmac_soft(const uint8_t key[16], const uint8_t *msg,
+					size_t msg_len, uint8_t mac[16])
+{
+	uint8_t rk[AES_ROUND_KEYS], k[16], x[16], last[16];
+	size_t n, i;
+	int j;
+
+	aes_expand_key(key, rk);
+
+	/* K1 = L doubled, with L = E(K, 0); K2 = K1 doubled */
+	memset(x, 0, 16);
+	aes_encrypt(rk, x, k);
+	cmac_double(k);
+
+	n = msg_len ? (msg_len + 15) / 16 : 1;
+
+	if (msg_len && msg_len % 16 == 0) {
+		memcpy(last, msg + 16 * (n - 1), 16);
+	} else {
+		cmac_double(k);
+		i = msg_len - 16 * (n - 1);
+		memset(last, 0, 16);
+		memcpy(last, msg + 16 * (n - 1), i);
+		last[i] = 0x80;
+	}
+
+	for (i = 0; i < n - 1; i++) {
+		for (j = 0; j < 16; j++)
+			x[j] ^= msg[16 * i + j];
+		aes_encrypt(rk, x, x);
+	}
+
+	for (j = 0; j < 16; j++)
+		x[j] ^= last[j] ^ k[j];
+	aes_encrypt(rk, x, mac);
+}
+
 static int urandom_setup(void)
 {
 	int fd;
@@ -137,21 +455,28 @@ static int cmac_aes_setup(void)
 	return fd;
 }
 
-struct bt_crypto *bt_crypto_new(void)
+static struct bt_crypto *crypto_new(bool af_alg)
 {
 	struct bt_crypto *crypto;
 
 	crypto = new0(struct bt_crypto, 1);
+	crypto->ecb_aes = -1;
+	crypto->cmac_aes = -1;
 
-	crypto->ecb_aes = ecb_aes_setup();
-	if (crypto->ecb_aes < 0) {
+	crypto->urandom = urandom_setup();
+	if (crypto->urandom < 0) {
 		free(crypto);
 		return NULL;
 	}
 
-	crypto->urandom = urandom_setup();
-	if (crypto->urandom < 0) {
-		close(crypto->ecb_aes);
+	if (!af_alg) {
+		aes_select();
+		return bt_crypto_ref(crypto);
+	}
+
+	crypto->ecb_aes = ecb_aes_setup();
+	if (crypto->ecb_aes < 0) {
+		close(crypto->urandom);
 		free(crypto);
 		return NULL;
 	}
@@ -167,6 +492,15 @@ struct bt_crypto *bt_crypto_new(void)
 	return bt_crypto_ref(crypto);
 }
 
+struct bt_crypto *bt_crypto_new(void)
+{
+#ifdef BT_CRYPTO_AF_ALG
+	return crypto_new(true);
+#else
+	return crypto_new(false);
+#endif
+}
+
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto)
 {
 	if (!crypto)
@@ -186,8 +520,10 @@ void bt_crypto_unref(struct bt_crypto *crypto)
 		return;
 
 	close(crypto->urandom);
-	close(crypto->ecb_aes);
-	close(crypto->cmac_aes);
+	if (crypto->ecb_aes >= 0)
+		close(crypto->ecb_aes);
+	if (crypto->cmac_aes >= 0)
+		close(crypto->cmac_aes);
 
 	free(crypto);
 }
@@ -263,12 +599,69 @@ static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
 		dst[len - 1 - i] = src[i];
 }
 
+/* AES-128 of one block with either backend, most significant octet first */
+static bool crypto_encrypt(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t rk[AES_ROUND_KEYS];
+	bool ret;
+	int fd;
+
+	if (crypto->ecb_aes < 0) {
+		aes_expand_key(key, rk);
+		aes_encrypt(rk, in, out);
+		return true;
+	}
+
+	fd = alg_new(crypto->ecb_aes, key, 16);
+	if (fd < 0)
+		return false;
+
+	ret = alg_encrypt(fd, in, 16, out, 16);
+
+	close(fd);
+
+	return ret;
+}
+
+/* AES-CMAC with either backend, most significant octet first */
+static bool crypto_cmac(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t *msg, size_t msg_len,
+				uint8_t out[16])
+{
+	ssize_t len;
+	int fd;
+
+	if (crypto->cmac_aes < 0) {
+		aes_cmac_soft(key, msg, msg_len, out);
+		return true;
+	}
+
+	fd = alg_new(crypto->cmac_aes, key, 16);
+	if (fd < 0)
+		return false;
+
+	len = send(fd, msg, msg_len, 0);
+	if (len < 0) {
+		close(fd);
+		return false;
+	}
+
+	len = read(fd, out, 16);
+	if (len < 0) {
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	return true;
+}
+
 bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12])
 {
-	int fd;
-	int len;
 	uint8_t tmp[16], out[16];
 	uint16_t msg_len = m_len + sizeof(uint32_t);
 	uint8_t msg[msg_len];
@@ -286,26 +679,11 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->cmac_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
 	/* Swap msg before signing */
 	swap_buf(msg, msg_s, msg_len);
 
-	len = send(fd, msg_s, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
-
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
+	if (!crypto_cmac(crypto, tmp, msg_s, msg_len, out))
 		return false;
-	}
-
-	close(fd);
 
 	/*
 	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
@@ -340,7 +718,6 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t plaintext[16], uint8_t encrypted[16])
 {
 	uint8_t tmp[16], in[16], out[16];
-	int fd;
 
 	if (!crypto)
 		return false;
@@ -348,24 +725,15 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->ecb_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
-
 	/* Most significant octet of plaintextData corresponds to in[0] */
 	swap_buf(plaintext, in, 16);
 
-	if (!alg_encrypt(fd, in, 16, out, 16)) {
-		close(fd);
+	if (!crypto_encrypt(crypto, tmp, in, out))
 		return false;
-	}
 
 	/* Most significant octet of encryptedData corresponds to out[0] */
 	swap_buf(out, encrypted, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -424,6 +792,91 @@ bool bt_crypto_ah(struct bt_crypto *crypto, const uint8_t k[16],
 	return true;
 }
 
+/*
+ * Resolving a private address means trying ah with every IRK known, so
+ * bt_crypto_ah_keys holds a set of them ready for bt_crypto_ah_resolve():
+ * in-process, as expanded round keys which are run through AES together.
+ */
+struct bt_crypto_ah_keys {
+	size_t count;
+	uint8_t (*k)[16];
+	uint8_t (*rk)[AES_ROUND_KEYS];
+};
+
+struct bt_crypto_ah_keys *bt_crypto_ah_keys_new(struct bt_crypto *crypto,
+					const uint8_t (*k)[16], size_t count)
+{
+	struct bt_crypto_ah_keys *keys;
+	uint8_t tmp[16];
+	size_t i;
+
+	if (!crypto)
+		return NULL;
+
+	keys = new0(struct bt_crypto_ah_keys, 1);
+	keys->count = count;
+	keys->k = malloc0(count * 16 + 1);
+	if (!keys->k) {
+		free(keys);
+		return NULL;
+	}
+	memcpy(keys->k, k, count * 16);
+
+	if (crypto->ecb_aes >= 0)
+		return keys;
+
+	keys->rk = malloc0(count * AES_ROUND_KEYS + 1);
+	if (!keys->rk) {
+		bt_crypto_ah_keys_free(keys);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		/* The most significant octet of key corresponds to key[0] */
+		swap_buf(k[i], tmp, 16);
+		aes_expand_key(tmp, keys->rk[i]);
+	}
+
+	return keys;
+}
+
+void bt_crypto_ah_keys_free(struct bt_crypto_ah_keys *keys)
+{
+	if (!keys)
+		return;
+
+	free(keys->rk);
+	free(keys->k);
+	free(keys);
+}
+
+/* Index of the first key k with ah(k, r) == hash, or -1 */
+int bt_crypto_ah_resolve(struct bt_crypto *crypto,
+				const struct bt_crypto_ah_keys *keys,
+				const uint8_t r[3], const uint8_t hash[3])
+{
+	uint8_t in[16], tail[3], out[3];
+	size_t i;
+
+	if (!crypto || !keys)
+		return -1;
+
+	if (!keys->rk) {
+		for (i = 0; i < keys->count; i++)
+			if (bt_crypto_ah(crypto, keys->k[i], r, out) &&
+						memcmp(out, hash, 3) == 0)
+				return i;
+		return -1;
+	}
+
+	/* r' = padding || r, most significant octet first */
+	memset(in, 0, 13);
+	swap_buf(r, in + 13, 3);
+	swap_buf(hash, tail, 3);
+
+	return aes_match(keys->rk, keys->count, in, tail);
+}
+
 typedef struct {
 	uint64_t a, b;
 } u128;
@@ -572,34 +1025,18 @@ static bool aes_cmac(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t *msg, size_t msg_len, uint8_t res[16])
 {
 	uint8_t key_msb[16], out[16], msg_msb[CMAC_MSG_MAX];
-	ssize_t len;
-	int fd;
 
 	if (msg_len > CMAC_MSG_MAX)
 		return false;
 
 	swap_buf(key, key_msb, 16);
-	fd = alg_new(crypto->cmac_aes, key_msb, 16);
-	if (fd < 0)
-		return false;
-
 	swap_buf(msg, msg_msb, msg_len);
-	len = send(fd, msg_msb, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
+	if (!crypto_cmac(crypto, key_msb, msg_msb, msg_len, out))
 		return false;
-	}
 
 	swap_buf(out, res, 16);
 
-	close(fd);
-
 	return true;
 }
 
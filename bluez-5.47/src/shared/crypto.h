@@ -22,6 +22,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct bt_crypto;
@@ -38,6 +39,15 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t plaintext[16], uint8_t encrypted[16]);
 bool bt_crypto_ah(struct bt_crypto *crypto, const uint8_t k[16],
 					const uint8_t r[3], uint8_t hash[3]);
+
+struct bt_crypto_ah_keys;
+
+struct bt_crypto_ah_keys *bt_crypto_ah_keys_new(struct bt_crypto *crypto,
+					const uint8_t (*k)[16], size_t count);
+void bt_crypto_ah_keys_free(struct bt_crypto_ah_keys *keys);
+int bt_crypto_ah_resolve(struct bt_crypto *crypto,
+				const struct bt_crypto_ah_keys *keys,
+				const uint8_t r[3], const uint8_t hash[3]);
 bool bt_crypto_c1(struct bt_crypto *crypto, const uint8_t k[16],
 			const uint8_t r[16], const uint8_t pres[7],
 			const uint8_t preq[7], uint8_t iat,
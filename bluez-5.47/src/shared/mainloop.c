@@ -0,0 +1,511 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2011-2014  Intel Corporation
+ *  Copyright (C) 2002-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+
+#include "src/shared/mainloop.h"
+
+#define MAX_EPOLL_EVENTS 64
+
+static int epoll_fd = -1;
+static int epoll_terminate;
+static int exit_status;
+
+struct mainloop_data {
+	int fd;
+	uint32_t events;
+	mainloop_event_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+	struct mainloop_data *next;
+};
+
+/* Watches indexed by fd, grown as larger fds are added */
+static struct mainloop_data **mainloop_list;
+static unsigned int mainloop_size;
+
+/* Watches removed while events are being dispatched; the event array may
+ * still point at them, so they are only freed once the batch is done */
+static struct mainloop_data *mainloop_dead;
+static bool dispatching;
+
+struct timeout_data {
+	int fd;
+	mainloop_timeout_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+};
+
+struct signal_data {
+	int fd;
+	sigset_t mask;
+	mainloop_signal_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+};
+
+static struct signal_data *signal_data;
+
+void mainloop_init(void)
+{
+	if (epoll_fd < 0)
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	epoll_terminate = 0;
+	exit_status = EXIT_SUCCESS;
+}
+
+void mainloop_quit(void)
+{
+	epoll_terminate = 1;
+}
+
+void mainloop_exit_success(void)
+{
+	exit_status = EXIT_SUCCESS;
+	epoll_terminate = 1;
+}
+
+void mainloop_exit_failure(void)
+{
+	exit_status = EXIT_FAILURE;
+	epoll_terminate = 1;
+}
+
+static void release_data(struct mainloop_data *data)
+{
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	data->callback = NULL;
+
+	if (dispatching) {
+		data->next = mainloop_dead;
+		mainloop_dead = data;
+	} else
+		free(data);
+}
+
+static void free_dead(void)
+{
+	while (mainloop_dead) {
+		struct mainloop_data *data = mainloop_dead;
+
+		mainloop_dead = data->next;
+		free(data);
+	}
+}
+
+int mainloop_run(void)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	unsigned int i;
+
+	if (epoll_fd < 0)
+		return -EBADF;
+
+	if (signal_data) {
+		if (sigprocmask(SIG_BLOCK, &signal_data->mask, NULL) < 0)
+			return EXIT_FAILURE;
+	}
+
+	while (!epoll_terminate) {
+		int n, nfds;
+
+		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		dispatching = true;
+
+		for (n = 0; n < nfds; n++) {
+			struct mainloop_data *data = events[n].data.ptr;
+
+			/* Removed by an earlier callback in this batch */
+			if (!data->callback)
+				continue;
+
+			data->callback(data->fd, events[n].events,
+							data->user_data);
+		}
+
+		dispatching = false;
+		free_dead();
+	}
+
+	if (signal_data) {
+		sigprocmask(SIG_UNBLOCK, &signal_data->mask, NULL);
+		signal_data = NULL;
+	}
+
+	for (i = 0; i < mainloop_size; i++) {
+		struct mainloop_data *data = mainloop_list[i];
+
+		if (!data)
+			continue;
+
+		mainloop_list[i] = NULL;
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+		release_data(data);
+	}
+
+	free(mainloop_list);
+	mainloop_list = NULL;
+	mainloop_size = 0;
+
+	close(epoll_fd);
+	epoll_fd = -1;
+
+	return exit_status;
+}
+
+static bool grow_list(int fd)
+{
+	struct mainloop_data **list;
+	unsigned int size = mainloop_size ? mainloop_size : 64;
+
+	while (size <= (unsigned int) fd)
+		size *= 2;
+
+	if (size == mainloop_size)
+		return true;
+
+	list = realloc(mainloop_list, size * sizeof(*list));
+	if (!list)
+		return false;
+
+	memset(list + mainloop_size, 0,
+			(size - mainloop_size) * sizeof(*list));
+	mainloop_list = list;
+	mainloop_size = size;
+
+	return true;
+}
+
+int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct mainloop_data *data;
+	struct epoll_event ev;
+	int err;
+
+	if (fd < 0 || !callback)
+		return -EINVAL;
+
+	if (epoll_fd < 0)
+		return -EBADF;
+
+	if (!grow_list(fd))
+		return -ENOMEM;
+
+	data = malloc(sizeof(*data));
+	if (!data)
+		return -ENOMEM;
+
+	memset(data, 0, sizeof(*data));
+	data->fd = fd;
+	data->events = events;
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = data;
+
+	err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
+	if (err < 0) {
+		err = -errno;
+		free(data);
+		return err;
+	}
+
+	/* The kernel forgets an fd when it is closed, so an entry still
+	 * here belongs to a descriptor closed without being removed */
+	if (mainloop_list[fd])
+		release_data(mainloop_list[fd]);
+
+	mainloop_list[fd] = data;
+
+	return 0;
+}
+
+int mainloop_modify_fd(int fd, uint32_t events)
+{
+	struct mainloop_data *data;
+	struct epoll_event ev;
+	int err;
+
+	if (fd < 0 || (unsigned int) fd >= mainloop_size)
+		return -EINVAL;
+
+	data = mainloop_list[fd];
+	if (!data)
+		return -ENXIO;
+
+	if (data->events == events)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = data;
+
+	err = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
+	if (err < 0)
+		return -errno;
+
+	data->events = events;
+
+	return 0;
+}
+
+int mainloop_remove_fd(int fd)
+{
+	struct mainloop_data *data;
+	int err;
+
+	if (fd < 0 || (unsigned int) fd >= mainloop_size)
+		return -EINVAL;
+
+	data = mainloop_list[fd];
+	if (!data)
+		return -ENXIO;
+
+	mainloop_list[fd] = NULL;
+
+	err = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+
+	release_data(data);
+
+	return err < 0 ? -errno : 0;
+}
+
+static void timeout_destroy(void *user_data)
+{
+	struct timeout_data *data = user_data;
+
+	close(data->fd);
+	data->fd = -1;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	free(data);
+}
+
+static void timeout_callback(int fd, uint32_t events, void *user_data)
+{
+	struct timeout_data *data = user_data;
+	uint64_t expired;
+	ssize_t result;
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		return;
+
+	result = read(data->fd, &expired, sizeof(expired));
+	if (result != sizeof(expired))
+		return;
+
+	if (data->callback)
+		data->callback(data->fd, data->user_data);
+}
+
+static inline int timeout_set(int fd, unsigned int msec)
+{
+	struct itimerspec itimer;
+	unsigned int sec = msec / 1000;
+
+	memset(&itimer, 0, sizeof(itimer));
+	itimer.it_value.tv_sec = sec;
+	itimer.it_value.tv_nsec = (msec - (sec * 1000)) * 1000 * 1000;
+
+	/* A zero it_value disarms the timer; make it due at once instead */
+	if (!msec)
+		itimer.it_value.tv_nsec = 1;
+
+	return timerfd_settime(fd, 0, &itimer, NULL);
+}
+
+int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct timeout_data *data;
+
+	if (!callback)
+		return -EINVAL;
+
+	data = malloc(sizeof(*data));
+	if (!data)
+		return -ENOMEM;
+
+	memset(data, 0, sizeof(*data));
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	data->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (data->fd < 0) {
+		free(data);
+		return -EIO;
+	}
+
+	if (timeout_set(data->fd, msec) < 0) {
+		close(data->fd);
+		free(data);
+		return -EIO;
+	}
+
+	if (mainloop_add_fd(data->fd, EPOLLIN | EPOLLONESHOT,
+				timeout_callback, data, timeout_destroy) < 0) {
+		close(data->fd);
+		free(data);
+		return -EIO;
+	}
+
+	return data->fd;
+}
+
+int mainloop_modify_timeout(int id, unsigned int msec)
+{
+	struct mainloop_data *data;
+	struct epoll_event ev;
+
+	if (id < 0 || (unsigned int) id >= mainloop_size)
+		return -EINVAL;
+
+	data = mainloop_list[id];
+	if (!data)
+		return -ENXIO;
+
+	if (timeout_set(id, msec) < 0)
+		return -EIO;
+
+	/* Re-arm the one-shot watch along with the timer */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = data->events;
+	ev.data.ptr = data;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, id, &ev) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int mainloop_remove_timeout(int id)
+{
+	return mainloop_remove_fd(id);
+}
+
+static void signal_destroy(void *user_data)
+{
+	struct signal_data *data = user_data;
+
+	close(data->fd);
+	data->fd = -1;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	if (data == signal_data)
+		signal_data = NULL;
+
+	free(data);
+}
+
+static void signal_callback(int fd, uint32_t events, void *user_data)
+{
+	struct signal_data *data = user_data;
+	struct signalfd_siginfo si;
+	ssize_t result;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		mainloop_quit();
+		return;
+	}
+
+	result = read(fd, &si, sizeof(si));
+	if (result != sizeof(si))
+		return;
+
+	if (data->callback)
+		data->callback(si.ssi_signo, data->user_data);
+}
+
+int mainloop_set_signal(sigset_t *mask, mainloop_signal_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct signal_data *data;
+	int fd;
+
+	if (!mask || !callback)
+		return -EINVAL;
+
+	if (signal_data)
+		return -EALREADY;
+
+	data = malloc(sizeof(*data));
+	if (!data)
+		return -ENOMEM;
+
+	memset(data, 0, sizeof(*data));
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+	memcpy(&data->mask, mask, sizeof(sigset_t));
+
+	fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		free(data);
+		return -errno;
+	}
+
+	data->fd = fd;
+
+	if (mainloop_add_fd(fd, EPOLLIN, signal_callback,
+					data, signal_destroy) < 0) {
+		close(fd);
+		free(data);
+		return -EIO;
+	}
+
+	signal_data = data;
+
+	return 0;
+}
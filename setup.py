@@ -24,6 +24,11 @@ def pre_install():
         print("Return code was %d" % e.returncode)
         print("Output was:\n%s" % e.output)
         sys.exit(1)
+    try:
+        # The in-process helper is optional: without it btle.py runs bluepy-helper
+        subprocess.check_output(shlex.split("make -C bluepy extension"), stderr=subprocess.STDOUT)
+    except (subprocess.CalledProcessError, OSError):
+        print("Not building the _bluepy extension (needs the Python headers)")
 
 class my_build_py(build_py):
     def run(self):
@@ -67,7 +72,8 @@ setup (
     packages=['bluepy'],
     
     package_data={
-        'bluepy': ['bluepy-helper', '*.json', 'bluez-src.tgz', 'bluepy-helper.c', 'version.h', 'Makefile']
+        'bluepy': ['bluepy-helper', '*.json', 'bluez-src.tgz', 'bluepy-helper.c', 'version.h', 'Makefile',
+                   '_bluepy.c', '_bluepy*.so']
     },
     cmdclass=setup_cmdclass,
     entry_points={
@@ -0,0 +1,235 @@
+"""
+Test the bluepy-helper protocol encoding in `btle.py`
+
+Run with:
+    $ python -m unittest this_file.py
+"""
+
+import asyncio
+import os
+import struct
+import tempfile
+import unittest
+
+from bluepy import btle
+from bluepy.aio import AsyncPeripheral
+from bluepy.btle import BluepyHelper, Peripheral, Scanner
+
+def field(tag, vtype, val):
+    tag = tag.encode('utf-8')
+    hdr = struct.pack('<B', len(tag)) + tag + vtype
+    if vtype == b'h':
+        return hdr + struct.pack('<I', val)
+    return hdr + struct.pack('<H', len(val)) + val
+
+class TestProtocol(unittest.TestCase):
+    def test_format_cmd(self):
+        self.assertEqual(BluepyHelper.formatCmd(("stat",)), "stat\n")
+        self.assertEqual(BluepyHelper.formatCmd(("rd", 0x2A)), "rd 2A\n")
+        self.assertEqual(BluepyHelper.formatCmd(("wr", 0x10, b'\x01\xff')), "wr 10 01ff\n")
+
+    def test_encode_cmd(self):
+        frame = BluepyHelper.encodeCmd(("wr", 0x100, b'\x00\x01'))
+        self.assertEqual(frame, b'\x0c\x00\x00\x00' +
+                                b'\x02\x00wr' + b'\x02\x00\x00\x01' + b'\x02\x00\x00\x01')
+
+    def test_parse_resp(self):
+        resp = BluepyHelper.parseResp("rsp=$ntfy\x1ehnd=h2A\x1ed=b0102\n")
+        self.assertEqual(resp, {'rsp': ['ntfy'], 'hnd': [0x2A], 'd': [b'\x01\x02']})
+
+    def test_parse_frame(self):
+        frame = (field('rsp', b'$', b'find') +
+                 field('hstart', b'h', 1) + field('uuid', b"'", b'1800') +
+                 field('hstart', b'h', 0x10) + field('d', b'b', b'\x00\x1e'))
+        resp = BluepyHelper.parseFrame(frame)
+        self.assertEqual(resp, {'rsp': ['find'], 'hstart': [1, 0x10],
+                                'uuid': ['1800'], 'd': [b'\x00\x1e']})
+
+    def test_split_scan_resp(self):
+        resp = BluepyHelper.parseResp("rsp=$scan\x1eaddr=b0A0B0C0D0E0F\x1etype=h1\x1erssi=h3C\x1eflag=h0\x1ed=b020106"
+                                      "\x1eaddr=b111213141516\x1etype=h2\x1erssi=h50\x1eflag=h4\x1ed=b\n")
+        reports = Scanner.splitScanResp(resp)
+        self.assertEqual(len(reports), 2)
+        self.assertEqual(reports[0]['d'], [b'\x02\x01\x06'])
+        self.assertEqual(reports[1], {'addr': [b'\x11\x12\x13\x14\x15\x16'], 'type': [2],
+                                      'rssi': [0x50], 'flag': [4], 'd': [b'']})
+
+    def test_scan_identity(self):
+        resp = BluepyHelper.parseResp("rsp=$scan\x1eaddr=b708194DFBAA0\x1etype=h2\x1erssi=h3C\x1eflag=h0\x1ed=b"
+                                      "\x1eid=bC01122334455\x1eidtype=h2"
+                                      "\x1eaddr=b111213141516\x1etype=h2\x1erssi=h50\x1eflag=h4\x1ed=b"
+                                      "\x1eid=b\x1eidtype=h0\n")
+        s = Scanner()
+        devs = [s._addReport(r)[0] for r in Scanner.splitScanResp(resp)]
+        self.assertEqual((devs[0].identity, devs[0].identityType), ("c0:11:22:33:44:55", "random"))
+        self.assertEqual((devs[1].identity, devs[1].identityType), (None, None))
+
+        s.setIdentityKeys([("9b7d390aa610103405adc857a33402ec", "c0:11:22:33:44:55", "random")])
+        self.assertIn(("irks", bytes.fromhex("9b7d390aa610103405adc857a33402ec"),
+                       "c0:11:22:33:44:55", "random"), s._setupCmds())
+
+    def test_scan_setup(self):
+        s = Scanner()
+        self.assertEqual(s._setupCmds(passive=True), [("le", "on")])
+        self.assertEqual(s._setupCmds(passive=True, interval=10),
+                         [("le", "on"), ("scanparams", "type", "passive", "int", "10")])
+        # Back to the defaults
+        self.assertEqual(s._setupCmds(passive=True), [("le", "on"), ("scanparams",)])
+        self.assertEqual(s._setupCmds(passive=True), [("le", "on")])
+
+    def test_shared_helper_cids(self):
+        sent = []
+        class FakeShared(btle.SharedHelper):
+            def _startHelper(self, iface=None):
+                pass
+            def _writeCmd(self, cmd):
+                sent.append(cmd)
+
+        h = FakeShared()
+        (a, b) = (h._attach()[0], h._attach()[0])
+        h._detach(a)
+        self.assertEqual(sent, ["@%x disc\n" % a])
+        # A freed id is not handed out again straight away
+        self.assertNotIn(h._attach()[0], (a, b))
+
+    def test_addr_filter_rule(self):
+        self.assertEqual(Scanner.addrFilterRule("aa:bb:cc"),
+                         b'\xaa\xbb\xcc\0\0\0' + b'\xff\xff\xff\0\0\0')
+        self.assertEqual(Scanner.addrFilterRule("*:01:02:03:04:05"),
+                         b'\0\x01\x02\x03\x04\x05' + b'\0\xff\xff\xff\xff\xff')
+
+    def test_link_params(self):
+        self.assertEqual(Peripheral.linkCmd({'interval': 7.5, 'phy': '2m'}),
+                         ["link", "int", "6", "phy", "2m"])
+        resp = BluepyHelper.parseResp("rsp=$stat\x1estate=$conn\x1emtu=hF7\x1etxphy=h2\x1erxphy=h2"
+                                      "\x1eintv=h6\x1elat=h0\x1etmo=h1F4\n")
+        self.assertEqual(Peripheral.parseLinkInfo(resp, {'mtu': 247, 'phy': '2m'}),
+                         {'mtu': 247, 'txPhy': '2m', 'rxPhy': '2m', 'interval': 7.5,
+                          'latency': 0, 'supervisionTimeout': 5000})
+        self.assertNotIn('mtu', Peripheral.parseLinkInfo(resp, {'phy': '2m'}))
+
+    def test_notification_handler(self):
+        got = []
+        resps = []
+        class FakePeripheral(Peripheral):
+            def _sendCmd(self, *args):
+                pass
+            def _waitResp(self, wantType, timeout=None):
+                return resps.pop(0) if resps else None
+
+        p = FakePeripheral().setNotificationHandler(0x20, lambda h, v: got.append((h, v)), '<hB')
+        p._dispatchNotification(0x20, memoryview(b'\xff\xff\x07'))
+        self.assertEqual(got, [(0x20, (-1, 7))])
+
+        # A bad value met while reading is raised afterwards, not by the read
+        resps += [BluepyHelper.parseResp("rsp=$ntfy\x1ehnd=h20\x1ed=bFFFF\n"),
+                  BluepyHelper.parseResp("rsp=$rd\x1ed=b0102\n"),
+                  BluepyHelper.parseResp("rsp=$ntfy\x1ehnd=h20\x1ed=bFFFF0700\n")]
+        self.assertEqual(p.readCharacteristic(0x21), b'\x01\x02')
+        self.assertRaises(btle.BTLEGattError, p.waitForNotifications, 0)
+        self.assertRaises(btle.BTLEGattError, p.waitForNotifications, 0)
+        self.assertFalse(p.waitForNotifications(0))
+        self.assertEqual(len(got), 1)
+
+    def test_gatt_cache_needs_hash(self):
+        class FakePeripheral(Peripheral):
+            def _readDatabaseHash(self):
+                return None
+            def _sendCmd(self, *args):
+                pass
+            def _getResp(self, wantType, timeout=None):
+                return {'rsp': ['find'], 'hstart': [1], 'hend': [5], 'uuid': ['1800']}
+
+        with tempfile.TemporaryDirectory() as cacheDir:
+            btle.GattCacheDir = cacheDir
+            try:
+                p = FakePeripheral()
+                p.addr = "11:22:33:44:55:66"
+                p._loadGattCache()
+                p.discoverServices()
+                self.assertIsNone(p._gattCache)
+                self.assertEqual(os.listdir(cacheDir), [])
+            finally:
+                btle.GattCacheDir = None
+
+    def test_gatt_cache_service_changed(self):
+        sent = []
+        class FakePeripheral(Peripheral):
+            def _readDatabaseHash(self):
+                return "00"
+            def _sendCmd(self, *args):
+                sent.append(args)
+            def _getResp(self, wantType, timeout=None):
+                if wantType == 'sub':
+                    return {'rsp': ['sub'], 'hnd': [3], 'estat': [0], 'dhnd': [4]}
+                return {'rsp': ['tree'], 'hstart': [1], 'hend': [4], 'uuid': ['1801'],
+                        'hnd': [2], 'props': [0x20], 'vhnd': [3], 'cuuid': ['2a05']}
+
+        with tempfile.TemporaryDirectory() as cacheDir:
+            btle.GattCacheDir = cacheDir
+            try:
+                p = FakePeripheral()
+                p.addr = "11:22:33:44:55:66"
+                p._loadGattCache()
+                p.discoverAll()
+                self.assertEqual(p._gattCache['changed'], [3])
+                self.assertEqual(sent, [("tree",), ("sub", "ind", 3)])
+
+                # The next connection takes the tree from the cache
+                del sent[:]
+                p._loadGattCache()
+                p.discoverAll()
+                self.assertEqual(sent, [("sub", "ind", 3)])
+            finally:
+                btle.GattCacheDir = None
+
+    def test_async_indication(self):
+        class FakeHelper:
+            _binary = False
+            def _writeCmd(self, cmd):
+                sent.append(cmd)
+
+        async def run():
+            p = AsyncPeripheral(FakeHelper())
+            (p._cid, p._lock, p._notifyq) = (1, asyncio.Lock(), asyncio.Queue())
+            p._deliver(BluepyHelper.parseResp("rsp=$ind\x1ecid=h1\x1ehnd=h2A\x1ed=b01\n"))
+            rd = asyncio.ensure_future(p._command('rd', "rd", 0x10))
+            await asyncio.sleep(0)
+            p._deliver(BluepyHelper.parseResp("rsp=$ind\x1ecid=h1\x1ehnd=h2A\x1ed=b02\n"))
+            p._deliver(BluepyHelper.parseResp("rsp=$rd\x1ecid=h1\x1ed=b0304\n"))
+            rsp = await rd
+            return (rsp['d'], [p._notifyq.get_nowait() for i in range(p._notifyq.qsize())])
+
+        sent = []
+        (value, queued) = asyncio.run(run())
+        self.assertEqual(sent, ["@1 rd 10\n"])
+        self.assertEqual(value, [b'\x03\x04'])
+        self.assertEqual(queued, [(0x2A, b'\x01'), (0x2A, b'\x02')])
+
+    def test_async_disconnect(self):
+        class FakeHelper:
+            def _detach(self, cid):
+                detached.append(cid)
+
+        async def run():
+            p = AsyncPeripheral(FakeHelper())
+            (p._cid, p._lock, p._notifyq) = (1, asyncio.Lock(), asyncio.Queue())
+            it = p.notifications()
+            first = asyncio.ensure_future(it.__anext__())
+            p._deliver(BluepyHelper.parseResp("rsp=$ntfy\x1ecid=h1\x1ehnd=h2A\x1ed=b01\n"))
+            self.assertEqual(await first, (0x2A, b'\x01'))
+            rest = asyncio.ensure_future(it.__anext__())
+            await asyncio.sleep(0)
+            p._deliver(BluepyHelper.parseResp("rsp=$stat\x1ecid=h1\x1estate=$disc\n"))
+            with self.assertRaises(StopAsyncIteration):
+                await asyncio.wait_for(rest, 1)
+            return p
+
+        detached = []
+        p = asyncio.run(run())
+        self.assertEqual(detached, [1])
+        self.assertIsNone(p._cid)
+
+
+if __name__ == "__main__":
+    unittest.main()